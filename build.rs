@@ -2,10 +2,13 @@ use libbpf_cargo::SkeletonBuilder;
 use std::{env, path::PathBuf};
 
 const PROBES_SRC: &str = "src/bpf/probes.bpf.c";
+const VMA_ITER_SRC: &str = "src/bpf/vma_iter.bpf.c";
 
 const PROTOS: &[&str] = &[
     "edgebitapis/edgebit/agent/v1alpha/token_service.proto",
     "edgebitapis/edgebit/agent/v1alpha/inventory_service.proto",
+    "proto/edgebit/agent/v1alpha/usage_service.proto",
+    "proto/edgebit/agent/v1alpha/sbom_service.proto",
 ];
 
 fn build_protos() -> Result<(), Box<dyn std::error::Error>> {
@@ -21,14 +24,20 @@ fn build_protos() -> Result<(), Box<dyn std::error::Error>> {
 }
 
 fn build_bpf() -> Result<(), Box<dyn std::error::Error>> {
-    let mut out =
+    let out_dir =
         PathBuf::from(env::var_os("OUT_DIR").expect("OUT_DIR must be set in build script"));
-    out.push("probes.skel.rs");
-    SkeletonBuilder::new()
-        .source(PROBES_SRC)
-        .clang("clang")
-        .build_and_generate(&out)?;
-    println!("cargo:rerun-if-changed={PROBES_SRC}");
+
+    for (src, skel) in [
+        (PROBES_SRC, "probes.skel.rs"),
+        (VMA_ITER_SRC, "vma_iter.skel.rs"),
+    ] {
+        SkeletonBuilder::new()
+            .source(src)
+            .clang("clang")
+            .build_and_generate(out_dir.join(skel))?;
+        println!("cargo:rerun-if-changed={src}");
+    }
+
     Ok(())
 }
 
@@ -0,0 +1,168 @@
+use std::convert::Infallible;
+use std::net::SocketAddr;
+use std::sync::Arc;
+
+use anyhow::{anyhow, Result};
+use chrono::NaiveDate;
+use hyper::service::{make_service_fn, service_fn};
+use hyper::{Body, Method, Request, Response, Server, StatusCode};
+use log::*;
+use serde_json::json;
+
+use crate::alloc_stats;
+use crate::backoff;
+use crate::startup::StartupProfileArc;
+use crate::store::InUseStoreArc;
+
+// How far back the in-use queries look by default
+const DEFAULT_DAYS: u32 = 7;
+
+// State exposed by the local admin HTTP interface
+pub struct Admin {
+    pub store: Option<InUseStoreArc>,
+    pub startup: StartupProfileArc,
+}
+
+pub async fn serve(addr: SocketAddr, admin: Arc<Admin>) -> Result<()> {
+    let make_svc = make_service_fn(move |_| {
+        let admin = admin.clone();
+        async move {
+            Ok::<_, Infallible>(service_fn(move |req| {
+                let admin = admin.clone();
+                async move { Ok::<_, Infallible>(handle(&admin, req)) }
+            }))
+        }
+    });
+
+    let server = Server::try_bind(&addr)
+        .map_err(|err| anyhow!("Failed to bind admin interface to {addr}: {err}"))?
+        .serve(make_svc);
+
+    info!("Admin interface listening on {addr}");
+    server.await?;
+    Ok(())
+}
+
+fn handle(admin: &Admin, req: Request<Body>) -> Response<Body> {
+    let query = req.uri().query();
+
+    // The only binary response, decoded with --decode-flight-record
+    if req.method() == Method::GET && req.uri().path() == "/v1/flight-recorder" {
+        return match crate::flight::dump() {
+            Some(dump) => Response::builder()
+                .header("content-type", "application/octet-stream")
+                .body(Body::from(dump))
+                .unwrap(),
+            None => Response::builder()
+                .status(StatusCode::NOT_FOUND)
+                .body(Body::from("flight recorder is disabled"))
+                .unwrap(),
+        };
+    }
+
+    let result = match (req.method(), req.uri().path()) {
+        (&Method::GET, "/v1/workloads") => workloads(admin, query),
+        (&Method::GET, "/v1/in-use") => in_use(admin, query),
+        (&Method::GET, "/v1/startup") => Ok(admin.startup.to_json()),
+        (&Method::GET, "/v1/alloc-stats") => alloc_stats(),
+        (&Method::GET, "/v1/connections") => Ok(backoff::to_json()),
+        _ => Err((StatusCode::NOT_FOUND, "not found".to_string())),
+    };
+
+    match result {
+        Ok(body) => Response::builder()
+            .header("content-type", "application/json")
+            .body(Body::from(body.to_string()))
+            .unwrap(),
+        Err((status, msg)) => {
+            debug!("admin: {} {}: {msg}", req.method(), req.uri());
+            Response::builder()
+                .status(status)
+                .body(Body::from(msg))
+                .unwrap()
+        }
+    }
+}
+
+type HandlerResult = std::result::Result<serde_json::Value, (StatusCode, String)>;
+
+fn workloads(admin: &Admin, query: Option<&str>) -> HandlerResult {
+    let store = store(admin)?;
+    let days = days_param(query)?;
+
+    let workloads = store.lock().unwrap().workloads(days).map_err(internal)?;
+
+    Ok(json!({ "workloads": workloads }))
+}
+
+fn in_use(admin: &Admin, query: Option<&str>) -> HandlerResult {
+    let store = store(admin)?;
+    let days = days_param(query)?;
+
+    let workload_id = query_param(query, "workload").ok_or((
+        StatusCode::BAD_REQUEST,
+        "missing workload parameter".to_string(),
+    ))?;
+
+    let files = store
+        .lock()
+        .unwrap()
+        .in_use(workload_id, days)
+        .map_err(internal)?;
+
+    let files: Vec<_> = files
+        .into_iter()
+        .map(|(path, day)| json!({ "path": path, "last_used": format_day(day) }))
+        .collect();
+
+    Ok(json!({ "workload_id": workload_id, "files": files }))
+}
+
+fn alloc_stats() -> HandlerResult {
+    if alloc_stats::is_enabled() {
+        Ok(alloc_stats::to_json())
+    } else {
+        Err((
+            StatusCode::NOT_FOUND,
+            "built without the alloc-stats feature".to_string(),
+        ))
+    }
+}
+
+fn store(admin: &Admin) -> std::result::Result<&InUseStoreArc, (StatusCode, String)> {
+    admin
+        .store
+        .as_ref()
+        .ok_or((StatusCode::NOT_FOUND, "local store is disabled".to_string()))
+}
+
+fn days_param(query: Option<&str>) -> std::result::Result<u32, (StatusCode, String)> {
+    match query_param(query, "days") {
+        Some(days) => days
+            .parse()
+            .map_err(|_| (StatusCode::BAD_REQUEST, format!("invalid days: {days}"))),
+        None => Ok(DEFAULT_DAYS),
+    }
+}
+
+// The values are not percent-decoded, ids and numbers don't need it
+fn query_param<'a>(query: Option<&'a str>, name: &str) -> Option<&'a str> {
+    query?
+        .split('&')
+        .filter_map(|kv| kv.split_once('='))
+        .find(|(k, _)| *k == name)
+        .map(|(_, v)| v)
+}
+
+fn format_day(day: u32) -> String {
+    NaiveDate::from_ymd_opt(1970, 1, 1)
+        .unwrap()
+        .checked_add_days(chrono::Days::new(day as u64))
+        .map(|d| d.to_string())
+        .unwrap_or_default()
+}
+
+fn internal(err: anyhow::Error) -> (StatusCode, String) {
+    error!("admin: {err}");
+    (StatusCode::INTERNAL_SERVER_ERROR, err.to_string())
+}
@@ -0,0 +1,197 @@
+// Allocation accounting per stage of the event pipeline. The counting
+// allocator is only installed with the alloc-stats feature, without it
+// the stage scopes are free and there are no stats.
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use serde_json::json;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Stage {
+    Other,
+    Decode,
+    Attribution,
+    Resolve,
+    Dedup,
+    Batching,
+    RpcEncode,
+    SbomLoad,
+}
+
+const STAGES: [Stage; 8] = [
+    Stage::Other,
+    Stage::Decode,
+    Stage::Attribution,
+    Stage::Resolve,
+    Stage::Dedup,
+    Stage::Batching,
+    Stage::RpcEncode,
+    Stage::SbomLoad,
+];
+
+impl Stage {
+    fn name(self) -> &'static str {
+        match self {
+            Stage::Other => "other",
+            Stage::Decode => "decode",
+            Stage::Attribution => "attribution",
+            Stage::Resolve => "resolve",
+            Stage::Dedup => "dedup",
+            Stage::Batching => "batching",
+            Stage::RpcEncode => "rpc_encode",
+            Stage::SbomLoad => "sbom_load",
+        }
+    }
+}
+
+struct Counters {
+    allocs: AtomicU64,
+    bytes: AtomicU64,
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO: Counters = Counters {
+    allocs: AtomicU64::new(0),
+    bytes: AtomicU64::new(0),
+};
+
+static COUNTERS: [Counters; STAGES.len()] = [ZERO; STAGES.len()];
+
+// Open events decoded, the denominator of the per event numbers
+static EVENTS: AtomicU64 = AtomicU64::new(0);
+
+thread_local! {
+    // const initialized and without a destructor, so that it
+    // can be accessed from within the allocator
+    static CURRENT: Cell<Stage> = const { Cell::new(Stage::Other) };
+}
+
+pub struct CountingAlloc;
+
+unsafe impl GlobalAlloc for CountingAlloc {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        count(layout.size());
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        count(layout.size());
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        count(new_size);
+        System.realloc(ptr, layout, new_size)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+#[cfg(feature = "alloc-stats")]
+#[global_allocator]
+static GLOBAL: CountingAlloc = CountingAlloc;
+
+fn count(size: usize) {
+    // The thread local is gone while the thread exits
+    let stage = CURRENT.try_with(|s| s.get()).unwrap_or(Stage::Other);
+
+    let counters = &COUNTERS[stage as usize];
+    counters.allocs.fetch_add(1, Ordering::Relaxed);
+    counters.bytes.fetch_add(size as u64, Ordering::Relaxed);
+}
+
+pub const fn is_enabled() -> bool {
+    cfg!(feature = "alloc-stats")
+}
+
+// Attributes the allocations of this thread to the stage until dropped.
+// Not to be held across an .await, the task may move to another thread.
+pub struct StageScope {
+    prev: Stage,
+}
+
+pub fn enter(stage: Stage) -> StageScope {
+    let prev = if is_enabled() {
+        CURRENT.with(|s| s.replace(stage))
+    } else {
+        Stage::Other
+    };
+
+    StageScope { prev }
+}
+
+impl Drop for StageScope {
+    fn drop(&mut self) {
+        if is_enabled() {
+            CURRENT.with(|s| s.set(self.prev));
+        }
+    }
+}
+
+pub fn events_decoded(n: usize) {
+    if is_enabled() {
+        EVENTS.fetch_add(n as u64, Ordering::Relaxed);
+    }
+}
+
+pub fn to_json() -> serde_json::Value {
+    let events = EVENTS.load(Ordering::Relaxed);
+
+    let stages: Vec<_> = STAGES
+        .iter()
+        .map(|stage| {
+            let counters = &COUNTERS[*stage as usize];
+            let allocs = counters.allocs.load(Ordering::Relaxed);
+            let bytes = counters.bytes.load(Ordering::Relaxed);
+
+            json!({
+                "stage": stage.name(),
+                "allocs": allocs,
+                "bytes": bytes,
+                "allocs_per_event": per_event(allocs, events),
+                "bytes_per_event": per_event(bytes, events),
+            })
+        })
+        .collect();
+
+    json!({ "events": events, "stages": stages })
+}
+
+fn per_event(n: u64, events: u64) -> Option<f64> {
+    (events > 0).then(|| n as f64 / events as f64)
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+
+    #[test]
+    fn test_stage_scope() {
+        let _outer = enter(Stage::Resolve);
+        {
+            let _inner = enter(Stage::Dedup);
+            if is_enabled() {
+                assert!(CURRENT.with(|s| s.get()) == Stage::Dedup);
+            }
+        }
+
+        if is_enabled() {
+            assert!(CURRENT.with(|s| s.get()) == Stage::Resolve);
+
+            let before = COUNTERS[Stage::Resolve as usize]
+                .allocs
+                .load(Ordering::Relaxed);
+            std::hint::black_box(vec![0u8; 100]);
+            let after = COUNTERS[Stage::Resolve as usize]
+                .allocs
+                .load(Ordering::Relaxed);
+            assert!(after > before);
+        }
+    }
+}
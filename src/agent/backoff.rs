@@ -0,0 +1,218 @@
+// Retry policy shared by the connections to EdgeBit (enrollment, session
+// refresh, reports) and to the container runtimes: exponential backoff with
+// full jitter, capped, stretched by the retry hints of the server. The
+// state of each connection is served by the admin interface.
+
+use std::collections::BTreeMap;
+use std::fmt::Display;
+use std::sync::{Arc, Mutex, OnceLock};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use rand::Rng;
+use serde_json::json;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum ConnState {
+    // No attempt completed yet
+    Connecting,
+    Connected,
+    BackingOff,
+}
+
+impl ConnState {
+    fn name(self) -> &'static str {
+        match self {
+            ConnState::Connecting => "connecting",
+            ConnState::Connected => "connected",
+            ConnState::BackingOff => "backing_off",
+        }
+    }
+}
+
+struct Status {
+    state: ConnState,
+    // Since the last success
+    failures: u32,
+    failures_total: u64,
+    last_error: Option<String>,
+    retry_at: Option<SystemTime>,
+}
+
+type StatusArc = Arc<Mutex<Status>>;
+
+// name -> status, the backoffs of the same name share it
+static REGISTRY: OnceLock<Mutex<BTreeMap<String, StatusArc>>> = OnceLock::new();
+
+fn registered(name: &str) -> StatusArc {
+    let registry = REGISTRY.get_or_init(|| Mutex::new(BTreeMap::new()));
+
+    registry
+        .lock()
+        .unwrap()
+        .entry(name.to_string())
+        .or_insert_with(|| {
+            Arc::new(Mutex::new(Status {
+                state: ConnState::Connecting,
+                failures: 0,
+                failures_total: 0,
+                last_error: None,
+                retry_at: None,
+            }))
+        })
+        .clone()
+}
+
+pub struct Backoff {
+    base: Duration,
+    cap: Duration,
+    failures: u32,
+    next_attempt: Option<Instant>,
+    status: StatusArc,
+}
+
+impl Backoff {
+    // The first retry is within base, doubling up to cap
+    pub fn new(name: &str, base: Duration, cap: Duration) -> Self {
+        Self {
+            base,
+            cap,
+            failures: 0,
+            next_attempt: None,
+            status: registered(name),
+        }
+    }
+
+    // Records a failed attempt and returns how long to wait before the next one.
+    // A retry hint from the server is a lower bound on the wait.
+    pub fn failed(&mut self, err: &dyn Display, retry_after: Option<Duration>) -> Duration {
+        self.failures = self.failures.saturating_add(1);
+
+        let delay = full_jitter(self.base, self.cap, self.failures);
+        let delay = match retry_after {
+            Some(hint) => delay.max(hint),
+            None => delay,
+        };
+
+        self.next_attempt = Some(Instant::now() + delay);
+
+        let mut status = self.status.lock().unwrap();
+        status.state = ConnState::BackingOff;
+        status.failures = self.failures;
+        status.failures_total += 1;
+        status.last_error = Some(err.to_string());
+        status.retry_at = Some(SystemTime::now() + delay);
+
+        delay
+    }
+
+    // Records a failed attempt and waits it out
+    pub async fn retry(&mut self, err: &dyn Display, retry_after: Option<Duration>) {
+        let delay = self.failed(err, retry_after);
+        tokio::time::sleep(delay).await;
+    }
+
+    pub fn succeeded(&mut self) {
+        self.failures = 0;
+        self.next_attempt = None;
+
+        let mut status = self.status.lock().unwrap();
+        status.state = ConnState::Connected;
+        status.failures = 0;
+        status.retry_at = None;
+    }
+
+    // For the callers that skip an attempt rather than wait for it
+    pub fn ready(&self) -> bool {
+        self.next_attempt
+            .map_or(true, |next| Instant::now() >= next)
+    }
+
+    pub fn failures(&self) -> u32 {
+        self.failures
+    }
+}
+
+// Uniform in [0, min(cap, base * 2^(failures-1))]
+fn full_jitter(base: Duration, cap: Duration, failures: u32) -> Duration {
+    let exp = failures.saturating_sub(1).min(31);
+    let ceiling = base.saturating_mul(1 << exp).min(cap);
+
+    let millis = ceiling.as_millis() as u64;
+    Duration::from_millis(rand::thread_rng().gen_range(0..=millis))
+}
+
+pub fn to_json() -> serde_json::Value {
+    let Some(registry) = REGISTRY.get() else {
+        return json!({});
+    };
+
+    let registry = registry.lock().unwrap();
+    let conns: serde_json::Map<_, _> = registry
+        .iter()
+        .map(|(name, status)| {
+            let status = status.lock().unwrap();
+            let retry_at = status
+                .retry_at
+                .map(|t| t.duration_since(UNIX_EPOCH).unwrap_or_default().as_secs());
+
+            let value = json!({
+                "state": status.state.name(),
+                "failures": status.failures,
+                "failures_total": status.failures_total,
+                "last_error": status.last_error,
+                "retry_at": retry_at,
+            });
+
+            (name.clone(), value)
+        })
+        .collect();
+
+    serde_json::Value::Object(conns)
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+
+    #[test]
+    fn test_full_jitter() {
+        let base = Duration::from_secs(1);
+        let cap = Duration::from_secs(60);
+
+        for failures in 1..40 {
+            let ceiling = base.saturating_mul(1 << (failures - 1).min(31)).min(cap);
+            for _ in 0..100 {
+                assert!(full_jitter(base, cap, failures) <= ceiling);
+            }
+        }
+
+        // Spread out, not in lockstep
+        let delays: std::collections::HashSet<_> =
+            (0..100).map(|_| full_jitter(base, cap, 10)).collect();
+        assert!(delays.len() > 10);
+    }
+
+    #[test]
+    fn test_backoff_state() {
+        let mut backoff = Backoff::new("test", Duration::from_secs(1), Duration::from_secs(60));
+        assert!(backoff.ready());
+
+        let hint = Duration::from_secs(30);
+        let delay = backoff.failed(&"unavailable", Some(hint));
+        assert!(delay >= hint);
+        assert!(!backoff.ready());
+        assert!(backoff.failures() == 1);
+
+        let json = to_json();
+        assert!(json["test"]["state"] == "backing_off");
+        assert!(json["test"]["last_error"] == "unavailable");
+
+        backoff.succeeded();
+        assert!(backoff.ready());
+        assert!(backoff.failures() == 0);
+        assert!(to_json()["test"]["state"] == "connected");
+        assert!(to_json()["test"]["failures_total"] == 1);
+    }
+}
@@ -0,0 +1,455 @@
+use std::collections::HashMap;
+use std::fs::{File, Metadata};
+use std::io::Read;
+use std::num::NonZeroUsize;
+use std::os::unix::fs::{FileExt, MetadataExt};
+use std::path::Path;
+use std::sync::mpsc::{Receiver, SyncSender, TrySendError};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+use anyhow::{anyhow, Result};
+use log::*;
+use lru::LruCache;
+use sha2::{Digest, Sha256};
+
+use crate::file_type::code_suffix;
+use crate::scoped_path::*;
+
+// Only this much of the file is read to look for the build-id note.
+// Linkers place the notes right after the program headers.
+const HEADER_READ_SIZE: usize = 64 * 1024;
+
+// Files without a build-id are identified by a hash of their size
+// and up to this many leading bytes
+const CONTENT_HASH_SIZE: u64 = 1024 * 1024;
+
+// Files identified per second by the background worker
+const IDENTIFY_RATE: u32 = 20;
+
+const QUEUE_SIZE: usize = 1024;
+
+const CACHE_SIZE: NonZeroUsize = unsafe { NonZeroUsize::new_unchecked(8192) };
+
+// Suffixes of the files that can be ELF, extensionless files are always candidates
+const ELF_SUFFIXES: &[&str] = &["so", "node"];
+
+const PT_NOTE: u32 = 4;
+const NT_GNU_BUILD_ID: u32 = 3;
+
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub enum BinaryId {
+    // .note.gnu.build-id
+    BuildId(Vec<u8>),
+
+    // SHA-256 of the file size (u64, little endian) followed by its first CONTENT_HASH_SIZE bytes
+    ContentHash(Vec<u8>),
+}
+
+pub struct IdentifiedBinary {
+    pub path: WorkloadPath,
+    pub id: BinaryId,
+}
+
+struct Job {
+    workload_id: String,
+    root: RootFsPath,
+    path: WorkloadPath,
+}
+
+// (dev, ino, mtime)
+type CacheKey = (u64, u64, i64);
+
+// Identifies the binaries (executables and shared objects) by their content
+// so they can be matched even when no package owns them. The work is done on
+// a low priority thread at a limited rate, files are dropped if it falls behind.
+pub struct BinaryIdentifier {
+    jobs: SyncSender<Job>,
+
+    // workload id -> identified binaries
+    results: Arc<Mutex<HashMap<String, Vec<IdentifiedBinary>>>>,
+}
+
+pub type BinaryIdentifierArc = Arc<BinaryIdentifier>;
+
+impl BinaryIdentifier {
+    pub fn start() -> Result<Self> {
+        let (tx, rx) = std::sync::mpsc::sync_channel(QUEUE_SIZE);
+        let results = Arc::new(Mutex::new(HashMap::new()));
+
+        {
+            let results = results.clone();
+            std::thread::Builder::new()
+                .name("binary-id".to_string())
+                .spawn(move || worker(rx, results))
+                .map_err(|err| anyhow!("Failed to start binary-id worker: {err}"))?;
+        }
+
+        Ok(Self { jobs: tx, results })
+    }
+
+    // Queues up a first seen file of a workload
+    pub fn submit(&self, workload_id: &str, root: &RootFsPath, path: &WorkloadPath) {
+        if !is_candidate(path.as_raw()) {
+            return;
+        }
+
+        let job = Job {
+            workload_id: workload_id.to_string(),
+            root: root.clone(),
+            path: path.clone(),
+        };
+
+        match self.jobs.try_send(job) {
+            Ok(_) => (),
+            Err(TrySendError::Full(job)) => {
+                debug!("binary-id queue full, skipping {}", job.path.display())
+            }
+            Err(TrySendError::Disconnected(_)) => error!("binary-id worker is gone"),
+        }
+    }
+
+    pub fn flush(&self) -> HashMap<String, Vec<IdentifiedBinary>> {
+        std::mem::take(&mut *self.results.lock().unwrap())
+    }
+}
+
+fn is_candidate(path: &Path) -> bool {
+    match code_suffix(path) {
+        Some(suffix) => ELF_SUFFIXES.contains(&suffix),
+        None => true,
+    }
+}
+
+fn worker(rx: Receiver<Job>, results: Arc<Mutex<HashMap<String, Vec<IdentifiedBinary>>>>) {
+    lower_priority("binary-id worker");
+
+    let mut cache = LruCache::<CacheKey, Option<BinaryId>>::new(CACHE_SIZE);
+    let interval = Duration::from_secs(1) / IDENTIFY_RATE;
+    let mut last = Instant::now();
+
+    while let Ok(job) = rx.recv() {
+        let rootfs_path = job.path.to_rootfs(&job.root);
+
+        let md = match std::fs::metadata(rootfs_path.as_raw()) {
+            Ok(md) if md.is_file() => md,
+            _ => continue,
+        };
+
+        let key = (md.dev(), md.ino(), md.mtime());
+
+        let id = match cache.get(&key) {
+            Some(id) => id.clone(),
+            None => {
+                // Only the actual work is rate limited, not the cache hits
+                let elapsed = last.elapsed();
+                if elapsed < interval {
+                    std::thread::sleep(interval - elapsed);
+                }
+                last = Instant::now();
+
+                let id = match identify(rootfs_path.as_raw(), &md) {
+                    Ok(id) => id,
+                    Err(err) => {
+                        debug!("Failed to identify {}: {err}", rootfs_path.display());
+                        None
+                    }
+                };
+
+                cache.put(key, id.clone());
+                id
+            }
+        };
+
+        if let Some(id) = id {
+            trace!("{}: {id:?}", job.path.display());
+
+            results
+                .lock()
+                .unwrap()
+                .entry(job.workload_id)
+                .or_default()
+                .push(IdentifiedBinary { path: job.path, id });
+        }
+    }
+}
+
+pub(crate) fn lower_priority(what: &str) {
+    let tid = nix::unistd::gettid().as_raw() as nix::libc::id_t;
+
+    // Per thread on Linux
+    if unsafe { nix::libc::setpriority(nix::libc::PRIO_PROCESS, tid, 19) } != 0 {
+        debug!(
+            "Failed to lower {what} priority: {}",
+            std::io::Error::last_os_error()
+        );
+    }
+}
+
+// Returns None if the file is not an ELF
+fn identify(path: &Path, md: &Metadata) -> Result<Option<BinaryId>> {
+    let file = File::open(path)?;
+
+    // Read rather than mapped, the file may get truncated (e.g. replaced by a
+    // package upgrade) under the SIGBUS of an access to a mapping past its end
+    let mut header = vec![0; std::cmp::min(md.len() as usize, HEADER_READ_SIZE)];
+    let len = read_at_most(&file, &mut header)?;
+    header.truncate(len);
+
+    if !header.starts_with(b"\x7fELF") {
+        return Ok(None);
+    }
+
+    if let Some(id) = build_id(&header) {
+        return Ok(Some(BinaryId::BuildId(id)));
+    }
+
+    Ok(Some(BinaryId::ContentHash(content_hash(file, md.len())?)))
+}
+
+// Reads from the start of the file until buf is full or the end of the file,
+// returns the number of bytes read
+fn read_at_most(file: &File, buf: &mut [u8]) -> std::io::Result<usize> {
+    let mut len = 0;
+
+    while len < buf.len() {
+        match file.read_at(&mut buf[len..], len as u64) {
+            Ok(0) => break,
+            Ok(n) => len += n,
+            Err(err) if err.kind() == std::io::ErrorKind::Interrupted => (),
+            Err(err) => return Err(err),
+        }
+    }
+
+    Ok(len)
+}
+
+fn content_hash(file: File, size: u64) -> Result<Vec<u8>> {
+    let mut hasher = Sha256::new();
+    hasher.update(size.to_le_bytes());
+
+    let mut buf = Vec::new();
+    file.take(CONTENT_HASH_SIZE).read_to_end(&mut buf)?;
+    hasher.update(&buf);
+
+    Ok(hasher.finalize().to_vec())
+}
+
+// Reads integers of the ELF's class and endianness
+struct ElfReader<'a> {
+    data: &'a [u8],
+    is64: bool,
+    le: bool,
+}
+
+impl ElfReader<'_> {
+    fn u16(&self, off: usize) -> Option<u16> {
+        let b: [u8; 2] = self.data.get(off..off + 2)?.try_into().ok()?;
+        Some(if self.le {
+            u16::from_le_bytes(b)
+        } else {
+            u16::from_be_bytes(b)
+        })
+    }
+
+    fn u32(&self, off: usize) -> Option<u32> {
+        let b: [u8; 4] = self.data.get(off..off + 4)?.try_into().ok()?;
+        Some(if self.le {
+            u32::from_le_bytes(b)
+        } else {
+            u32::from_be_bytes(b)
+        })
+    }
+
+    fn u64(&self, off: usize) -> Option<u64> {
+        let b: [u8; 8] = self.data.get(off..off + 8)?.try_into().ok()?;
+        Some(if self.le {
+            u64::from_le_bytes(b)
+        } else {
+            u64::from_be_bytes(b)
+        })
+    }
+
+    // Elf32_Addr/Elf32_Off or Elf64_Addr/Elf64_Off/Elf64_Xword
+    fn word(&self, off: usize) -> Option<usize> {
+        if self.is64 {
+            self.u64(off).map(|v| v as usize)
+        } else {
+            self.u32(off).map(|v| v as usize)
+        }
+    }
+}
+
+// Finds NT_GNU_BUILD_ID in the PT_NOTE segments that are within the data
+fn build_id(data: &[u8]) -> Option<Vec<u8>> {
+    let elf = ElfReader {
+        data,
+        is64: *data.get(4)? == 2,
+        le: *data.get(5)? == 1,
+    };
+
+    let (phoff, phentsize, phnum) = if elf.is64 {
+        (elf.word(0x20)?, elf.u16(0x36)?, elf.u16(0x38)?)
+    } else {
+        (elf.word(0x1c)?, elf.u16(0x2a)?, elf.u16(0x2c)?)
+    };
+
+    for i in 0..phnum as usize {
+        let ph = phoff.checked_add(i.checked_mul(phentsize as usize)?)?;
+        if elf.u32(ph)? != PT_NOTE {
+            continue;
+        }
+
+        let (offset, filesz, align) = if elf.is64 {
+            (
+                elf.word(ph + 0x08)?,
+                elf.word(ph + 0x20)?,
+                elf.word(ph + 0x30)?,
+            )
+        } else {
+            (
+                elf.word(ph + 0x04)?,
+                elf.word(ph + 0x10)?,
+                elf.word(ph + 0x1c)?,
+            )
+        };
+
+        let end = offset.checked_add(filesz)?;
+        if end > data.len() {
+            continue;
+        }
+
+        let align = if align == 8 { 8 } else { 4 };
+        if let Some(id) = find_build_id_note(&elf, offset, end, align) {
+            return Some(id);
+        }
+    }
+
+    None
+}
+
+fn find_build_id_note(
+    elf: &ElfReader,
+    mut pos: usize,
+    end: usize,
+    align: usize,
+) -> Option<Vec<u8>> {
+    let pad = |n: usize| (n + align - 1) & !(align - 1);
+
+    while pos + 12 <= end {
+        let namesz = elf.u32(pos)? as usize;
+        let descsz = elf.u32(pos + 4)? as usize;
+        let typ = elf.u32(pos + 8)?;
+
+        let name = pos + 12;
+        let desc = name.checked_add(pad(namesz))?;
+        let next = desc.checked_add(pad(descsz))?;
+
+        if desc + descsz > end {
+            return None;
+        }
+
+        if typ == NT_GNU_BUILD_ID && elf.data.get(name..name + namesz)? == b"GNU\0" {
+            return Some(elf.data[desc..desc + descsz].to_vec());
+        }
+
+        pos = next;
+    }
+
+    None
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    // Minimal 64-bit little endian ELF with a single PT_NOTE segment
+    fn elf64_with_notes(notes: &[u8]) -> Vec<u8> {
+        let phoff = 64usize;
+        let notes_off = phoff + 56;
+
+        let mut data = vec![0u8; notes_off];
+        data[..4].copy_from_slice(b"\x7fELF");
+        data[4] = 2; // ELFCLASS64
+        data[5] = 1; // ELFDATA2LSB
+        data[0x20..0x28].copy_from_slice(&(phoff as u64).to_le_bytes());
+        data[0x36..0x38].copy_from_slice(&56u16.to_le_bytes());
+        data[0x38..0x3a].copy_from_slice(&1u16.to_le_bytes());
+
+        let ph = phoff;
+        data[ph..ph + 4].copy_from_slice(&PT_NOTE.to_le_bytes());
+        data[ph + 0x08..ph + 0x10].copy_from_slice(&(notes_off as u64).to_le_bytes());
+        data[ph + 0x20..ph + 0x28].copy_from_slice(&(notes.len() as u64).to_le_bytes());
+        data[ph + 0x30..ph + 0x38].copy_from_slice(&4u64.to_le_bytes());
+
+        data.extend_from_slice(notes);
+        data
+    }
+
+    fn note(name: &[u8], typ: u32, desc: &[u8]) -> Vec<u8> {
+        let mut n = Vec::new();
+        n.extend_from_slice(&(name.len() as u32).to_le_bytes());
+        n.extend_from_slice(&(desc.len() as u32).to_le_bytes());
+        n.extend_from_slice(&typ.to_le_bytes());
+        n.extend_from_slice(name);
+        n.resize((n.len() + 3) & !3, 0);
+        n.extend_from_slice(desc);
+        n.resize((n.len() + 3) & !3, 0);
+        n
+    }
+
+    #[test]
+    fn test_build_id() {
+        let id = [0xde, 0xad, 0xbe, 0xef, 0x01, 0x02, 0x03, 0x04];
+
+        let mut notes = note(b"GNU\0", 5, &[0u8; 12]);
+        notes.extend(note(b"GNU\0", NT_GNU_BUILD_ID, &id));
+
+        let elf = elf64_with_notes(&notes);
+        assert!(build_id(&elf) == Some(id.to_vec()));
+    }
+
+    #[test]
+    fn test_no_build_id() {
+        let elf = elf64_with_notes(&note(b"Go\0\0", 4, b"abcd"));
+        assert!(build_id(&elf) == None);
+
+        // note segment cut off
+        let elf = elf64_with_notes(&note(b"GNU\0", NT_GNU_BUILD_ID, &[1u8; 20]));
+        assert!(build_id(&elf[..elf.len() - 4]) == None);
+    }
+
+    #[test]
+    fn test_identify_truncated() {
+        let dir = TempDir::new("binary-id");
+        let path = dir.join("bin");
+
+        let id = [0xab; 20];
+        let elf = elf64_with_notes(&note(b"GNU\0", NT_GNU_BUILD_ID, &id));
+        std::fs::write(&path, &elf).unwrap();
+
+        let md = std::fs::metadata(&path).unwrap();
+        assert!(identify(&path, &md).unwrap() == Some(BinaryId::BuildId(id.to_vec())));
+
+        // Cut short after the size was taken, past the notes
+        File::options()
+            .write(true)
+            .open(&path)
+            .unwrap()
+            .set_len(64)
+            .unwrap();
+
+        let res = identify(&path, &md).unwrap();
+        assert!(matches!(res, Some(BinaryId::ContentHash(_))));
+    }
+
+    #[test]
+    fn test_is_candidate() {
+        assert!(is_candidate(Path::new("/usr/bin/kubectl")));
+        assert!(is_candidate(Path::new("/usr/lib/libssl.so.3")));
+        assert!(!is_candidate(Path::new("/usr/lib/python3/os.py")));
+    }
+}
@@ -59,6 +59,11 @@ impl CloudMetadata {
             Err(err) => debug!("azure load metadata {err}"),
         }
 
+        Self::null()
+    }
+
+    // Not running in a (known) cloud
+    pub fn null() -> Self {
         Self {
             provider: Arc::new(NullProvider),
         }
@@ -1,10 +1,17 @@
 use std::collections::HashMap;
+use std::net::SocketAddr;
 use std::path::{Path, PathBuf};
+use std::time::Duration;
 
 use anyhow::{anyhow, Result};
 use nix::NixPath;
 use serde::Deserialize;
 
+use crate::export::ExportFormat;
+use crate::open_monitor::TracingTier;
+use crate::residency::InUseEngine;
+use crate::store::{DEFAULT_STORE_DIR, DEFAULT_STORE_RETENTION_DAYS};
+
 pub const CONFIG_PATH: &str = "/etc/edgebit/config.yaml";
 
 const DEFAULT_LOG_LEVEL: &str = "info";
@@ -19,6 +26,16 @@ static DEFAULT_HOST_EXCLUDES: &[&str] = &[];
 
 static DEFAULT_CONTAINER_EXCLUDES: &[&str] = &[];
 
+static DEFAULT_IGNORE_PROCESS_NAMES: &[&str] = &["updatedb", "plocate", "mlocate"];
+
+// 2MiB worth of flight recorder records
+const DEFAULT_FLIGHT_RECORDER_SIZE: usize = 16 * 1024;
+
+const DEFAULT_MAPPINGS_INTERVAL_SECS: u64 = 10;
+
+// 1 in N file opens is reported by the converged workloads in the "sampled" tier
+const CONVERGED_SAMPLE_RATE: u32 = 16;
+
 #[derive(Default, Deserialize)]
 #[serde(deny_unknown_fields)]
 struct Inner {
@@ -53,6 +70,44 @@ struct Inner {
     host_root: Option<PathBuf>,
 
     labels: Option<HashMap<String, String>>,
+
+    ignore_process_names: Option<Vec<String>>,
+
+    ignore_process_exes: Option<Vec<String>>,
+
+    ignore_process_uids: Option<Vec<u32>>,
+
+    code_suffixes: Option<Vec<String>>,
+
+    code_suffixes_from_sbom: Option<bool>,
+
+    convergence_minutes: Option<u64>,
+
+    converged_tier: Option<String>,
+
+    binary_ids: Option<bool>,
+
+    usage_summaries: Option<bool>,
+
+    local_store: Option<bool>,
+
+    store_dir: Option<PathBuf>,
+
+    store_retention_days: Option<u32>,
+
+    admin_addr: Option<String>,
+
+    export_dir: Option<PathBuf>,
+
+    export_format: Option<String>,
+
+    startup_trace: Option<PathBuf>,
+
+    flight_recorder_size: Option<usize>,
+
+    in_use_engine: Option<String>,
+
+    mappings_interval_secs: Option<u64>,
 }
 
 // TODO: probably worth using Figment or similar to unify yaml and env vars
@@ -91,6 +146,11 @@ impl Config {
         me.try_edgebit_url()?;
         me.try_syft_path()?;
         me.try_syft_config()?;
+        me.ignore_process_uids()?;
+        me.converged_tier()?;
+        me.admin_addr()?;
+        me.export_format()?;
+        me.in_use_engine()?;
 
         Ok(me)
     }
@@ -271,6 +331,221 @@ impl Config {
             .map(|(k, v)| ("user:".to_string() + &k, v))
             .collect()
     }
+
+    pub fn ignore_process_names(&self) -> Vec<String> {
+        match env_list("EDGEBIT_IGNORE_PROCESS_NAMES") {
+            Some(names) => names,
+            None => self.inner.ignore_process_names.clone().unwrap_or_else(|| {
+                DEFAULT_IGNORE_PROCESS_NAMES
+                    .iter()
+                    .map(|s| s.to_string())
+                    .collect()
+            }),
+        }
+    }
+
+    pub fn ignore_process_exes(&self) -> Vec<PathBuf> {
+        match env_list("EDGEBIT_IGNORE_PROCESS_EXES") {
+            Some(exes) => exes.into_iter().map(PathBuf::from).collect(),
+            None => paths(&self.inner.ignore_process_exes, &[]),
+        }
+    }
+
+    pub fn ignore_process_uids(&self) -> Result<Vec<u32>> {
+        match env_list("EDGEBIT_IGNORE_PROCESS_UIDS") {
+            Some(uids) => uids
+                .iter()
+                .map(|uid| {
+                    uid.parse::<u32>()
+                        .map_err(|err| anyhow!("$EDGEBIT_IGNORE_PROCESS_UIDS: '{uid}': {err}"))
+                })
+                .collect(),
+            None => Ok(self.inner.ignore_process_uids.clone().unwrap_or_default()),
+        }
+    }
+
+    // Suffixes of the files to track. None if all files should be tracked.
+    pub fn code_suffixes(&self) -> Option<Vec<String>> {
+        env_list("EDGEBIT_CODE_SUFFIXES").or_else(|| self.inner.code_suffixes.clone())
+    }
+
+    pub fn code_suffixes_from_sbom(&self) -> bool {
+        self.inner
+            .code_suffixes_from_sbom
+            .or_else(|| {
+                std::env::var("EDGEBIT_CODE_SUFFIXES_FROM_SBOM")
+                    .ok()
+                    .map(|v| is_yes(&v))
+            })
+            .unwrap_or(false)
+    }
+
+    // How long a workload needs to go without opening a new file to be considered
+    // converged and have its tracing throttled. None if disabled.
+    pub fn convergence_window(&self) -> Option<Duration> {
+        self.inner
+            .convergence_minutes
+            .or_else(|| {
+                std::env::var("EDGEBIT_CONVERGENCE_MINUTES")
+                    .ok()
+                    .and_then(|v| v.parse().ok())
+            })
+            .filter(|mins| *mins > 0)
+            .map(|mins| Duration::from_secs(mins * 60))
+    }
+
+    pub fn binary_ids(&self) -> bool {
+        self.inner
+            .binary_ids
+            .or_else(|| std::env::var("EDGEBIT_BINARY_IDS").ok().map(|v| is_yes(&v)))
+            .unwrap_or(true)
+    }
+
+    pub fn usage_summaries(&self) -> bool {
+        self.inner
+            .usage_summaries
+            .or_else(|| {
+                std::env::var("EDGEBIT_USAGE_SUMMARIES")
+                    .ok()
+                    .map(|v| is_yes(&v))
+            })
+            .unwrap_or(true)
+    }
+
+    pub fn local_store(&self) -> bool {
+        self.inner
+            .local_store
+            .or_else(|| {
+                std::env::var("EDGEBIT_LOCAL_STORE")
+                    .ok()
+                    .map(|v| is_yes(&v))
+            })
+            .unwrap_or(false)
+    }
+
+    pub fn store_dir(&self) -> PathBuf {
+        self.inner
+            .store_dir
+            .clone()
+            .or_else(|| std::env::var("EDGEBIT_STORE_DIR").ok().map(PathBuf::from))
+            .unwrap_or(DEFAULT_STORE_DIR.into())
+    }
+
+    // Number of days of in-use history kept in the local store
+    pub fn store_retention_days(&self) -> u32 {
+        self.inner
+            .store_retention_days
+            .or_else(|| {
+                std::env::var("EDGEBIT_STORE_RETENTION_DAYS")
+                    .ok()
+                    .and_then(|v| v.parse().ok())
+            })
+            .unwrap_or(DEFAULT_STORE_RETENTION_DAYS)
+    }
+
+    // Address of the local admin HTTP interface, None if disabled
+    pub fn admin_addr(&self) -> Result<Option<SocketAddr>> {
+        let addr = self
+            .inner
+            .admin_addr
+            .clone()
+            .or_else(|| std::env::var("EDGEBIT_ADMIN_ADDR").ok());
+
+        match addr {
+            Some(addr) => addr
+                .parse()
+                .map(Some)
+                .map_err(|err| anyhow!("admin_addr: '{addr}': {err}")),
+            None => Ok(None),
+        }
+    }
+
+    // Directory to export the in-use data to, None if disabled
+    pub fn export_dir(&self) -> Option<PathBuf> {
+        self.inner
+            .export_dir
+            .clone()
+            .or_else(|| std::env::var("EDGEBIT_EXPORT_DIR").ok().map(PathBuf::from))
+    }
+
+    // Number of recent events kept by the flight recorder, 0 disables it
+    pub fn flight_recorder_size(&self) -> usize {
+        self.inner
+            .flight_recorder_size
+            .or_else(|| {
+                std::env::var("EDGEBIT_FLIGHT_RECORDER_SIZE")
+                    .ok()
+                    .and_then(|v| v.parse().ok())
+            })
+            .unwrap_or(DEFAULT_FLIGHT_RECORDER_SIZE)
+    }
+
+    // File to write the startup phases to in the Chrome trace event format
+    pub fn startup_trace(&self) -> Option<PathBuf> {
+        self.inner.startup_trace.clone().or_else(|| {
+            std::env::var("EDGEBIT_STARTUP_TRACE")
+                .ok()
+                .map(PathBuf::from)
+        })
+    }
+
+    pub fn export_format(&self) -> Result<ExportFormat> {
+        let format = self
+            .inner
+            .export_format
+            .clone()
+            .or_else(|| std::env::var("EDGEBIT_EXPORT_FORMAT").ok())
+            .unwrap_or("arrow".to_string());
+
+        format
+            .parse()
+            .map_err(|err| anyhow!("export_format: {err}"))
+    }
+
+    pub fn in_use_engine(&self) -> Result<InUseEngine> {
+        let engine = self
+            .inner
+            .in_use_engine
+            .clone()
+            .or_else(|| std::env::var("EDGEBIT_IN_USE_ENGINE").ok())
+            .unwrap_or("tracing".to_string());
+
+        engine
+            .parse()
+            .map_err(|err| anyhow!("in_use_engine: {err}"))
+    }
+
+    // How often the mappings engine samples the processes
+    pub fn mappings_interval(&self) -> Duration {
+        let secs = self
+            .inner
+            .mappings_interval_secs
+            .or_else(|| {
+                std::env::var("EDGEBIT_MAPPINGS_INTERVAL_SECS")
+                    .ok()
+                    .and_then(|v| v.parse().ok())
+            })
+            .unwrap_or(DEFAULT_MAPPINGS_INTERVAL_SECS);
+
+        Duration::from_secs(secs.max(1))
+    }
+
+    pub fn converged_tier(&self) -> Result<TracingTier> {
+        let tier = self
+            .inner
+            .converged_tier
+            .clone()
+            .or_else(|| std::env::var("EDGEBIT_CONVERGED_TIER").ok())
+            .unwrap_or("sampled".to_string());
+
+        match tier.to_lowercase().as_str() {
+            "sampled" => Ok(TracingTier::Sampled(CONVERGED_SAMPLE_RATE)),
+            "exec-only" => Ok(TracingTier::ExecOnly),
+            _ => Err(anyhow!(
+                "converged_tier: '{tier}', expected 'sampled' or 'exec-only'"
+            )),
+        }
+    }
 }
 
 fn paths(lst: &Option<Vec<String>>, def: &[&str]) -> Vec<PathBuf> {
@@ -280,6 +555,19 @@ fn paths(lst: &Option<Vec<String>>, def: &[&str]) -> Vec<PathBuf> {
     }
 }
 
+// Comma separated list in an env var
+fn env_list(name: &str) -> Option<Vec<String>> {
+    let val = std::env::var(name).ok()?;
+
+    Some(
+        val.split(',')
+            .map(|s| s.trim())
+            .filter(|s| !s.is_empty())
+            .map(|s| s.to_string())
+            .collect(),
+    )
+}
+
 fn is_yes(val: &str) -> bool {
     let val = val.to_lowercase();
     val == "1" || val == "yes" || val == "true"
@@ -1,4 +1,4 @@
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::sync::Arc;
 use std::time::UNIX_EPOCH;
 use std::time::{Duration, SystemTime};
@@ -13,7 +13,8 @@ use futures::stream::StreamExt;
 use lazy_static::lazy_static;
 use log::*;
 
-use super::{ContainerEventsPtr, ContainerInfo};
+use super::{ContainerEventsPtr, ContainerInfo, Runtime};
+use crate::backoff::Backoff;
 use crate::cloud_metadata::CloudMetadata;
 use crate::scoped_path::*;
 
@@ -30,25 +31,24 @@ pub struct DockerTracker {
 }
 
 impl DockerTracker {
-    pub async fn connect(host: &str) -> Result<Self> {
+    pub async fn connect(host: &str, backoff: &mut Backoff) -> Result<Self> {
         let docker = docker_connection(host)?;
 
-        let mut quiet = false;
         loop {
             match docker.ping().await {
                 Ok(_) => {
                     info!("Connected to Docker daemon");
+                    backoff.succeeded();
                     break;
                 }
                 Err(err) => {
-                    if quiet {
+                    if backoff.failures() > 0 {
                         debug!("Failed to connect to Docker daemon: {err}");
                     } else {
                         error!("Failed to connect to Docker daemon: {err}");
-                        quiet = true;
                     }
 
-                    tokio::time::sleep(Duration::from_secs(1)).await;
+                    backoff.retry(&err, None).await;
                 }
             }
         }
@@ -132,7 +132,9 @@ impl Tracker {
 
                             match self.inspect_container(&id).await {
                                 Ok(info) => {
-                                    self.events.container_started(id, info).await;
+                                    self.events
+                                        .container_started(Runtime::Docker, id, info)
+                                        .await;
                                 }
                                 Err(err) => {
                                     error!("Failed to inspect container(id={id}): {err}");
@@ -159,17 +161,22 @@ impl Tracker {
         };
 
         let conts = self.docker.list_containers(Some(opts)).await?;
+        let running: HashSet<String> = conts.into_iter().filter_map(|c| c.id).collect();
 
-        for c in conts {
-            if c.id.is_none() {
+        // Only report the difference from what's already known (e.g. after a reconnect)
+        self.events.resync(Runtime::Docker, running.clone()).await;
+
+        for id in running {
+            if self.events.is_running(&id) {
                 continue;
             }
-            let id = c.id.unwrap();
 
             match self.inspect_container(&id).await {
                 Ok(info) => {
                     debug!("Container started: {id}; {info:?}");
-                    self.events.container_started(id, info).await;
+                    self.events
+                        .container_started(Runtime::Docker, id, info)
+                        .await;
                 }
                 Err(err) => {
                     error!("Docker inspect_container({id}): {err}");
@@ -1,6 +1,6 @@
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::path::PathBuf;
-use std::time::{Duration, SystemTime};
+use std::time::SystemTime;
 
 use anyhow::{anyhow, Result};
 use containerd_client::events::*;
@@ -13,14 +13,15 @@ use containerd_client::services::v1::{
 use containerd_client::types::v1::Status;
 use containerd_client::with_namespace;
 use log::*;
-use oci_spec::runtime::Spec;
 use prost::DecodeError;
 use prost_types::Any;
 use serde::Deserialize;
 use tonic::transport::channel::Channel;
 use tonic::Request;
 
-use super::{ContainerEventsPtr, ContainerInfo};
+use super::{ContainerEventsPtr, ContainerInfo, Runtime};
+use crate::backoff::Backoff;
+use crate::json_decode;
 use crate::label::*;
 use crate::scoped_path::*;
 
@@ -45,23 +46,22 @@ pub struct K8sContainerdTracker {
 }
 
 impl K8sContainerdTracker {
-    pub async fn connect(host: &str, container_roots: HostPath) -> Self {
-        let mut quiet = false;
+    pub async fn connect(host: &str, container_roots: HostPath, backoff: &mut Backoff) -> Self {
         let ch = loop {
             match super::grpc_connect(host).await {
                 Ok(ch) => {
                     info!("Connected to containerd daemon");
+                    backoff.succeeded();
                     break ch;
                 }
                 Err(err) => {
-                    if quiet {
+                    if backoff.failures() > 0 {
                         debug!("Failed to connect to containerd daemon: {err}");
                     } else {
                         error!("Failed to connect to containerd daemon: {err}");
-                        quiet = true;
                     }
 
-                    tokio::time::sleep(Duration::from_secs(1)).await;
+                    backoff.retry(&err, None).await;
                 }
             }
         };
@@ -114,7 +114,9 @@ impl K8sContainerdTracker {
                 debug!("Container {} created", msg.container_id);
                 match self.inspect_container(&msg.container_id).await {
                     Ok(Some(info)) => {
-                        events.container_started(msg.container_id, info).await;
+                        events
+                            .container_started(Runtime::Containerd, msg.container_id, info)
+                            .await;
                     }
                     Ok(None) => (),
                     Err(err) => {
@@ -138,8 +140,6 @@ impl K8sContainerdTracker {
     }
 
     async fn load_running(&mut self, events: ContainerEventsPtr) -> Result<()> {
-        let mut containers = self.load_containers().await?;
-
         let req = ListTasksRequest {
             filter: String::new(),
         };
@@ -148,11 +148,31 @@ impl K8sContainerdTracker {
 
         let resp = self.tasks.list(req).await?.into_inner();
 
-        for t in resp.tasks {
-            if Status::from_i32(t.status) == Some(Status::Running) {
-                if let Some(info) = containers.remove(&t.id) {
-                    events.container_started(t.id, info).await;
-                }
+        let running: HashSet<String> = resp
+            .tasks
+            .into_iter()
+            .filter(|t| Status::from_i32(t.status) == Some(Status::Running))
+            .map(|t| t.id)
+            .collect();
+
+        // Only report the difference from what's already known (e.g. after a reconnect)
+        events.resync(Runtime::Containerd, running.clone()).await;
+
+        if running.iter().all(|id| events.is_running(id)) {
+            return Ok(());
+        }
+
+        let mut containers = self.load_containers().await?;
+
+        for id in running {
+            if events.is_running(&id) {
+                continue;
+            }
+
+            if let Some(info) = containers.remove(&id) {
+                events
+                    .container_started(Runtime::Containerd, id, info)
+                    .await;
             }
         }
 
@@ -233,18 +253,9 @@ impl K8sContainerdTracker {
             labels.insert(LABEL_KUBE_NAMESPACE_NAME.to_string(), ns);
         }
 
-        let mounts: Vec<PathBuf> = if let Some(spec) = c.spec {
-            if let Some(oci_spec) = into_oci_spec(spec) {
-                if let Some(mounts) = oci_spec.mounts() {
-                    mounts.iter().map(|m| m.destination().clone()).collect()
-                } else {
-                    Vec::new()
-                }
-            } else {
-                Vec::new()
-            }
-        } else {
-            Vec::new()
+        let mounts: Vec<PathBuf> = match c.spec.take().and_then(into_oci_spec) {
+            Some(oci_spec) => oci_spec.mounts.into_iter().map(|m| m.destination).collect(),
+            None => Vec::new(),
         };
 
         debug!("Container (id={}) mounts: {mounts:?}", c.id);
@@ -299,10 +310,26 @@ fn is_container(c: &Container) -> bool {
     }
 }
 
-fn into_oci_spec(spec: Any) -> Option<Spec> {
+// The part of the OCI runtime spec that is used, the process, linux, hooks,
+// etc. fields are skipped by the decoder
+#[derive(Deserialize)]
+struct OciSpec {
+    #[serde(rename = "ociVersion")]
+    version: String,
+
+    #[serde(default)]
+    mounts: Vec<OciMount>,
+}
+
+#[derive(Deserialize)]
+struct OciMount {
+    destination: PathBuf,
+}
+
+fn into_oci_spec(mut spec: Any) -> Option<OciSpec> {
     if spec.type_url == OCI_SPEC_TYPE_NAME {
-        let oci_spec: Spec = serde_json::from_slice(&spec.value).ok()?;
-        if oci_spec.version().starts_with("1.") {
+        let oci_spec: OciSpec = json_decode::from_slice(&mut spec.value).ok()?;
+        if oci_spec.version.starts_with("1.") {
             return Some(oci_spec);
         }
     }
@@ -325,12 +352,12 @@ struct Metadata {
     image_ref: String,
 }
 
-fn into_cri_metadata(any: Any) -> Result<CriMetadata> {
+fn into_cri_metadata(mut any: Any) -> Result<CriMetadata> {
     if any.type_url != CRI_CONTAINERD_CONTAINER_METADATA_TYPE {
         return Err(anyhow!("unexpected CRI metadata extension type: {} instead of {CRI_CONTAINERD_CONTAINER_METADATA_TYPE}", any.type_url));
     }
 
-    let meta: CriMetadata = serde_json::from_slice(&any.value)?;
+    let meta: CriMetadata = json_decode::from_slice(&mut any.value)?;
 
     if meta.version != "v1" {
         return Err(anyhow!("unexpected CRI metadata version: {}", meta.version));
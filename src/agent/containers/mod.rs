@@ -2,10 +2,10 @@ pub mod docker;
 pub mod k8s_containerd;
 pub mod podman;
 
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::path::PathBuf;
 use std::sync::{Arc, Mutex};
-use std::time::{Duration, SystemTime};
+use std::time::{Duration, Instant, SystemTime};
 
 use anyhow::{anyhow, Result};
 use async_trait::async_trait;
@@ -23,13 +23,22 @@ use docker::DockerTracker;
 use k8s_containerd::K8sContainerdTracker;
 use podman::PodmanTracker;
 
+use crate::backoff::Backoff;
 use crate::cloud_metadata::CloudMetadata;
 use crate::config::Config;
 use crate::scoped_path::*;
+use crate::startup::StartupProfileArc;
 
 // Docker containers will contain the id somewhere in the cgroup name
 const CONTAINER_CLEANUP_LAG: Duration = Duration::from_secs(10);
 
+// How long the stop of a container that is not known (yet) is remembered
+const TOMBSTONE_TTL: Duration = Duration::from_secs(60);
+
+// Reconnects to the container runtime, see Backoff
+const RECONNECT_BASE: Duration = Duration::from_secs(1);
+const RECONNECT_CAP: Duration = Duration::from_secs(30);
+
 lazy_static! {
     // Docker containers will contain the id somewhere in the cgroup name
     static ref CGROUP_NAME_RE: Regex = Regex::new(r".*([[:xdigit:]]{64})").unwrap();
@@ -55,9 +64,42 @@ pub enum ContainerEvent {
 
 pub type ContainerMap = HashMap<String, ContainerInfo>;
 
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+pub enum Runtime {
+    Docker,
+    Podman,
+    Containerd,
+}
+
+// Lifecycle state of a known container. The generation is bumped on every
+// (re)start so that a stop whose cleanup got overtaken by a restart of the
+// same container is not applied.
+struct Registration {
+    runtime: Runtime,
+    generation: u64,
+    stopping: bool,
+}
+
+#[derive(Default)]
+struct Registry {
+    containers: HashMap<String, Registration>,
+    next_generation: u64,
+
+    // Stops that overtook the start of the container (e.g. the event stream
+    // racing with load_running): stop time and when it was recorded.
+    // The late start is ignored.
+    tombstones: HashMap<String, (SystemTime, tokio::time::Instant)>,
+}
+
 struct Inner {
     cont_map: Arc<Mutex<ContainerMap>>,
+    registry: Arc<Mutex<Registry>>,
     ch: Sender<ContainerEvent>,
+
+    // The first resync of a runtime completes its bootstrap
+    startup: StartupProfileArc,
+    created: Instant,
+    bootstrapped: Mutex<HashSet<Runtime>>,
 }
 
 pub struct Containers {
@@ -68,10 +110,19 @@ pub struct Containers {
 }
 
 impl Containers {
-    pub fn new(config: Arc<Config>, cloud_meta: CloudMetadata, ch: Sender<ContainerEvent>) -> Self {
+    pub fn new(
+        config: Arc<Config>,
+        cloud_meta: CloudMetadata,
+        ch: Sender<ContainerEvent>,
+        startup: StartupProfileArc,
+    ) -> Self {
         let inner = Arc::new(Inner {
             cont_map: Arc::new(Mutex::new(ContainerMap::new())),
+            registry: Arc::new(Mutex::new(Registry::default())),
             ch,
+            startup,
+            created: Instant::now(),
+            bootstrapped: Mutex::new(HashSet::new()),
         });
 
         Self {
@@ -87,8 +138,10 @@ impl Containers {
         let cloud_meta = self.cloud_meta.clone();
 
         let task = tokio::task::spawn(async move {
+            let mut backoff = Backoff::new("docker", RECONNECT_BASE, RECONNECT_CAP);
+
             loop {
-                let tracker = match DockerTracker::connect(&host).await {
+                let tracker = match DockerTracker::connect(&host, &mut backoff).await {
                     Ok(tracker) => tracker,
                     Err(err) => {
                         error!("Failed to connect to docker: {err}");
@@ -96,29 +149,20 @@ impl Containers {
                     }
                 };
 
-                match tracker.is_podman().await {
+                let res = match tracker.is_podman().await {
                     Ok(true) => {
                         info!("Podman detected, reconnecting");
-                        match PodmanTracker::connect(&host).await {
-                            Ok(tracker) => {
-                                if let Err(err) =
-                                    tracker.track(cloud_meta.clone(), ev.clone()).await
-                                {
-                                    error!("Container monitoring: {err}");
-                                }
-                            }
-
-                            Err(err) => error!("Failed to connect to podman: {err}"),
-                        }
-                    }
-                    _ => {
-                        if let Err(err) = tracker.track(cloud_meta.clone(), ev.clone()).await {
-                            error!("Container monitoring: {err}");
+                        match PodmanTracker::connect(&host, &mut backoff).await {
+                            Ok(tracker) => tracker.track(cloud_meta.clone(), ev.clone()).await,
+                            Err(err) => Err(anyhow!("Failed to connect to podman: {err}")),
                         }
                     }
-                }
+                    _ => tracker.track(cloud_meta.clone(), ev.clone()).await,
+                };
 
-                tokio::time::sleep(Duration::from_secs(1)).await;
+                let err = res.err().unwrap_or_else(|| anyhow!("event stream ended"));
+                error!("Container monitoring: {err}");
+                backoff.retry(&err, None).await;
             }
         });
 
@@ -130,25 +174,27 @@ impl Containers {
         let roots = HostPath::from(self.config.containerd_roots());
 
         let task = tokio::task::spawn(async move {
+            let mut backoff = Backoff::new("containerd", RECONNECT_BASE, RECONNECT_CAP);
+
             loop {
-                let tracker = K8sContainerdTracker::connect(&host, roots.clone()).await;
-                if let Err(err) = tracker.track(ev.clone()).await {
-                    error!("Container monitoring: {err}");
-                }
+                let tracker =
+                    K8sContainerdTracker::connect(&host, roots.clone(), &mut backoff).await;
 
-                tokio::time::sleep(Duration::from_secs(1)).await;
+                let res = tracker.track(ev.clone()).await;
+                let err = res.err().unwrap_or_else(|| anyhow!("event stream ended"));
+                error!("Container monitoring: {err}");
+                backoff.retry(&err, None).await;
             }
         });
         self.tasks.push(task);
     }
 
     pub fn id_from_cgroup(&self, cgroup: &str) -> Option<String> {
-        let groups = CGROUP_NAME_RE.captures(cgroup)?;
-        let id = groups.get(1)?.as_str();
+        let id = container_id_from_cgroup(cgroup)?;
 
         let cont_map = self.inner.cont_map.lock().unwrap();
-        if cont_map.contains_key(id) {
-            Some(id.to_string())
+        if cont_map.contains_key(&id) {
+            Some(id)
         } else {
             None
         }
@@ -157,17 +203,78 @@ impl Containers {
     pub fn all(&self) -> ContainerMap {
         self.inner.cont_map.lock().unwrap().clone()
     }
+
+    // For feeding runtime events without a runtime
+    pub fn events(&self) -> ContainerEventsPtr {
+        self.inner.clone()
+    }
+
+    // Number of containers, registrations and tombstones, for leak checks
+    pub fn sizes(&self) -> (usize, usize, usize) {
+        let registry = self.inner.registry.lock().unwrap();
+        (
+            self.inner.cont_map.lock().unwrap().len(),
+            registry.containers.len(),
+            registry.tombstones.len(),
+        )
+    }
 }
 
 #[async_trait]
 pub trait ContainerRuntimeEvents {
-    async fn container_started(&self, id: String, info: ContainerInfo);
+    async fn container_started(&self, runtime: Runtime, id: String, info: ContainerInfo);
     async fn container_stopped(&self, id: String, stop_time: SystemTime);
+
+    // Called with the containers running according to the runtime after
+    // (re)connecting to it. Stops the known containers that are gone.
+    async fn resync(&self, runtime: Runtime, running: HashSet<String>);
+
+    // True if the container is known and running, i.e. there's no need
+    // to inspect it and report its start.
+    fn is_running(&self, id: &str) -> bool;
 }
 
 #[async_trait]
 impl ContainerRuntimeEvents for Inner {
-    async fn container_started(&self, id: String, info: ContainerInfo) {
+    async fn container_started(&self, runtime: Runtime, id: String, info: ContainerInfo) {
+        {
+            let mut registry = self.registry.lock().unwrap();
+            let generation = registry.next_generation;
+
+            if let Some((stop_time, _)) = registry.tombstones.remove(&id) {
+                // Unless it's a restart after that stop
+                if info.start_time.map_or(true, |start| start <= stop_time) {
+                    debug!("Container {id} stopped before its start got processed, ignoring");
+                    return;
+                }
+            }
+
+            match registry.containers.get_mut(&id) {
+                // Duplicate (e.g. from the event stream racing with load_running)
+                Some(reg) if !reg.stopping => {
+                    debug!("Container {id} already started, ignoring");
+                    return;
+                }
+                // Restarted before the cleanup of the previous run
+                Some(reg) => {
+                    reg.generation = generation;
+                    reg.stopping = false;
+                }
+                None => {
+                    registry.containers.insert(
+                        id.clone(),
+                        Registration {
+                            runtime,
+                            generation,
+                            stopping: false,
+                        },
+                    );
+                }
+            }
+
+            registry.next_generation += 1;
+        }
+
         info!("Container started {id}: {info:?}");
 
         self.cont_map
@@ -182,31 +289,102 @@ impl ContainerRuntimeEvents for Inner {
     }
 
     async fn container_stopped(&self, id: String, stop_time: SystemTime) {
-        info!("Container {id} stopped");
+        let generation = {
+            let mut registry = self.registry.lock().unwrap();
+            match registry.containers.get_mut(&id) {
+                Some(reg) if !reg.stopping => {
+                    reg.stopping = true;
+                    reg.generation
+                }
+                Some(_) => return,
+                // Not started yet, e.g. called before load_running got to it
+                None => {
+                    let now = tokio::time::Instant::now();
+                    registry
+                        .tombstones
+                        .retain(|_, (_, recorded)| now.duration_since(*recorded) < TOMBSTONE_TTL);
+                    registry.tombstones.insert(id, (stop_time, now));
+                    return;
+                }
+            }
+        };
 
-        // TODO: it's racy to rely on the cont_map to have the info since
-        // if this is called before load_running, it may not be there.
-        if self.cont_map.lock().unwrap().contains_key(&id) {
-            // Hack to deal with open events also being processed under delay
-            let ch = self.ch.clone();
-            let cont_map = self.cont_map.clone();
+        info!("Container {id} stopped");
 
-            tokio::task::spawn(async move {
-                tokio::time::sleep(CONTAINER_CLEANUP_LAG).await;
+        // Hack to deal with open events also being processed under delay
+        let ch = self.ch.clone();
+        let cont_map = self.cont_map.clone();
+        let registry = self.registry.clone();
 
-                let info = { cont_map.lock().unwrap().remove(&id) };
+        tokio::task::spawn(async move {
+            tokio::time::sleep(CONTAINER_CLEANUP_LAG).await;
 
-                if let Some(mut info) = info {
-                    info.end_time = Some(stop_time);
-                    _ = ch.send(ContainerEvent::Stopped(id, info)).await;
+            {
+                let mut registry = registry.lock().unwrap();
+                match registry.containers.get(&id) {
+                    Some(reg) if reg.stopping && reg.generation == generation => {
+                        registry.containers.remove(&id);
+                    }
+                    _ => {
+                        debug!("Container {id} restarted, skipping the cleanup");
+                        return;
+                    }
                 }
-            });
+            }
+
+            let info = { cont_map.lock().unwrap().remove(&id) };
+
+            if let Some(mut info) = info {
+                info.end_time = Some(stop_time);
+                _ = ch.send(ContainerEvent::Stopped(id, info)).await;
+            }
+        });
+    }
+
+    async fn resync(&self, runtime: Runtime, running: HashSet<String>) {
+        let gone: Vec<String> = self
+            .registry
+            .lock()
+            .unwrap()
+            .containers
+            .iter()
+            .filter(|(id, reg)| reg.runtime == runtime && !reg.stopping && !running.contains(*id))
+            .map(|(id, _)| id.clone())
+            .collect();
+
+        if !gone.is_empty() {
+            info!("{runtime:?} resync: {} container(s) gone", gone.len());
+        }
+
+        for id in gone {
+            self.container_stopped(id, SystemTime::now()).await;
+        }
+
+        if self.bootstrapped.lock().unwrap().insert(runtime) {
+            let name = format!("{runtime:?}_bootstrap").to_lowercase();
+            self.startup.record(name, self.created);
         }
     }
+
+    fn is_running(&self, id: &str) -> bool {
+        self.registry
+            .lock()
+            .unwrap()
+            .containers
+            .get(id)
+            .map_or(false, |reg| !reg.stopping)
+    }
 }
 
 pub type ContainerEventsPtr = Arc<dyn ContainerRuntimeEvents + Send + Sync>;
 
+// The container id in a cgroup name, regardless of whether the container
+// is known to any of the runtimes (yet)
+pub fn container_id_from_cgroup(cgroup: &str) -> Option<String> {
+    let groups = CGROUP_NAME_RE.captures(cgroup)?;
+    Some(groups.get(1)?.as_str().to_string())
+}
+
 pub async fn grpc_connect(host: &str) -> Result<Channel> {
     info!("Connecting to {host}");
 
@@ -1,5 +1,5 @@
+use std::collections::HashSet;
 use std::sync::Arc;
-use std::time::Duration;
 
 use anyhow::Result;
 use futures::stream::StreamExt;
@@ -8,7 +8,8 @@ use podman_api::models::Event;
 use podman_api::opts::{ContainerListOpts, EventsOpts};
 use podman_api::Podman;
 
-use super::{ContainerEventsPtr, ContainerInfo};
+use super::{ContainerEventsPtr, ContainerInfo, Runtime};
+use crate::backoff::Backoff;
 use crate::cloud_metadata::CloudMetadata;
 use crate::scoped_path::*;
 
@@ -20,26 +21,25 @@ pub struct PodmanTracker {
 }
 
 impl PodmanTracker {
-    pub async fn connect(host: &str) -> Result<Self> {
+    pub async fn connect(host: &str, backoff: &mut Backoff) -> Result<Self> {
         info!("Connecting to {host}");
         let podman = Podman::new(host)?;
 
-        let mut quiet = false;
         loop {
             match podman.ping().await {
                 Ok(_) => {
                     info!("Connected to Podman daemon");
+                    backoff.succeeded();
                     break;
                 }
                 Err(err) => {
-                    if quiet {
+                    if backoff.failures() > 0 {
                         debug!("Failed to connect to Podman daemon: {err}");
                     } else {
                         error!("Failed to connect to Podman daemon: {err}");
-                        quiet = true;
                     }
 
-                    tokio::time::sleep(Duration::from_secs(1)).await;
+                    backoff.retry(&err, None).await;
                 }
             }
         }
@@ -109,7 +109,9 @@ impl Tracker {
 
                     match self.inspect_container(&id).await {
                         Ok(info) => {
-                            self.events.container_started(id, info).await;
+                            self.events
+                                .container_started(Runtime::Podman, id, info)
+                                .await;
                         }
                         Err(err) => {
                             error!("Failed to inspect container(id={id}): {err}");
@@ -128,17 +130,22 @@ impl Tracker {
         let opts = ContainerListOpts::builder().build();
 
         let conts = self.podman.containers().list(&opts).await?;
+        let running: HashSet<String> = conts.into_iter().filter_map(|c| c.id).collect();
 
-        for c in conts {
-            if c.id.is_none() {
+        // Only report the difference from what's already known (e.g. after a reconnect)
+        self.events.resync(Runtime::Podman, running.clone()).await;
+
+        for id in running {
+            if self.events.is_running(&id) {
                 continue;
             }
-            let id = c.id.unwrap();
 
             match self.inspect_container(&id).await {
                 Ok(info) => {
                     debug!("Container {id}: {info:?}");
-                    self.events.container_started(id, info).await;
+                    self.events
+                        .container_started(Runtime::Podman, id, info)
+                        .await;
                 }
                 Err(err) => {
                     error!("Podman inspect_container({id}): {err}");
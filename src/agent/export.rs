@@ -0,0 +1,1112 @@
+use std::fs::File;
+use std::io::{BufReader, BufWriter};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc::{Receiver, RecvTimeoutError, SyncSender, TrySendError};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use anyhow::{anyhow, Result};
+use arrow_array::builder::{
+    StringBuilder, StringDictionaryBuilder, TimestampMillisecondBuilder, UInt32Builder,
+};
+use arrow_array::types::Int32Type;
+use arrow_array::{ArrayRef, RecordBatch};
+use arrow_ipc::reader::StreamReader;
+use arrow_ipc::writer::StreamWriter;
+use arrow_schema::{DataType, Field, Schema, SchemaRef, TimeUnit};
+use log::*;
+use parquet::arrow::ArrowWriter;
+use parquet::basic::Compression;
+use parquet::file::properties::WriterProperties;
+
+use crate::open_monitor::OpenEvent;
+use crate::platform::pb;
+use crate::sbom::Sbom;
+use crate::scoped_path::*;
+use crate::sinks::EventBatch;
+
+// Buffered rows are written out as one record batch when there are
+// this many of them or the oldest one is this old
+const BATCH_ROWS: usize = 64 * 1024;
+const BATCH_INTERVAL: Duration = Duration::from_secs(60);
+
+// A new file is started when the current one gets this big or this old
+const ROTATE_SIZE: usize = 64 * 1024 * 1024;
+const ROTATE_INTERVAL: Duration = Duration::from_secs(60 * 60);
+
+const TMP_SUFFIX: &str = ".tmp";
+
+// Commands queued up for the export thread, of which at most
+// QUEUED_OPENS are open event batches to leave room for the rest
+const QUEUE_SIZE: usize = 1024;
+const QUEUED_OPENS: usize = 256;
+
+// How often the export thread writes out the batches and rotates the files that are due
+const TICK_INTERVAL: Duration = Duration::from_secs(1);
+
+// When the batches are written and the files rotated
+#[derive(Clone, Copy)]
+struct Limits {
+    batch_rows: usize,
+    batch_interval: Duration,
+    rotate_size: usize,
+    rotate_interval: Duration,
+}
+
+impl Default for Limits {
+    fn default() -> Self {
+        Self {
+            batch_rows: BATCH_ROWS,
+            batch_interval: BATCH_INTERVAL,
+            rotate_size: ROTATE_SIZE,
+            rotate_interval: ROTATE_INTERVAL,
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum ExportFormat {
+    // Arrow IPC stream format, allows for the dictionaries to change between batches
+    Arrow,
+    Parquet,
+}
+
+impl ExportFormat {
+    fn extension(&self) -> &'static str {
+        match self {
+            ExportFormat::Arrow => "arrows",
+            ExportFormat::Parquet => "parquet",
+        }
+    }
+}
+
+impl std::str::FromStr for ExportFormat {
+    type Err = anyhow::Error;
+
+    fn from_str(s: &str) -> Result<Self> {
+        match s.to_lowercase().as_str() {
+            "arrow" => Ok(ExportFormat::Arrow),
+            "parquet" => Ok(ExportFormat::Parquet),
+            _ => Err(anyhow!("'{s}', expected 'arrow' or 'parquet'")),
+        }
+    }
+}
+
+// Writes the in-use reports, workload metadata and SBOM package files into
+// columnar files for offline ingestion. Workload ids and paths are dictionary encoded.
+pub struct Exporter {
+    opens: Dataset<OpenRows>,
+    in_use: Dataset<InUseRows>,
+    workloads: Dataset<WorkloadRows>,
+    packages: Dataset<PackageRows>,
+}
+
+impl Exporter {
+    pub fn new(dir: &Path, format: ExportFormat) -> Result<Self> {
+        Self::with_limits(dir, format, Limits::default())
+    }
+
+    fn with_limits(dir: &Path, format: ExportFormat, limits: Limits) -> Result<Self> {
+        std::fs::create_dir_all(dir)
+            .map_err(|err| anyhow!("Failed to create {}: {err}", dir.display()))?;
+
+        recover_tmp_files(dir)?;
+
+        Ok(Self {
+            opens: Dataset::new(dir, "opens", format, limits),
+            in_use: Dataset::new(dir, "in-use", format, limits),
+            workloads: Dataset::new(dir, "workloads", format, limits),
+            packages: Dataset::new(dir, "packages", format, limits),
+        })
+    }
+
+    // The raw open events, before the attribution to a workload and the filtering
+    pub fn opens(&mut self, events: &[OpenEvent]) -> Result<()> {
+        let now = now_millis();
+
+        for evt in events {
+            let rows = &mut self.opens.rows;
+            rows.time.append_value(now);
+            rows.pid.append_value(evt.pid);
+            rows.cgroup.append_option(evt.cgroup_name.as_deref());
+            rows.path
+                .append_value(evt.filename.as_raw().to_string_lossy());
+        }
+
+        self.opens.added(events.len())
+    }
+
+    pub fn in_use(&mut self, workload_id: &str, files: &[WorkloadPath]) -> Result<()> {
+        let now = now_millis();
+
+        for f in files {
+            let rows = &mut self.in_use.rows;
+            rows.time.append_value(now);
+            rows.workload_id.append_value(workload_id);
+            rows.path.append_value(f.as_raw().to_string_lossy());
+        }
+
+        self.in_use.added(files.len())
+    }
+
+    pub fn workload(&mut self, req: &pb::UpsertWorkloadRequest) -> Result<()> {
+        let rows = &mut self.workloads.rows;
+        rows.time.append_value(now_millis());
+        rows.workload_id.append_value(&req.workload_id);
+
+        let (kind, name) = match req.workload.as_ref().and_then(|w| w.kind.as_ref()) {
+            Some(pb::workload::Kind::Host(host)) => ("host", Some(host.hostname.as_str())),
+            Some(pb::workload::Kind::Container(cont)) => ("container", Some(cont.name.as_str())),
+            _ => ("", None),
+        };
+        rows.kind.append_value(kind);
+        rows.name.append_option(name);
+
+        rows.image_id.append_value(&req.image_id);
+
+        let image = match req.image.as_ref().and_then(|i| i.kind.as_ref()) {
+            Some(pb::image::Kind::Docker(docker)) => Some(docker.tag.as_str()),
+            _ => None,
+        };
+        rows.image.append_option(image);
+
+        let labels = req
+            .workload
+            .as_ref()
+            .map(|w| serde_json::to_string(&w.labels))
+            .transpose()?;
+        rows.labels.append_option(labels);
+
+        rows.start_time
+            .append_option(req.start_time.as_ref().map(ts_millis));
+        rows.end_time
+            .append_option(req.end_time.as_ref().map(ts_millis));
+
+        self.workloads.added(1)
+    }
+
+    // The package to file mapping of an SBOM, see package_files()
+    pub fn packages(&mut self, image_id: &str, packages: &[PackageFiles]) -> Result<()> {
+        let now = now_millis();
+        let mut count = 0;
+
+        for (package_id, files) in packages {
+            let rows = &mut self.packages.rows;
+            for f in files {
+                rows.time.append_value(now);
+                rows.image_id.append_value(image_id);
+                rows.package_id.append_value(package_id);
+                rows.path.append_value(f.as_raw().to_string_lossy());
+                count += 1;
+            }
+        }
+
+        self.packages.added(count)
+    }
+
+    // Called periodically to write out the batches and rotate the files that are due
+    pub fn tick(&mut self) -> Result<()> {
+        self.opens.tick()?;
+        self.in_use.tick()?;
+        self.workloads.tick()?;
+        self.packages.tick()
+    }
+
+    pub fn close(&mut self) -> Result<()> {
+        self.opens.close()?;
+        self.in_use.close()?;
+        self.workloads.close()?;
+        self.packages.close()
+    }
+}
+
+// Package id and its files
+pub type PackageFiles = (String, Vec<WorkloadPath>);
+
+pub fn package_files(sbom: &Sbom, host_root: &RootFsPath) -> Vec<PackageFiles> {
+    sbom.artifacts()
+        .iter()
+        // unsupported package types have no file lists
+        .filter_map(|artifact| Some((artifact.id.clone(), artifact.files(host_root).ok()?)))
+        .collect()
+}
+
+enum Command {
+    Opens(EventBatch),
+    InUse(String, Vec<WorkloadPath>),
+    Workload(Box<pb::UpsertWorkloadRequest>),
+    Packages(String, Vec<PackageFiles>),
+    Close(SyncSender<Result<()>>),
+}
+
+// Runs the Exporter on a thread of its own, so that building the record
+// batches and encoding, writing and rotating the files never block the async
+// runtime. The callers only queue up the rows, which are dropped if the
+// thread falls behind.
+#[derive(Clone)]
+pub struct ExportWorker {
+    cmds: SyncSender<Command>,
+    queued_opens: Arc<AtomicUsize>,
+}
+
+impl ExportWorker {
+    pub fn start(exporter: Exporter) -> Result<Self> {
+        let (tx, rx) = std::sync::mpsc::sync_channel(QUEUE_SIZE);
+        let queued_opens = Arc::new(AtomicUsize::new(0));
+
+        {
+            let queued_opens = queued_opens.clone();
+            std::thread::Builder::new()
+                .name("export".to_string())
+                .spawn(move || worker(exporter, rx, queued_opens))
+                .map_err(|err| anyhow!("Failed to start the export worker: {err}"))?;
+        }
+
+        Ok(Self {
+            cmds: tx,
+            queued_opens,
+        })
+    }
+
+    // Losing some of the raw opens is expected under load, like in the sink
+    pub fn opens(&self, events: EventBatch) {
+        if self.queued_opens.fetch_add(1, Ordering::Relaxed) >= QUEUED_OPENS {
+            self.queued_opens.fetch_sub(1, Ordering::Relaxed);
+            debug!("Export queue full, dropping {} open events", events.len());
+            return;
+        }
+
+        if !self.submit(Command::Opens(events)) {
+            self.queued_opens.fetch_sub(1, Ordering::Relaxed);
+        }
+    }
+
+    pub fn in_use(&self, workload_id: &str, files: &[WorkloadPath]) {
+        self.submit(Command::InUse(workload_id.to_string(), files.to_vec()));
+    }
+
+    pub fn workload(&self, req: &pb::UpsertWorkloadRequest) {
+        self.submit(Command::Workload(Box::new(req.clone())));
+    }
+
+    pub fn packages(&self, image_id: &str, packages: Vec<PackageFiles>) {
+        self.submit(Command::Packages(image_id.to_string(), packages));
+    }
+
+    // Writes out everything queued up before it and finishes the files.
+    // Blocks until done, the rows submitted afterwards are not exported.
+    pub fn close(&self) -> Result<()> {
+        let (done_tx, done_rx) = std::sync::mpsc::sync_channel(1);
+
+        self.cmds
+            .send(Command::Close(done_tx))
+            .map_err(|_| anyhow!("The export worker is gone"))?;
+
+        done_rx
+            .recv()
+            .map_err(|_| anyhow!("The export worker is gone"))?
+    }
+
+    // Returns whether the command was queued up
+    fn submit(&self, cmd: Command) -> bool {
+        match self.cmds.try_send(cmd) {
+            Ok(()) => return true,
+            Err(TrySendError::Full(Command::Opens(events))) => {
+                debug!("Export queue full, dropping {} open events", events.len())
+            }
+            Err(TrySendError::Full(_)) => warn!("Export queue full, dropping the update"),
+            Err(TrySendError::Disconnected(_)) => debug!("The export worker is gone"),
+        }
+
+        false
+    }
+}
+
+fn worker(mut exporter: Exporter, cmds: Receiver<Command>, queued_opens: Arc<AtomicUsize>) {
+    let mut last_tick = Instant::now();
+
+    loop {
+        let res = match cmds.recv_timeout(TICK_INTERVAL) {
+            Ok(Command::Opens(events)) => {
+                queued_opens.fetch_sub(1, Ordering::Relaxed);
+                exporter
+                    .opens(&events)
+                    .map_err(|err| anyhow!("the open events: {err}"))
+            }
+            Ok(Command::InUse(workload_id, files)) => exporter
+                .in_use(&workload_id, &files)
+                .map_err(|err| anyhow!("in-use files: {err}")),
+            Ok(Command::Workload(req)) => exporter
+                .workload(&req)
+                .map_err(|err| anyhow!("workload: {err}")),
+            Ok(Command::Packages(image_id, packages)) => exporter
+                .packages(&image_id, &packages)
+                .map_err(|err| anyhow!("the SBOM packages: {err}")),
+            Ok(Command::Close(done)) => {
+                _ = done.send(exporter.close());
+                return;
+            }
+            Err(RecvTimeoutError::Timeout) => Ok(()),
+            Err(RecvTimeoutError::Disconnected) => {
+                if let Err(err) = exporter.close() {
+                    error!("Failed to finish the export: {err}");
+                }
+                return;
+            }
+        };
+
+        if let Err(err) = res {
+            error!("Failed to export {err}");
+        }
+
+        if last_tick.elapsed() >= TICK_INTERVAL {
+            last_tick = Instant::now();
+
+            if let Err(err) = exporter.tick() {
+                error!("Failed to export: {err}");
+            }
+        }
+    }
+}
+
+// Column builders of a dataset
+trait Rows: Default {
+    fn schema() -> Schema;
+    fn finish(&mut self) -> Vec<ArrayRef>;
+}
+
+#[derive(Default)]
+struct OpenRows {
+    time: TimestampMillisecondBuilder,
+    pid: UInt32Builder,
+    cgroup: StringDictionaryBuilder<Int32Type>,
+    path: StringDictionaryBuilder<Int32Type>,
+}
+
+impl Rows for OpenRows {
+    fn schema() -> Schema {
+        Schema::new(vec![
+            time_field("time", false),
+            Field::new("pid", DataType::UInt32, false),
+            dict_field("cgroup", true),
+            dict_field("path", false),
+        ])
+    }
+
+    fn finish(&mut self) -> Vec<ArrayRef> {
+        vec![
+            Arc::new(self.time.finish().with_timezone("UTC")),
+            Arc::new(self.pid.finish()),
+            Arc::new(self.cgroup.finish()),
+            Arc::new(self.path.finish()),
+        ]
+    }
+}
+
+#[derive(Default)]
+struct InUseRows {
+    time: TimestampMillisecondBuilder,
+    workload_id: StringDictionaryBuilder<Int32Type>,
+    path: StringDictionaryBuilder<Int32Type>,
+}
+
+impl Rows for InUseRows {
+    fn schema() -> Schema {
+        Schema::new(vec![
+            time_field("time", false),
+            dict_field("workload_id", false),
+            dict_field("path", false),
+        ])
+    }
+
+    fn finish(&mut self) -> Vec<ArrayRef> {
+        vec![
+            Arc::new(self.time.finish().with_timezone("UTC")),
+            Arc::new(self.workload_id.finish()),
+            Arc::new(self.path.finish()),
+        ]
+    }
+}
+
+#[derive(Default)]
+struct WorkloadRows {
+    time: TimestampMillisecondBuilder,
+    workload_id: StringDictionaryBuilder<Int32Type>,
+    kind: StringDictionaryBuilder<Int32Type>,
+    name: StringBuilder,
+    image_id: StringDictionaryBuilder<Int32Type>,
+    image: StringBuilder,
+    // JSON object
+    labels: StringBuilder,
+    start_time: TimestampMillisecondBuilder,
+    end_time: TimestampMillisecondBuilder,
+}
+
+impl Rows for WorkloadRows {
+    fn schema() -> Schema {
+        Schema::new(vec![
+            time_field("time", false),
+            dict_field("workload_id", false),
+            dict_field("kind", false),
+            Field::new("name", DataType::Utf8, true),
+            dict_field("image_id", false),
+            Field::new("image", DataType::Utf8, true),
+            Field::new("labels", DataType::Utf8, true),
+            time_field("start_time", true),
+            time_field("end_time", true),
+        ])
+    }
+
+    fn finish(&mut self) -> Vec<ArrayRef> {
+        vec![
+            Arc::new(self.time.finish().with_timezone("UTC")),
+            Arc::new(self.workload_id.finish()),
+            Arc::new(self.kind.finish()),
+            Arc::new(self.name.finish()),
+            Arc::new(self.image_id.finish()),
+            Arc::new(self.image.finish()),
+            Arc::new(self.labels.finish()),
+            Arc::new(self.start_time.finish().with_timezone("UTC")),
+            Arc::new(self.end_time.finish().with_timezone("UTC")),
+        ]
+    }
+}
+
+#[derive(Default)]
+struct PackageRows {
+    time: TimestampMillisecondBuilder,
+    image_id: StringDictionaryBuilder<Int32Type>,
+    package_id: StringDictionaryBuilder<Int32Type>,
+    path: StringDictionaryBuilder<Int32Type>,
+}
+
+impl Rows for PackageRows {
+    fn schema() -> Schema {
+        Schema::new(vec![
+            time_field("time", false),
+            dict_field("image_id", false),
+            dict_field("package_id", false),
+            dict_field("path", false),
+        ])
+    }
+
+    fn finish(&mut self) -> Vec<ArrayRef> {
+        vec![
+            Arc::new(self.time.finish().with_timezone("UTC")),
+            Arc::new(self.image_id.finish()),
+            Arc::new(self.package_id.finish()),
+            Arc::new(self.path.finish()),
+        ]
+    }
+}
+
+// Buffered rows of a dataset and the file they are written to
+struct Dataset<R: Rows> {
+    dir: PathBuf,
+    name: &'static str,
+    format: ExportFormat,
+    schema: SchemaRef,
+    limits: Limits,
+
+    rows: R,
+    count: usize,
+    first_row: Option<Instant>,
+
+    file: Option<OutputFile>,
+    seq: u64,
+}
+
+impl<R: Rows> Dataset<R> {
+    fn new(dir: &Path, name: &'static str, format: ExportFormat, limits: Limits) -> Self {
+        Self {
+            dir: dir.to_path_buf(),
+            name,
+            format,
+            schema: Arc::new(R::schema()),
+            limits,
+            rows: R::default(),
+            count: 0,
+            first_row: None,
+            file: None,
+            seq: 0,
+        }
+    }
+
+    fn added(&mut self, count: usize) -> Result<()> {
+        if count > 0 {
+            self.count += count;
+            self.first_row.get_or_insert_with(Instant::now);
+        }
+
+        if self.count >= self.limits.batch_rows {
+            self.write_batch()?;
+        }
+
+        Ok(())
+    }
+
+    fn tick(&mut self) -> Result<()> {
+        if self
+            .first_row
+            .map_or(false, |t| t.elapsed() >= self.limits.batch_interval)
+        {
+            self.write_batch()?;
+        }
+
+        let expired = self
+            .file
+            .as_ref()
+            .map_or(false, |f| f.opened.elapsed() >= self.limits.rotate_interval);
+
+        if expired {
+            self.close_file()?;
+        }
+
+        Ok(())
+    }
+
+    fn write_batch(&mut self) -> Result<()> {
+        if self.count == 0 {
+            return Ok(());
+        }
+
+        let batch = RecordBatch::try_new(self.schema.clone(), self.rows.finish())?;
+        self.count = 0;
+        self.first_row = None;
+
+        if self.file.is_none() {
+            self.file = Some(self.open_file()?);
+        }
+
+        let file = self.file.as_mut().unwrap();
+        file.write(&batch)?;
+
+        if file.size >= self.limits.rotate_size {
+            self.close_file()?;
+        }
+
+        Ok(())
+    }
+
+    fn open_file(&mut self) -> Result<OutputFile> {
+        self.seq += 1;
+
+        let name = format!(
+            "{}-{}-{}.{}",
+            self.name,
+            chrono::Utc::now().format("%Y%m%dT%H%M%SZ"),
+            self.seq,
+            self.format.extension()
+        );
+
+        let path = self.dir.join(name);
+        debug!("Exporting {} to {}", self.name, path.display());
+
+        OutputFile::create(path, self.format, &self.schema)
+    }
+
+    fn close_file(&mut self) -> Result<()> {
+        match self.file.take() {
+            Some(file) => file.finish(),
+            None => Ok(()),
+        }
+    }
+
+    fn close(&mut self) -> Result<()> {
+        self.write_batch()?;
+        self.close_file()
+    }
+}
+
+enum Writer {
+    Arrow(StreamWriter<BufWriter<File>>),
+    Parquet(ArrowWriter<File>),
+}
+
+// Written under a ".tmp" name and renamed once complete,
+// so that the ingestion never picks up a partial file
+struct OutputFile {
+    writer: Writer,
+    path: PathBuf,
+    tmp_path: PathBuf,
+    opened: Instant,
+    size: usize,
+}
+
+impl OutputFile {
+    fn create(path: PathBuf, format: ExportFormat, schema: &SchemaRef) -> Result<Self> {
+        let mut tmp_path = path.clone().into_os_string();
+        tmp_path.push(TMP_SUFFIX);
+        let tmp_path = PathBuf::from(tmp_path);
+
+        let file = File::create(&tmp_path)?;
+
+        let writer = match format {
+            ExportFormat::Arrow => {
+                Writer::Arrow(StreamWriter::try_new(BufWriter::new(file), schema)?)
+            }
+            ExportFormat::Parquet => {
+                let props = WriterProperties::builder()
+                    .set_compression(Compression::SNAPPY)
+                    .build();
+                Writer::Parquet(ArrowWriter::try_new(file, schema.clone(), Some(props))?)
+            }
+        };
+
+        Ok(Self {
+            writer,
+            path,
+            tmp_path,
+            opened: Instant::now(),
+            size: 0,
+        })
+    }
+
+    fn write(&mut self, batch: &RecordBatch) -> Result<()> {
+        match &mut self.writer {
+            Writer::Arrow(w) => w.write(batch)?,
+            Writer::Parquet(w) => w.write(batch)?,
+        }
+
+        // in-memory size, close enough for the rotation
+        self.size += batch.get_array_memory_size();
+        Ok(())
+    }
+
+    fn finish(self) -> Result<()> {
+        match self.writer {
+            Writer::Arrow(w) => {
+                w.into_inner()?
+                    .into_inner()
+                    .map_err(|err| err.into_error())?;
+            }
+            Writer::Parquet(w) => {
+                w.close()?;
+            }
+        }
+
+        std::fs::rename(&self.tmp_path, &self.path)?;
+        Ok(())
+    }
+}
+
+// The files left behind by an agent that didn't close the exporter (killed,
+// crashed). The complete batches of an Arrow stream are written out under the
+// final name. A Parquet file without its footer can't be read, it's removed.
+fn recover_tmp_files(dir: &Path) -> Result<()> {
+    for entry in std::fs::read_dir(dir)? {
+        let tmp_path = entry?.path();
+        let Some(path) = tmp_path
+            .to_str()
+            .and_then(|p| p.strip_suffix(TMP_SUFFIX))
+            .map(PathBuf::from)
+        else {
+            continue;
+        };
+
+        let res = match path.extension().and_then(|ext| ext.to_str()) {
+            Some(ext) if ext == ExportFormat::Arrow.extension() => recover_arrow(&tmp_path, path),
+            _ => Ok(0),
+        };
+
+        match res {
+            // Rewritten through the same tmp file and renamed
+            Ok(n) if n > 0 => {
+                info!("Recovered {n} batches of the export {}", tmp_path.display());
+                continue;
+            }
+            Ok(_) => warn!("Removing the incomplete export {}", tmp_path.display()),
+            Err(err) => warn!(
+                "Removing the unreadable export {}: {err}",
+                tmp_path.display()
+            ),
+        }
+
+        std::fs::remove_file(&tmp_path)?;
+    }
+
+    Ok(())
+}
+
+// Returns the number of batches recovered
+fn recover_arrow(tmp_path: &Path, path: PathBuf) -> Result<usize> {
+    let reader = StreamReader::try_new(BufReader::new(File::open(tmp_path)?), None)?;
+    let schema = reader.schema();
+
+    // Up to the first truncated or corrupted batch. All read before the tmp
+    // file gets truncated by the rewrite.
+    let batches: Vec<_> = reader.map_while(|batch| batch.ok()).collect();
+    if batches.is_empty() {
+        return Ok(0);
+    }
+
+    let mut out = OutputFile::create(path, ExportFormat::Arrow, &schema)?;
+    for batch in &batches {
+        out.write(batch)?;
+    }
+    out.finish()?;
+
+    Ok(batches.len())
+}
+
+fn time_field(name: &str, nullable: bool) -> Field {
+    Field::new(
+        name,
+        DataType::Timestamp(TimeUnit::Millisecond, Some("UTC".into())),
+        nullable,
+    )
+}
+
+fn dict_field(name: &str, nullable: bool) -> Field {
+    Field::new(
+        name,
+        DataType::Dictionary(Box::new(DataType::Int32), Box::new(DataType::Utf8)),
+        nullable,
+    )
+}
+
+fn ts_millis(ts: &prost_types::Timestamp) -> i64 {
+    ts.seconds * 1000 + (ts.nanos / 1_000_000) as i64
+}
+
+fn now_millis() -> i64 {
+    chrono::Utc::now().timestamp_millis()
+}
+
+#[cfg(test)]
+mod tests {
+    use arrow_array::cast::AsArray;
+    use arrow_array::types::UInt32Type;
+    use arrow_array::StringArray;
+    use assert2::assert;
+    use parquet::arrow::arrow_reader::ParquetRecordBatchReaderBuilder;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    const NO_LIMITS: Limits = Limits {
+        batch_rows: usize::MAX,
+        batch_interval: Duration::MAX,
+        rotate_size: usize::MAX,
+        rotate_interval: Duration::MAX,
+    };
+
+    fn paths(names: &[&str]) -> Vec<WorkloadPath> {
+        names.iter().map(|n| WorkloadPath::from(*n)).collect()
+    }
+
+    fn row(workload_id: &str, path: &str) -> (String, String) {
+        (workload_id.to_string(), path.to_string())
+    }
+
+    // Sorted by name, i.e. by the time and sequence they were opened in
+    fn exported(dir: &Path, prefix: &str) -> Vec<PathBuf> {
+        let mut files: Vec<_> = std::fs::read_dir(dir)
+            .unwrap()
+            .map(|e| e.unwrap().path())
+            .filter(|p| p.file_name().unwrap().to_string_lossy().starts_with(prefix))
+            .collect();
+
+        files.sort();
+        files
+    }
+
+    fn read_back(path: &Path) -> Vec<RecordBatch> {
+        let file = File::open(path).unwrap();
+
+        match path.extension().unwrap().to_str().unwrap() {
+            "arrows" => StreamReader::try_new(BufReader::new(file), None)
+                .unwrap()
+                .map(|b| b.unwrap())
+                .collect(),
+            "parquet" => ParquetRecordBatchReaderBuilder::try_new(file)
+                .unwrap()
+                .build()
+                .unwrap()
+                .map(|b| b.unwrap())
+                .collect(),
+            ext => panic!("unexpected export {ext}"),
+        }
+    }
+
+    // (workload_id, path) of every in-use row
+    fn in_use_rows(batches: &[RecordBatch]) -> Vec<(String, String)> {
+        let strings = |batch: &RecordBatch, name: &str| -> Vec<String> {
+            let dict = batch
+                .column_by_name(name)
+                .unwrap()
+                .as_dictionary::<Int32Type>();
+            let values = dict.downcast_dict::<StringArray>().unwrap();
+            values.into_iter().map(|v| v.unwrap().to_string()).collect()
+        };
+
+        batches
+            .iter()
+            .flat_map(|b| std::iter::zip(strings(b, "workload_id"), strings(b, "path")))
+            .collect()
+    }
+
+    fn check_read_back(format: ExportFormat) {
+        let dir = TempDir::new("export");
+
+        let mut exporter = Exporter::with_limits(&dir, format, NO_LIMITS).unwrap();
+        exporter
+            .in_use("w1", &paths(&["/bin/sh", "/lib/libc.so.6"]))
+            .unwrap();
+        exporter.in_use("w2", &paths(&["/bin/sh"])).unwrap();
+        exporter.close().unwrap();
+
+        let files = exported(&dir, "in-use-");
+        assert!(files.len() == 1);
+        assert!(files[0].extension().unwrap() == format.extension());
+
+        let batches = read_back(&files[0]);
+        assert!(batches[0].schema().fields() == InUseRows::schema().fields());
+        assert!(
+            in_use_rows(&batches)
+                == vec![
+                    row("w1", "/bin/sh"),
+                    row("w1", "/lib/libc.so.6"),
+                    row("w2", "/bin/sh"),
+                ]
+        );
+
+        // Nothing was added to the others, no empty files
+        assert!(exported(&dir, "workloads-").is_empty());
+        assert!(exported(&dir, "packages-").is_empty());
+    }
+
+    #[test]
+    fn test_read_back_arrow() {
+        check_read_back(ExportFormat::Arrow);
+    }
+
+    #[test]
+    fn test_read_back_parquet() {
+        check_read_back(ExportFormat::Parquet);
+    }
+
+    #[test]
+    fn test_opens() {
+        let dir = TempDir::new("export");
+
+        let events = [
+            OpenEvent {
+                pid: 10,
+                cgroup_name: Some("/kubepods/pod1/abc".to_string()),
+                cgroup_id: Some(1),
+                filename: WorkloadPath::from("/bin/sh"),
+                exec: true,
+            },
+            OpenEvent {
+                pid: 11,
+                cgroup_name: None,
+                cgroup_id: None,
+                filename: WorkloadPath::from("/usr/bin/python3"),
+                exec: false,
+            },
+        ];
+
+        let mut exporter = Exporter::with_limits(&dir, ExportFormat::Parquet, NO_LIMITS).unwrap();
+        exporter.opens(&events).unwrap();
+        exporter.close().unwrap();
+
+        let files = exported(&dir, "opens-");
+        assert!(files.len() == 1);
+
+        let batches = read_back(&files[0]);
+        assert!(batches.len() == 1);
+
+        let batch = &batches[0];
+        assert!(batch.schema().fields() == OpenRows::schema().fields());
+        assert!(batch.num_rows() == 2);
+
+        let pids = batch
+            .column_by_name("pid")
+            .unwrap()
+            .as_primitive::<UInt32Type>();
+        assert!(pids.values().to_vec() == vec![10, 11]);
+
+        let cgroups = batch
+            .column_by_name("cgroup")
+            .unwrap()
+            .as_dictionary::<Int32Type>();
+        let cgroups: Vec<_> = cgroups
+            .downcast_dict::<StringArray>()
+            .unwrap()
+            .into_iter()
+            .collect();
+        assert!(cgroups == vec![Some("/kubepods/pod1/abc"), None]);
+    }
+
+    #[test]
+    fn test_batch_rows() {
+        let dir = TempDir::new("export");
+        let limits = Limits {
+            batch_rows: 3,
+            ..NO_LIMITS
+        };
+
+        let mut exporter = Exporter::with_limits(&dir, ExportFormat::Arrow, limits).unwrap();
+        exporter.in_use("w1", &paths(&["/a", "/b"])).unwrap();
+        assert!(exporter.in_use.count == 2);
+        assert!(exporter.in_use.file.is_none());
+
+        exporter.in_use("w1", &paths(&["/c", "/d"])).unwrap();
+        assert!(exporter.in_use.count == 0);
+        assert!(exporter.in_use.file.is_some());
+
+        exporter.in_use("w1", &paths(&["/e"])).unwrap();
+        exporter.close().unwrap();
+
+        let files = exported(&dir, "in-use-");
+        assert!(files.len() == 1);
+
+        let batches = read_back(&files[0]);
+        let sizes: Vec<_> = batches.iter().map(|b| b.num_rows()).collect();
+        assert!(sizes == vec![4, 1]);
+    }
+
+    #[test]
+    fn test_batch_interval() {
+        let dir = TempDir::new("export");
+        let limits = Limits {
+            batch_interval: Duration::ZERO,
+            ..NO_LIMITS
+        };
+
+        let mut exporter = Exporter::with_limits(&dir, ExportFormat::Arrow, limits).unwrap();
+        exporter.tick().unwrap();
+        assert!(exporter.in_use.file.is_none());
+
+        exporter.in_use("w1", &paths(&["/a"])).unwrap();
+        assert!(exporter.in_use.count == 1);
+
+        exporter.tick().unwrap();
+        assert!(exporter.in_use.count == 0);
+        assert!(exporter.in_use.first_row.is_none());
+        assert!(exporter.in_use.file.is_some());
+    }
+
+    #[test]
+    fn test_rotate_size() {
+        let dir = TempDir::new("export");
+        let limits = Limits {
+            batch_rows: 1,
+            rotate_size: 1,
+            ..NO_LIMITS
+        };
+
+        let mut exporter = Exporter::with_limits(&dir, ExportFormat::Parquet, limits).unwrap();
+        exporter.in_use("w1", &paths(&["/a"])).unwrap();
+        exporter.in_use("w1", &paths(&["/b"])).unwrap();
+
+        // Every batch goes over the size and closes its file
+        assert!(exporter.in_use.file.is_none());
+
+        let files = exported(&dir, "in-use-");
+        assert!(files.len() == 2);
+        assert!(in_use_rows(&read_back(&files[0])) == vec![row("w1", "/a")]);
+        assert!(in_use_rows(&read_back(&files[1])) == vec![row("w1", "/b")]);
+    }
+
+    #[test]
+    fn test_rotate_interval() {
+        let dir = TempDir::new("export");
+        let limits = Limits {
+            batch_rows: 1,
+            rotate_interval: Duration::ZERO,
+            ..NO_LIMITS
+        };
+
+        let mut exporter = Exporter::with_limits(&dir, ExportFormat::Arrow, limits).unwrap();
+        exporter.in_use("w1", &paths(&["/a"])).unwrap();
+        assert!(exporter.in_use.file.is_some());
+        assert!(exported(&dir, "in-use-")[0].extension().unwrap() == "tmp");
+
+        exporter.tick().unwrap();
+        assert!(exporter.in_use.file.is_none());
+
+        let files = exported(&dir, "in-use-");
+        assert!(files.len() == 1);
+        assert!(files[0].extension().unwrap() == "arrows");
+    }
+
+    #[test]
+    fn test_worker() {
+        let dir = TempDir::new("export");
+
+        let exporter = Exporter::with_limits(&dir, ExportFormat::Arrow, NO_LIMITS).unwrap();
+        let worker = ExportWorker::start(exporter).unwrap();
+
+        let events: EventBatch = Arc::new([OpenEvent {
+            pid: 10,
+            cgroup_name: None,
+            cgroup_id: None,
+            filename: WorkloadPath::from("/bin/sh"),
+            exec: true,
+        }]);
+        worker.opens(events);
+        worker.in_use("w1", &paths(&["/bin/sh"]));
+        worker.packages("img", vec![("pkg1".to_string(), paths(&["/bin/sh"]))]);
+
+        // Waits for the queued up rows
+        worker.close().unwrap();
+
+        assert!(exported(&dir, "opens-").len() == 1);
+        assert!(exported(&dir, "packages-").len() == 1);
+
+        let files = exported(&dir, "in-use-");
+        assert!(files.len() == 1);
+        assert!(in_use_rows(&read_back(&files[0])) == vec![row("w1", "/bin/sh")]);
+
+        // The thread is gone, the late rows are not exported
+        worker.in_use("w2", &paths(&["/bin/sh"]));
+        assert!(worker.close().is_err());
+        assert!(exported(&dir, "in-use-").len() == 1);
+    }
+
+    #[test]
+    fn test_recover_tmp_files() {
+        let dir = TempDir::new("export");
+        let limits = Limits {
+            batch_rows: 1,
+            ..NO_LIMITS
+        };
+
+        for format in [ExportFormat::Arrow, ExportFormat::Parquet] {
+            let mut exporter = Exporter::with_limits(&dir, format, limits).unwrap();
+            exporter.in_use("w1", &paths(&["/a"])).unwrap();
+            exporter.in_use("w1", &paths(&["/b"])).unwrap();
+
+            // Stopped without a close()
+            drop(exporter);
+        }
+
+        let tmp: Vec<_> = exported(&dir, "in-use-");
+        assert!(tmp.len() == 2);
+        assert!(tmp.iter().all(|p| p.extension().unwrap() == "tmp"));
+
+        // Half a batch at the end of the stream
+        let arrow_tmp = tmp
+            .iter()
+            .find(|p| p.to_string_lossy().contains(".arrows"))
+            .unwrap();
+        let mut f = std::fs::OpenOptions::new()
+            .append(true)
+            .open(arrow_tmp)
+            .unwrap();
+        std::io::Write::write_all(&mut f, &[0xff, 0xff, 0xff, 0xff, 0x10]).unwrap();
+        drop(f);
+
+        let _exporter = Exporter::new(&dir, ExportFormat::Arrow).unwrap();
+
+        // The Arrow stream is readable up to the last complete batch, the
+        // Parquet file without a footer is gone
+        let files = exported(&dir, "in-use-");
+        assert!(files.len() == 1);
+        assert!(files[0].extension().unwrap() == "arrows");
+        assert!(in_use_rows(&read_back(&files[0])) == vec![row("w1", "/a"), row("w1", "/b")]);
+    }
+}
@@ -0,0 +1,209 @@
+use std::collections::HashSet;
+use std::fs::Metadata;
+use std::io::Read;
+use std::num::NonZeroUsize;
+use std::os::unix::fs::{MetadataExt, PermissionsExt};
+use std::path::Path;
+use std::sync::Mutex;
+
+use log::*;
+use lru::LruCache;
+
+use crate::scoped_path::*;
+
+pub static DEFAULT_CODE_SUFFIXES: &[&str] = &[
+    "so", "py", "pyc", "pyo", "jar", "war", "class", "rb", "js", "mjs", "cjs", "node", "php", "pl",
+    "pm", "sh",
+];
+
+// Share of the executable-location files in the SBOM that a suffix
+// needs to have to be picked up automatically
+const MIN_SBOM_SUFFIX_SHARE: f64 = 0.01;
+
+// Path components of the locations code is expected to be found in
+const CODE_DIRS: &[&str] = &[
+    "bin",
+    "sbin",
+    "lib",
+    "lib32",
+    "lib64",
+    "libx32",
+    "libexec",
+    "site-packages",
+    "dist-packages",
+];
+
+const MAGIC_CACHE_SIZE: NonZeroUsize = unsafe { NonZeroUsize::new_unchecked(4096) };
+
+const S_IXUSR: u32 = 0o100;
+
+// Decides if a file can carry code (and therefore map to a package).
+// Used in the userspace for the files that got past the kernel side
+// filter without a suffix and for the events coming via fanotify.
+pub struct FileTypeFilter {
+    suffixes: Option<HashSet<String>>,
+
+    // (dev, ino) -> has ELF or shebang magic
+    magic_cache: Mutex<LruCache<(u64, u64), bool>>,
+}
+
+impl FileTypeFilter {
+    // No filtering, all files are considered code
+    pub fn none() -> Self {
+        Self {
+            suffixes: None,
+            magic_cache: Mutex::new(LruCache::new(MAGIC_CACHE_SIZE)),
+        }
+    }
+
+    pub fn new<S: AsRef<str>>(suffixes: &[S]) -> Self {
+        let suffixes = suffixes
+            .iter()
+            .map(|s| normalize_suffix(s.as_ref()))
+            .filter(|s| !s.is_empty())
+            .collect();
+
+        Self {
+            suffixes: Some(suffixes),
+            magic_cache: Mutex::new(LruCache::new(MAGIC_CACHE_SIZE)),
+        }
+    }
+
+    pub fn is_enabled(&self) -> bool {
+        self.suffixes.is_some()
+    }
+
+    pub fn suffixes(&self) -> Vec<String> {
+        match &self.suffixes {
+            Some(suffixes) => suffixes.iter().cloned().collect(),
+            None => Vec::new(),
+        }
+    }
+
+    pub fn is_code(&self, path: &RootFsPath, md: &Metadata) -> bool {
+        let suffixes = match &self.suffixes {
+            Some(suffixes) => suffixes,
+            None => return true,
+        };
+
+        match code_suffix(path.as_raw()) {
+            Some(suffix) if suffixes.contains(suffix) => true,
+            _ if md.permissions().mode() & S_IXUSR != 0 => true,
+            Some(_) => false,
+            None => self.has_code_magic(path, md),
+        }
+    }
+
+    fn has_code_magic(&self, path: &RootFsPath, md: &Metadata) -> bool {
+        let key = (md.dev(), md.ino());
+
+        if let Some(is_code) = self.magic_cache.lock().unwrap().get(&key) {
+            return *is_code;
+        }
+
+        let is_code = match read_magic(path.as_raw()) {
+            Ok(magic) => magic.starts_with(b"\x7fELF") || magic.starts_with(b"#!"),
+            Err(err) => {
+                debug!("Failed to read magic of {}: {err}", path.display());
+                false
+            }
+        };
+
+        self.magic_cache.lock().unwrap().put(key, is_code);
+        is_code
+    }
+}
+
+// Suffixes found in the locations of the package files, weighted by their frequency
+pub fn suffixes_from_stats<'a, I: Iterator<Item = &'a Path>>(files: I) -> Vec<String> {
+    let mut stats = std::collections::HashMap::<&str, usize>::new();
+    let mut total = 0usize;
+
+    for path in files {
+        let in_code_dir = path.parent().map_or(false, |dir| {
+            dir.iter().any(|comp| CODE_DIRS.iter().any(|d| comp == *d))
+        });
+
+        if !in_code_dir {
+            continue;
+        }
+
+        total += 1;
+        if let Some(suffix) = code_suffix(path) {
+            *stats.entry(suffix).or_default() += 1;
+        }
+    }
+
+    let min = (total as f64 * MIN_SBOM_SUFFIX_SHARE) as usize;
+
+    stats
+        .into_iter()
+        .filter(|(_, count)| *count > min)
+        .map(|(suffix, _)| suffix.to_string())
+        .collect()
+}
+
+// The same logic as lookup_suffix() in probes.bpf.c: the last dot separated component
+// of the file name, skipping the numeric ones (e.g. libfoo.so.1.2 => so).
+pub fn code_suffix(path: &Path) -> Option<&str> {
+    let name = path.file_name()?.to_str()?;
+    let mut comps = name.rsplit('.').peekable();
+
+    while let Some(comp) = comps.next() {
+        // the first component is the name itself, not a suffix
+        comps.peek()?;
+
+        if comp.is_empty() || !comp.bytes().all(|b| b.is_ascii_digit()) {
+            return Some(comp);
+        }
+    }
+
+    None
+}
+
+fn normalize_suffix(suffix: &str) -> String {
+    // accept ".so", "so" and ".so*" forms
+    suffix
+        .trim()
+        .trim_start_matches('.')
+        .trim_end_matches('*')
+        .to_string()
+}
+
+fn read_magic(path: &Path) -> std::io::Result<Vec<u8>> {
+    let mut magic = Vec::with_capacity(4);
+    std::fs::File::open(path)?.take(4).read_to_end(&mut magic)?;
+    Ok(magic)
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+    use std::path::Path;
+
+    use super::*;
+
+    #[test]
+    fn test_code_suffix() {
+        assert!(code_suffix(Path::new("/usr/lib/os.py")) == Some("py"));
+        assert!(code_suffix(Path::new("/usr/lib/libssl.so.1.1")) == Some("so"));
+        assert!(code_suffix(Path::new("/usr/lib/libc.so.6")) == Some("so"));
+        assert!(code_suffix(Path::new("/usr/bin/python3.11")) == None);
+        assert!(code_suffix(Path::new("/usr/bin/bash")) == None);
+        assert!(code_suffix(Path::new("/etc/.bashrc")) == Some("bashrc"));
+        assert!(code_suffix(Path::new("/data/x.parquet")) == Some("parquet"));
+    }
+
+    #[test]
+    fn test_suffixes_from_stats() {
+        let mut files: Vec<&Path> = vec![Path::new("/usr/share/doc/foo/changelog.gz"); 100];
+        files.extend(vec![Path::new("/usr/lib/python3/dist-packages/a.py"); 50]);
+        files.extend(vec![Path::new("/usr/lib/x86_64-linux-gnu/libfoo.so.1"); 50]);
+        files.push(Path::new("/usr/lib/x86_64-linux-gnu/README.txt"));
+
+        let mut suffixes = suffixes_from_stats(files.into_iter());
+        suffixes.sort();
+
+        assert!(suffixes == vec!["py".to_string(), "so".to_string()]);
+    }
+}
@@ -0,0 +1,326 @@
+// Flight recorder: the last N open events and what the agent decided
+// about them, for post-mortem debugging (e.g. "why is this package not
+// reported as in use?"). Recording is lock-free and costs an atomic
+// increment and a 128-byte copy. The dump is a compact binary file,
+// decoded offline with `edgebit-agent --decode-flight-record <file>`.
+
+use std::cell::UnsafeCell;
+use std::fmt::Write as _;
+use std::path::Path;
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+use std::sync::OnceLock;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use anyhow::{anyhow, Result};
+
+const MAGIC: &[u8; 4] = b"EBFR";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 16;
+
+pub const RECORD_SIZE: usize = 128;
+const WORKLOAD_LEN: usize = 12;
+const PATH_LEN: usize = RECORD_SIZE - 24 - WORKLOAD_LEN;
+
+// Record layout (little endian):
+//   0: timestamp, ns since UNIX epoch (u64)
+//   8: sequence number (u64)
+//  16: pid (u32)
+//  20: verdict (u8)
+//  21: path length (u8)
+//  22: flags (u8), FLAG_TRUNCATED: only the tail of the path was kept
+//  23: reserved (u8)
+//  24: workload, first WORKLOAD_LEN bytes of the id, NUL padded
+//  36: path, the last PATH_LEN bytes
+const FLAG_TRUNCATED: u8 = 1;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(u8)]
+pub enum Verdict {
+    Reported = 0,
+    AlreadyReported = 1,
+    NotAFile = 2,
+    NotCode = 3,
+    Excluded = 4,
+    ResolveFailed = 5,
+    // Dropped by the tracing tier of a converged workload
+    Sampled = 6,
+    IgnoredProcess = 7,
+    NoWorkload = 8,
+}
+
+impl Verdict {
+    fn from_u8(v: u8) -> Option<Self> {
+        let verdict = match v {
+            0 => Verdict::Reported,
+            1 => Verdict::AlreadyReported,
+            2 => Verdict::NotAFile,
+            3 => Verdict::NotCode,
+            4 => Verdict::Excluded,
+            5 => Verdict::ResolveFailed,
+            6 => Verdict::Sampled,
+            7 => Verdict::IgnoredProcess,
+            8 => Verdict::NoWorkload,
+            _ => return None,
+        };
+
+        Some(verdict)
+    }
+}
+
+struct Slot {
+    // Seqlock: odd while being written, 2 * (seq + 1) once complete
+    seq: AtomicU64,
+    data: UnsafeCell<[u8; RECORD_SIZE]>,
+}
+
+pub struct FlightRecorder {
+    slots: Box<[Slot]>,
+    mask: u64,
+    head: AtomicU64,
+}
+
+// The slot data is guarded by the seqlock
+unsafe impl Sync for FlightRecorder {}
+
+impl FlightRecorder {
+    // size is rounded up to a power of 2
+    pub fn new(size: usize) -> Self {
+        let size = size.max(1).next_power_of_two();
+        let slots = (0..size)
+            .map(|_| Slot {
+                seq: AtomicU64::new(0),
+                data: UnsafeCell::new([0; RECORD_SIZE]),
+            })
+            .collect();
+
+        Self {
+            slots,
+            mask: size as u64 - 1,
+            head: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record(&self, verdict: Verdict, pid: u32, workload: &str, path: &[u8]) {
+        let seq = self.head.fetch_add(1, Ordering::Relaxed);
+        let slot = &self.slots[(seq & self.mask) as usize];
+
+        // A writer that lapped the ring is still on this slot, drop the record
+        let cur = slot.seq.load(Ordering::Relaxed);
+        if cur & 1 == 1
+            || slot
+                .seq
+                .compare_exchange(cur, 2 * seq + 1, Ordering::Relaxed, Ordering::Relaxed)
+                .is_err()
+        {
+            return;
+        }
+        fence(Ordering::Release);
+
+        let mut rec = [0u8; RECORD_SIZE];
+        let ts = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .unwrap_or_default()
+            .as_nanos() as u64;
+
+        rec[0..8].copy_from_slice(&ts.to_le_bytes());
+        rec[8..16].copy_from_slice(&seq.to_le_bytes());
+        rec[16..20].copy_from_slice(&pid.to_le_bytes());
+        rec[20] = verdict as u8;
+
+        let (path, truncated) = match path.len().checked_sub(PATH_LEN) {
+            Some(skip) if skip > 0 => (&path[skip..], true),
+            _ => (path, false),
+        };
+        rec[21] = path.len() as u8;
+        rec[22] = if truncated { FLAG_TRUNCATED } else { 0 };
+
+        let workload = &workload.as_bytes()[..workload.len().min(WORKLOAD_LEN)];
+        rec[24..24 + workload.len()].copy_from_slice(workload);
+        rec[24 + WORKLOAD_LEN..24 + WORKLOAD_LEN + path.len()].copy_from_slice(path);
+
+        unsafe { std::ptr::write_volatile(slot.data.get(), rec) };
+        slot.seq.store(2 * seq + 2, Ordering::Release);
+    }
+
+    // The complete records, oldest first, prefixed by the file header
+    pub fn dump(&self) -> Vec<u8> {
+        let mut records: Vec<(u64, [u8; RECORD_SIZE])> = self
+            .slots
+            .iter()
+            .filter_map(|slot| {
+                let before = slot.seq.load(Ordering::Acquire);
+                if before == 0 || before & 1 == 1 {
+                    return None;
+                }
+
+                let rec = unsafe { std::ptr::read_volatile(slot.data.get()) };
+                fence(Ordering::Acquire);
+
+                (slot.seq.load(Ordering::Relaxed) == before).then_some((before, rec))
+            })
+            .collect();
+
+        records.sort_unstable_by_key(|(seq, _)| *seq);
+
+        let mut out = Vec::with_capacity(HEADER_SIZE + records.len() * RECORD_SIZE);
+        out.extend_from_slice(MAGIC);
+        out.extend_from_slice(&VERSION.to_le_bytes());
+        out.extend_from_slice(&(RECORD_SIZE as u32).to_le_bytes());
+        out.extend_from_slice(&(records.len() as u32).to_le_bytes());
+
+        for (_, rec) in &records {
+            out.extend_from_slice(rec);
+        }
+
+        out
+    }
+}
+
+#[derive(Debug, PartialEq, Eq)]
+pub struct Record {
+    pub timestamp_ns: u64,
+    pub seq: u64,
+    pub pid: u32,
+    pub verdict: Option<Verdict>,
+    pub workload: String,
+    pub path: String,
+    pub truncated: bool,
+}
+
+pub fn decode(data: &[u8]) -> Result<Vec<Record>> {
+    if data.len() < HEADER_SIZE || &data[0..4] != MAGIC {
+        return Err(anyhow!("not a flight recorder dump"));
+    }
+
+    let u32_at = |off: usize| u32::from_le_bytes(data[off..off + 4].try_into().unwrap());
+
+    let version = u32_at(4);
+    let rec_size = u32_at(8) as usize;
+    let count = u32_at(12) as usize;
+
+    if version != VERSION || rec_size != RECORD_SIZE {
+        return Err(anyhow!(
+            "unsupported dump version {version}, record size {rec_size}"
+        ));
+    }
+
+    let body = &data[HEADER_SIZE..];
+    if body.len() < count * RECORD_SIZE {
+        return Err(anyhow!("dump is cut off"));
+    }
+
+    let records = body
+        .chunks_exact(RECORD_SIZE)
+        .take(count)
+        .map(|rec| {
+            let path_len = (rec[21] as usize).min(PATH_LEN);
+            let workload = &rec[24..24 + WORKLOAD_LEN];
+            let workload_len = workload
+                .iter()
+                .position(|b| *b == 0)
+                .unwrap_or(WORKLOAD_LEN);
+            let path_start = 24 + WORKLOAD_LEN;
+
+            Record {
+                timestamp_ns: u64::from_le_bytes(rec[0..8].try_into().unwrap()),
+                seq: u64::from_le_bytes(rec[8..16].try_into().unwrap()),
+                pid: u32::from_le_bytes(rec[16..20].try_into().unwrap()),
+                verdict: Verdict::from_u8(rec[20]),
+                workload: String::from_utf8_lossy(&workload[..workload_len]).to_string(),
+                path: String::from_utf8_lossy(&rec[path_start..path_start + path_len]).to_string(),
+                truncated: rec[22] & FLAG_TRUNCATED != 0,
+            }
+        })
+        .collect();
+
+    Ok(records)
+}
+
+// One line per record, for --decode-flight-record
+pub fn format(records: &[Record]) -> String {
+    let mut out = String::new();
+
+    for r in records {
+        let ts = chrono::DateTime::from_timestamp(
+            (r.timestamp_ns / 1_000_000_000) as i64,
+            (r.timestamp_ns % 1_000_000_000) as u32,
+        )
+        .map(|t| t.format("%Y-%m-%dT%H:%M:%S%.6fZ").to_string())
+        .unwrap_or_default();
+
+        let verdict = match r.verdict {
+            Some(v) => format!("{v:?}"),
+            None => "?".to_string(),
+        };
+        let ellipsis = if r.truncated { "..." } else { "" };
+
+        _ = writeln!(
+            out,
+            "{ts} #{} pid={} {:<12} {verdict:<16} {ellipsis}{}",
+            r.seq, r.pid, r.workload, r.path
+        );
+    }
+
+    out
+}
+
+static RECORDER: OnceLock<FlightRecorder> = OnceLock::new();
+
+pub fn init(size: usize) {
+    _ = RECORDER.set(FlightRecorder::new(size));
+}
+
+// No-op unless the recorder was initialized
+#[inline]
+pub fn record(verdict: Verdict, pid: u32, workload: &str, path: &Path) {
+    if let Some(recorder) = RECORDER.get() {
+        use std::os::unix::ffi::OsStrExt;
+        recorder.record(verdict, pid, workload, path.as_os_str().as_bytes());
+    }
+}
+
+pub fn is_enabled() -> bool {
+    RECORDER.get().is_some()
+}
+
+pub fn dump() -> Option<Vec<u8>> {
+    RECORDER.get().map(|r| r.dump())
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+
+    #[test]
+    fn test_record_and_decode() {
+        let recorder = FlightRecorder::new(3);
+
+        recorder.record(Verdict::Reported, 1, "host", b"/usr/lib/libc.so.6");
+        recorder.record(Verdict::NotCode, 2, "0123456789abcdef", b"/etc/passwd");
+
+        let records = decode(&recorder.dump()).unwrap();
+        assert!(records.len() == 2);
+        assert!(records[0].verdict == Some(Verdict::Reported));
+        assert!(records[0].path == "/usr/lib/libc.so.6");
+        assert!(records[1].workload == "0123456789ab");
+        assert!(records[1].pid == 2);
+    }
+
+    #[test]
+    fn test_ring_wraps() {
+        let recorder = FlightRecorder::new(4);
+
+        let long_path = format!("/{}", "x".repeat(200));
+        for pid in 0..10 {
+            recorder.record(Verdict::Excluded, pid, "host", long_path.as_bytes());
+        }
+
+        let records = decode(&recorder.dump()).unwrap();
+        let pids: Vec<_> = records.iter().map(|r| r.pid).collect();
+        assert!(pids == vec![6, 7, 8, 9]);
+        assert!(records[0].truncated);
+        assert!(records[0].path.len() == PATH_LEN);
+    }
+}
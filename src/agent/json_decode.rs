@@ -0,0 +1,62 @@
+// Decoding of the larger JSON documents (SBOMs, OCI runtime specs, CRI
+// metadata). simd-json finds the structure of the document with SIMD
+// instructions (selected at runtime) and then feeds the serde derives, so
+// the target structs only declare the fields that are needed: everything
+// else is skipped without building any values for it.
+
+use anyhow::{anyhow, Result};
+use serde::Deserialize;
+
+// The document is parsed in place, buf is left scrambled
+pub fn from_slice<'a, T: Deserialize<'a>>(buf: &'a mut [u8]) -> Result<T> {
+    simd_json::serde::from_slice(buf).map_err(|err| anyhow!("{err}"))
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+
+    #[derive(Deserialize)]
+    struct Spec {
+        #[serde(rename = "ociVersion")]
+        version: String,
+
+        #[serde(default)]
+        mounts: Vec<Mount>,
+    }
+
+    #[derive(Deserialize)]
+    struct Mount {
+        destination: String,
+    }
+
+    #[test]
+    fn test_from_slice() {
+        let mut doc = br#"{
+            "ociVersion": "1.1.0",
+            "process": {"args": ["/pause"], "env": ["PATH=/bin"], "rlimits": []},
+            "mounts": [
+                {"destination": "/proc", "type": "proc", "options": ["nosuid"]},
+                {"destination": "/dev", "source": "tmpfs"}
+            ],
+            "linux": {"namespaces": [{"type": "pid"}], "seccomp": {"syscalls": []}},
+            "hooks": {"createRuntime": [{"path": "/bin/hook"}]}
+        }"#
+        .to_vec();
+
+        let spec: Spec = from_slice(&mut doc).unwrap();
+        assert!(spec.version == "1.1.0");
+
+        let mounts: Vec<_> = spec.mounts.iter().map(|m| m.destination.as_str()).collect();
+        assert!(mounts == ["/proc", "/dev"]);
+
+        let mut doc = br#"{"ociVersion": "1.0.2"}"#.to_vec();
+        let spec: Spec = from_slice(&mut doc).unwrap();
+        assert!(spec.mounts.is_empty());
+
+        let mut doc = br#"{"ociVersion": 1"#.to_vec();
+        assert!(from_slice::<Spec>(&mut doc).is_err());
+    }
+}
@@ -1,20 +1,39 @@
+pub mod admin;
+pub mod alloc_stats;
+pub mod backoff;
+pub mod binary_id;
 pub mod chroot_cmd;
 pub mod cloud_metadata;
 pub mod config;
 pub mod containers;
+pub mod export;
 pub mod fanotify;
+pub mod file_type;
+pub mod flight;
 pub mod jitter;
+pub mod json_decode;
 pub mod label;
+pub mod mappings;
+pub mod mmap;
 pub mod open_monitor;
 pub mod platform;
+pub mod residency;
 pub mod sbom;
 pub mod scoped_path;
+pub mod sinks;
+#[cfg(test)]
+mod soak;
+pub mod startup;
+pub mod store;
+#[cfg(test)]
+mod test_util;
+pub mod usage;
 pub mod version;
 pub mod workloads;
 
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::path::{Path, PathBuf};
-use std::sync::Arc;
+use std::sync::{Arc, Mutex};
 use std::time::{Duration, Instant, SystemTime};
 
 use anyhow::{anyhow, Result};
@@ -23,17 +42,28 @@ use log::*;
 use prost_types::Timestamp;
 use tokio::sync::mpsc::Receiver;
 
+use backoff::Backoff;
+use binary_id::{BinaryIdentifier, BinaryIdentifierArc};
 use config::Config;
 use containers::{ContainerInfo, Containers};
+use export::{ExportWorker, Exporter};
+use file_type::FileTypeFilter;
 use jitter::JitteredDuration;
 use platform::pb;
+use residency::InUseEngine;
 use sbom::Sbom;
 use scoped_path::*;
+use sinks::{Backpressure, EventBatch, SinkRegistry};
+use startup::StartupProfile;
+use store::{InUseStore, InUseStoreArc};
+use usage::USAGE_EPOCH;
 use version::VERSION;
 use workloads::host::HostWorkload;
 use workloads::{Event, Workloads};
 
-use crate::open_monitor::{FileOpenMonitorArc, NullOpenMonitor, OpenEvent, OpenMonitor};
+use crate::open_monitor::{
+    CgroupEvent, FileOpenMonitorArc, NullOpenMonitor, OpenMonitor, ProcessFilters,
+};
 use crate::workloads::track_container_lifecycle;
 
 use crate::cloud_metadata::CloudMetadata;
@@ -46,6 +76,16 @@ const TIMESTAMP_INFINITY: Timestamp = Timestamp {
 const HEARTBEAT_INTERVAL: Duration = Duration::from_secs(300);
 const HEARTBEAT_JITTER: Duration = Duration::from_secs(30);
 
+// Report retries while EdgeBit is unreachable, see Backoff
+const REPORT_RETRY_BASE: Duration = Duration::from_secs(1);
+const REPORT_RETRY_CAP: Duration = Duration::from_secs(60);
+
+// Bound on the files held back for the next report (without the local store)
+const MAX_HELD_FILES: usize = 64 * 1024;
+
+// Files per request when resending the local store, well within the gRPC message size limit
+const RESEND_CHUNK: usize = 4096;
+
 const MACHINE_ID_PATH: &str = "etc/machine-id";
 
 #[derive(Parser)]
@@ -64,19 +104,38 @@ struct CliArgs {
 
     #[clap(long = "hostname")]
     hostname: Option<String>,
+
+    // Prints a flight recorder dump and exits
+    #[clap(long = "decode-flight-record")]
+    decode_flight_record: Option<PathBuf>,
 }
 
 #[tokio::main]
 async fn main() {
     let args = CliArgs::parse();
 
+    if let Some(path) = &args.decode_flight_record {
+        match std::fs::read(path)
+            .map_err(anyhow::Error::from)
+            .and_then(|d| flight::decode(&d))
+        {
+            Ok(records) => print!("{}", flight::format(&records)),
+            Err(err) => eprintln!("{}: {err}", path.display()),
+        }
+        return;
+    }
+
     match run(&args).await {
-        Ok(_) => {}
+        // Not waiting for the blocking tasks polling the BPF buffers, they don't return
+        Ok(_) => std::process::exit(0),
         Err(err) => eprintln!("{err}"),
     }
 }
 
 async fn run(args: &CliArgs) -> Result<()> {
+    let mut startup = StartupProfile::new();
+
+    let phase = startup.begin("config");
     let config_path = match &args.config {
         Some(path) => PathBuf::from(path),
         None => PathBuf::from(config::CONFIG_PATH),
@@ -89,6 +148,15 @@ async fn run(args: &CliArgs) -> Result<()> {
 
     std::env::set_var("RUST_LOG", config.log_level());
     pretty_env_logger::init();
+    startup.end(phase);
+
+    startup.set_trace_path(config.startup_trace());
+    let startup = Arc::new(startup);
+
+    if config.flight_recorder_size() > 0 {
+        flight::init(config.flight_recorder_size());
+        tokio::task::spawn(dump_flight_record_on_signal(config.store_dir()));
+    }
 
     info!("EdgeBit Agent v{VERSION}");
 
@@ -97,31 +165,114 @@ async fn run(args: &CliArgs) -> Result<()> {
     let host_root = RootFsPath::from(config.host_root());
     let machine_id = read_machine_id(&host_root.join(MACHINE_ID_PATH))?;
 
+    let phase = startup.begin("local_outputs");
+    let store: Option<InUseStoreArc> = if config.local_store() {
+        let store = InUseStore::open(&config.store_dir(), config.store_retention_days())
+            .map_err(|err| anyhow!("Error opening the local store: {err}"))?;
+        Some(Arc::new(Mutex::new(store)))
+    } else {
+        None
+    };
+
+    let exporter: Option<ExportWorker> = match config.export_dir() {
+        Some(dir) => {
+            let exporter = Exporter::new(&dir, config.export_format()?)
+                .map_err(|err| anyhow!("Error starting the export: {err}"))?;
+            Some(ExportWorker::start(exporter)?)
+        }
+        None => None,
+    };
+
+    let outputs = LocalOutputs {
+        store: store.clone(),
+        exporter,
+    };
+    startup.end(phase);
+
+    if let Some(addr) = config.admin_addr()? {
+        let admin = Arc::new(admin::Admin {
+            store: store.clone(),
+            startup: startup.clone(),
+        });
+
+        tokio::task::spawn(async move {
+            if let Err(err) = admin::serve(addr, admin).await {
+                error!("Admin interface: {err}");
+            }
+        });
+    }
+
     info!("Connecting to EdgeBit at {url}");
+    let phase = startup.begin("connect");
     let mut client =
         platform::Client::connect(url.try_into()?, token, config.hostname(), machine_id).await?;
+    startup.end(phase);
 
-    let host_image_id = if config.machine_sbom() {
-        load_sbom(args, config.clone(), &mut client).await?.id()
+    let (host_sbom, host_image_id) = if config.machine_sbom() {
+        let phase = startup.begin("load_sbom");
+        let (sbom, image_id) = load_sbom(args, config.clone(), &mut client, &startup).await?;
+        startup.end(phase);
+        (Some(sbom), image_id)
     } else {
-        String::new()
+        (None, String::new())
     };
 
+    if let (Some(exporter), Some(sbom)) = (&outputs.exporter, &host_sbom) {
+        exporter.packages(&host_image_id, export::package_files(sbom, &host_root));
+    }
+    let file_types = Arc::new(file_type_filter(&config, host_sbom.as_ref()));
+
+    let phase = startup.begin("reset_workloads");
     client.reset_workloads().await?;
+    startup.end(phase);
 
+    let phase = startup.begin("cloud_metadata");
     let cloud_meta = CloudMetadata::load().await;
+    startup.end(phase);
+
+    // Only the tracing engine attaches the open probes
+    let in_use_engine = config
+        .pkg_tracking()
+        .then(|| config.in_use_engine())
+        .transpose()?;
+    let residency = in_use_engine == Some(InUseEngine::Residency);
+
+    let phase = startup.begin("bpf_load");
+    let (open_mon, open_rx) = match in_use_engine {
+        Some(InUseEngine::Tracing) => {
+            let (sinks, rx) = register_sinks(&outputs);
+
+            let (cgroup_tx, cgroup_rx) = tokio::sync::mpsc::channel::<CgroupEvent>(100);
+            let filters = process_filters(&config, &host_root)?;
+            let mon: FileOpenMonitorArc = Arc::new(OpenMonitor::start(
+                Arc::new(sinks),
+                cgroup_tx,
+                &filters,
+                &file_types,
+            )?);
+            (mon, Some((rx, cgroup_rx)))
+        }
+        Some(InUseEngine::Mappings) => {
+            // The sampled mappings go the same way as the traced opens
+            let (sinks, rx) = register_sinks(&outputs);
 
-    let (open_mon, open_rx) = if config.pkg_tracking() {
-        let (tx, rx) = tokio::sync::mpsc::channel::<OpenEvent>(1000);
-        let mon: FileOpenMonitorArc = Arc::new(OpenMonitor::start(tx)?);
-        (mon, Some(rx))
-    } else {
-        let mon: FileOpenMonitorArc = Arc::new(NullOpenMonitor);
-        (mon, None)
+            let (cgroup_tx, cgroup_rx) = tokio::sync::mpsc::channel::<CgroupEvent>(100);
+            mappings::start(Arc::new(sinks), cgroup_tx, config.mappings_interval())?;
+
+            let mon: FileOpenMonitorArc = Arc::new(NullOpenMonitor);
+            (mon, Some((rx, cgroup_rx)))
+        }
+        Some(InUseEngine::Residency) | None => {
+            let mon: FileOpenMonitorArc = Arc::new(NullOpenMonitor);
+            (mon, None)
+        }
     };
+    startup.end(phase);
 
+    // The bootstrap of the running containers completes in the background
     let (cont_tx, cont_rx) = tokio::sync::mpsc::channel(10);
-    let mut containers = Containers::new(config.clone(), cloud_meta.clone(), cont_tx);
+    let mut containers =
+        Containers::new(config.clone(), cloud_meta.clone(), cont_tx, startup.clone());
     if let Some(host) = config.docker_host() {
         containers.track_docker(host);
     }
@@ -130,18 +281,48 @@ async fn run(args: &CliArgs) -> Result<()> {
         containers.track_k8s(host);
     }
 
+    let phase = startup.begin("binary_ids");
+    let binary_ids = if config.pkg_tracking() && config.binary_ids() {
+        Some(Arc::new(BinaryIdentifier::start()?))
+    } else {
+        None
+    };
+    startup.end(phase);
+
+    let sbom_files: HashSet<WorkloadPath> = host_sbom
+        .as_ref()
+        .map(|sbom| sbom.file_paths(&host_root).into_iter().collect())
+        .unwrap_or_default();
+
+    let residency_files: Vec<WorkloadPath> = if residency {
+        sbom_files.iter().cloned().collect()
+    } else {
+        Vec::new()
+    };
+
     let (events_tx, events_rx) = tokio::sync::mpsc::channel::<Event>(1000);
+    let phase = startup.begin("host_workload");
     let host_wrkld = HostWorkload::new(
         host_image_id,
         config.clone(),
         open_mon.clone(),
+        file_types.clone(),
         cloud_meta.host_labels(),
+        binary_ids.clone(),
+        sbom_files,
     )?;
 
-    register_host_workload(&mut client, &host_wrkld, config.labels()).await?;
+    register_host_workload(&mut client, &outputs, &host_wrkld, config.labels()).await?;
+    startup.end(phase);
 
     let containers = Arc::new(containers);
-    let workloads = Workloads::new(config.clone(), host_wrkld, open_mon.clone());
+    let workloads = Workloads::new(
+        config.clone(),
+        host_wrkld,
+        open_mon.clone(),
+        file_types.clone(),
+        binary_ids.clone(),
+    );
 
     tokio::task::spawn(track_container_lifecycle(
         cont_rx,
@@ -149,84 +330,404 @@ async fn run(args: &CliArgs) -> Result<()> {
         events_tx.clone(),
     ));
 
-    if let Some(rx) = open_rx {
+    if let Some((rx, cgroup_rx)) = open_rx {
         tokio::task::spawn(workloads::in_use::track_pkgs_in_use(
             containers.clone(),
             workloads.clone(),
             rx,
+            cgroup_rx,
         ));
     }
 
+    if !residency_files.is_empty() {
+        residency::start(
+            host_root.clone(),
+            residency_files,
+            file_types,
+            workloads.host.clone(),
+        )?;
+    } else if residency {
+        warn!("The residency engine needs the host SBOM, no files will be reported in use");
+    }
+
+    startup.ready();
+
     info!("Monitoring workloads");
-    monitor(config, workloads, &mut client, events_rx).await;
+    tokio::select! {
+        _ = monitor(
+            config,
+            workloads,
+            binary_ids,
+            outputs.clone(),
+            &mut client,
+            events_rx,
+        ) => (),
+        _ = shutdown_signal() => info!("Shutting down"),
+    }
+
+    // The files being exported only get their final name once closed
+    if let Some(exporter) = outputs.exporter {
+        let res = tokio::task::spawn_blocking(move || exporter.close())
+            .await
+            .map_err(anyhow::Error::from)
+            .and_then(|res| res);
+        if let Err(err) = res {
+            error!("Failed to finish the export: {err}");
+        }
+    }
 
     Ok(())
 }
 
+// Returns the registry and the receiving end of the in-use sink
+fn register_sinks(outputs: &LocalOutputs) -> (SinkRegistry, Receiver<EventBatch>) {
+    // Reporting must not lose events, the other sinks can drop theirs
+    let mut sinks = SinkRegistry::new();
+    let in_use_rx = sinks.register("in-use", 100, Backpressure::Block);
+
+    if let Some(exporter) = &outputs.exporter {
+        let rx = sinks.register("export", 100, Backpressure::Drop);
+        // Only hands the batches over to the export thread
+        tokio::task::spawn(export_opens(exporter.clone(), rx));
+    }
+
+    (sinks, in_use_rx)
+}
+
+async fn export_opens(exporter: ExportWorker, mut rx: Receiver<EventBatch>) {
+    while let Some(batch) = rx.recv().await {
+        exporter.opens(batch);
+    }
+}
+
+// Resolves on SIGTERM or SIGINT
+async fn shutdown_signal() {
+    use tokio::signal::unix::{signal, SignalKind};
+
+    let mut sigterm = match signal(SignalKind::terminate()) {
+        Ok(sig) => sig,
+        Err(err) => {
+            error!("Failed to install the SIGTERM handler: {err}");
+            return std::future::pending().await;
+        }
+    };
+
+    tokio::select! {
+        _ = sigterm.recv() => (),
+        _ = tokio::signal::ctrl_c() => (),
+    }
+}
+
+// SIGUSR1 writes the flight recorder to a file in dir
+async fn dump_flight_record_on_signal(dir: PathBuf) {
+    use tokio::signal::unix::{signal, SignalKind};
+
+    let mut sigusr1 = match signal(SignalKind::user_defined1()) {
+        Ok(sig) => sig,
+        Err(err) => {
+            error!("Failed to install the SIGUSR1 handler: {err}");
+            return;
+        }
+    };
+
+    while sigusr1.recv().await.is_some() {
+        let Some(dump) = flight::dump() else {
+            continue;
+        };
+
+        let secs = SystemTime::now()
+            .duration_since(SystemTime::UNIX_EPOCH)
+            .unwrap_or_default()
+            .as_secs();
+        let path = dir.join(format!("flight-{secs}.bin"));
+
+        match std::fs::create_dir_all(&dir).and_then(|_| std::fs::write(&path, dump)) {
+            Ok(()) => info!("Flight recorder written to {}", path.display()),
+            Err(err) => error!("Failed to write the flight recorder: {err}"),
+        }
+    }
+}
+
+// Where the reported data goes to on the node, in addition to EdgeBit
+#[derive(Clone)]
+struct LocalOutputs {
+    store: Option<InUseStoreArc>,
+    exporter: Option<ExportWorker>,
+}
+
+impl LocalOutputs {
+    fn workload(&self, req: &pb::UpsertWorkloadRequest) {
+        if let Some(exporter) = &self.exporter {
+            exporter.workload(req);
+        }
+    }
+}
+
 async fn monitor(
     config: Arc<Config>,
     workloads: Workloads,
+    binary_ids: Option<BinaryIdentifierArc>,
+    outputs: LocalOutputs,
     client: &mut platform::Client,
     mut events: Receiver<Event>,
 ) {
     let mut periods = tokio::time::interval(Duration::from_millis(1000));
+    let mut usage_periods = tokio::time::interval(USAGE_EPOCH);
+    let usage_summaries = config.usage_summaries();
     let labels = config.labels();
 
     let mut last_reported = Instant::now();
     let mut jitter = JitteredDuration::new(HEARTBEAT_JITTER);
+    let mut retry = ReportRetry::new();
 
     loop {
         tokio::select! {
             evt = events.recv() => {
                 match evt {
-                    Some(Event::ContainerStarted(id, info)) => handle_container_started(client, id, info, labels.clone()).await,
-                    Some(Event::ContainerStopped(id, info)) => handle_container_stopped(client, id, info).await,
+                    Some(Event::ContainerStarted(id, info)) => handle_container_started(client, &outputs, id, info, labels.clone()).await,
+                    Some(Event::ContainerStopped(id, info)) => handle_container_stopped(client, &outputs, id, info).await,
                     None => break,
                 }
             },
             _ = periods.tick() => {
                 let mut reported = false;
 
+                if retry.backoff.ready() {
+                    for (id, pkgs) in retry.take_held() {
+                        send_in_use(client, &outputs.store, &mut retry, id, pkgs).await;
+                    }
+                }
+
                 let (host_id, pkgs) = workloads.host.lock()
                     .unwrap()
                     .flush_in_use();
 
                 if !pkgs.is_empty() {
-                    if let Err(err) = client.report_in_use(host_id.clone(), pkgs).await {
-                        error!("Failed to report-in-use: {err}");
-                    }
-
+                    report_in_use(client, &outputs, &mut retry, host_id.clone(), pkgs).await;
                     reported = true;
                 }
 
-                let batches = workloads.containers.lock()
-                    .unwrap()
-                    .flush_in_use();
+                let batches = {
+                    let mut containers = workloads.containers.lock().unwrap();
+                    containers.update_tiers();
+                    containers.flush_in_use()
+                };
 
                 for (id, pkgs) in batches {
                     if !pkgs.is_empty() {
-                        if let Err(err) = client.report_in_use(id, pkgs).await {
-                            error!("Failed to report-in-use: {err}");
-                        }
-
+                        report_in_use(client, &outputs, &mut retry, id, pkgs).await;
                         reported = true;
                     }
                 }
 
+                if let Some(store) = &outputs.store {
+                    let res = store.lock().unwrap().compact();
+                    if let Err(err) = res {
+                        error!("Failed to compact the local store: {err}");
+                    }
+                }
+
+                if let Some(binary_ids) = &binary_ids {
+                    for (id, binaries) in binary_ids.flush() {
+                        if let Err(err) = client.report_binary_ids(id, binaries).await {
+                            error!("Failed to report-binary-ids: {err}");
+                        }
+                    }
+                }
+
                 if reported {
                     last_reported = Instant::now();
-                } else if last_reported.elapsed() >= jitter.add(HEARTBEAT_INTERVAL) {
-                    if let Err(err) = client.report_in_use(host_id, Vec::new()).await {
-                        error!("Failed to report-in-use (heartbeat): {err}");
+                } else if last_reported.elapsed() >= jitter.add(HEARTBEAT_INTERVAL)
+                    && retry.backoff.ready()
+                {
+                    match client.report_in_use(host_id, &[]).await {
+                        Ok(()) => {
+                            retry.backoff.succeeded();
+                            sync_store(client, &outputs.store, &mut retry).await;
+                        }
+                        Err(err) => {
+                            error!("Failed to report-in-use (heartbeat): {err}");
+                            retry.backoff.failed(&err, platform::retry_after(&err));
+                        }
                     }
 
                     last_reported = Instant::now();
                 }
+            },
+            _ = usage_periods.tick(), if usage_summaries => {
+                let mut summaries = workloads.containers.lock()
+                    .unwrap()
+                    .usage_summaries();
+
+                summaries.push(workloads.host.lock().unwrap().usage_summary());
+
+                for (id, usage) in summaries {
+                    if !usage.is_empty() {
+                        if let Err(err) = client.report_usage_summary(id, usage).await {
+                            error!("Failed to report-usage-summary: {err}");
+                        }
+                    }
+                }
             }
         }
     }
 }
 
+// Paces the reports while EdgeBit is unreachable. The files not reported
+// in the meantime are resent from the local store if enabled, otherwise
+// they are held back (up to MAX_HELD_FILES) and sent once it's back.
+struct ReportRetry {
+    backoff: Backoff,
+    held: HashMap<String, Vec<WorkloadPath>>,
+    held_files: usize,
+}
+
+impl ReportRetry {
+    fn new() -> Self {
+        Self {
+            backoff: Backoff::new("report", REPORT_RETRY_BASE, REPORT_RETRY_CAP),
+            held: HashMap::new(),
+            held_files: 0,
+        }
+    }
+
+    fn defer(
+        &mut self,
+        store: &Option<InUseStoreArc>,
+        workload_id: String,
+        files: Vec<WorkloadPath>,
+    ) {
+        if let Some(store) = store {
+            let res = store.lock().unwrap().mark_unsynced();
+            if let Err(err) = res {
+                error!("Failed to update the local store: {err}");
+            }
+            return;
+        }
+
+        if self.held_files + files.len() > MAX_HELD_FILES {
+            warn!(
+                "Too many in-use files held back, dropping {} of {workload_id}",
+                files.len()
+            );
+            return;
+        }
+
+        self.held_files += files.len();
+        self.held.entry(workload_id).or_default().extend(files);
+    }
+
+    fn take_held(&mut self) -> HashMap<String, Vec<WorkloadPath>> {
+        self.held_files = 0;
+        std::mem::take(&mut self.held)
+    }
+}
+
+// Records the files in the local store and the export (if enabled) and reports them.
+// The first successful report after a failure resends the stored history.
+async fn report_in_use(
+    client: &mut platform::Client,
+    outputs: &LocalOutputs,
+    retry: &mut ReportRetry,
+    workload_id: String,
+    files: Vec<WorkloadPath>,
+) {
+    let store = &outputs.store;
+
+    if let Some(exporter) = &outputs.exporter {
+        exporter.in_use(&workload_id, &files);
+    }
+
+    if let Some(store) = store {
+        let res = store.lock().unwrap().record(&workload_id, &files);
+        if let Err(err) = res {
+            error!("Failed to record in-use files in the local store: {err}");
+        }
+    }
+
+    send_in_use(client, store, retry, workload_id, files).await;
+}
+
+async fn send_in_use(
+    client: &mut platform::Client,
+    store: &Option<InUseStoreArc>,
+    retry: &mut ReportRetry,
+    workload_id: String,
+    files: Vec<WorkloadPath>,
+) {
+    if !retry.backoff.ready() {
+        retry.defer(store, workload_id, files);
+        return;
+    }
+
+    match client.report_in_use(workload_id.clone(), &files).await {
+        Ok(()) => {
+            retry.backoff.succeeded();
+            sync_store(client, store, retry).await;
+        }
+        Err(err) => {
+            error!("Failed to report-in-use: {err}");
+            retry.backoff.failed(&err, platform::retry_after(&err));
+            retry.defer(store, workload_id, files);
+        }
+    }
+}
+
+// Resends, in chunks of up to RESEND_CHUNK files per workload, what was recorded
+// while the server was unreachable. A failure backs off the resend as well as the
+// reports, the store stays unsynced and the history is resent in full later on.
+async fn sync_store(
+    client: &mut platform::Client,
+    store: &Option<InUseStoreArc>,
+    retry: &mut ReportRetry,
+) {
+    let store = match store {
+        Some(store) => store,
+        None => return,
+    };
+
+    if !retry.backoff.ready() {
+        return;
+    }
+
+    let unsynced = {
+        let store = store.lock().unwrap();
+        if !store.is_unsynced() {
+            return;
+        }
+
+        store.unsynced()
+    };
+
+    let unsynced = match unsynced {
+        Ok(unsynced) => unsynced,
+        Err(err) => {
+            error!("Failed to read the local store: {err}");
+            return;
+        }
+    };
+
+    info!(
+        "Resending the in-use history of {} workloads",
+        unsynced.len()
+    );
+
+    for (id, files) in unsynced {
+        for chunk in files.chunks(RESEND_CHUNK) {
+            if let Err(err) = client.report_in_use(id.clone(), chunk).await {
+                error!("Failed to resend in-use history: {err}");
+                retry.backoff.failed(&err, platform::retry_after(&err));
+                return;
+            }
+        }
+    }
+
+    let res = store.lock().unwrap().mark_synced();
+    if let Err(err) = res {
+        error!("Failed to update the local store: {err}");
+    }
+}
+
 fn to_upsert_workload_req(
     workload: &HostWorkload,
     mut extra_labels: HashMap<String, String>,
@@ -260,6 +761,7 @@ fn to_upsert_workload_req(
 
 async fn handle_container_started(
     client: &mut platform::Client,
+    outputs: &LocalOutputs,
     id: String,
     info: ContainerInfo,
     mut extra_labels: HashMap<String, String>,
@@ -270,99 +772,200 @@ async fn handle_container_started(
     let mut labels = info.labels.clone();
     labels.extend(extra_labels.drain());
 
-    let res = client
-        .upsert_workload(pb::UpsertWorkloadRequest {
-            workload_id: id,
-            workload: Some(pb::Workload {
-                labels,
-                kind: Some(pb::workload::Kind::Container(pb::Container {
-                    name: info.name.unwrap_or_default(),
-                })),
-            }),
-            start_time: info.start_time.map(|t| t.into()),
-            end_time: Some(TIMESTAMP_INFINITY),
-            image_id: info.image_id.unwrap_or_default(),
-            image: Some(pb::Image {
-                kind: Some(pb::image::Kind::Docker(pb::DockerImage {
-                    tag: info.image.unwrap_or_default(),
-                })),
-            }),
-            machine_id: String::new(),
-        })
-        .await;
+    let req = pb::UpsertWorkloadRequest {
+        workload_id: id,
+        workload: Some(pb::Workload {
+            labels,
+            kind: Some(pb::workload::Kind::Container(pb::Container {
+                name: info.name.unwrap_or_default(),
+            })),
+        }),
+        start_time: info.start_time.map(|t| t.into()),
+        end_time: Some(TIMESTAMP_INFINITY),
+        image_id: info.image_id.unwrap_or_default(),
+        image: Some(pb::Image {
+            kind: Some(pb::image::Kind::Docker(pb::DockerImage {
+                tag: info.image.unwrap_or_default(),
+            })),
+        }),
+        machine_id: String::new(),
+    };
+
+    outputs.workload(&req);
+    let res = client.upsert_workload(req).await;
 
     if let Err(err) = res {
         error!("Failed to register container started: {err}");
     }
 }
 
-async fn handle_container_stopped(client: &mut platform::Client, id: String, info: ContainerInfo) {
+async fn handle_container_stopped(
+    client: &mut platform::Client,
+    outputs: &LocalOutputs,
+    id: String,
+    info: ContainerInfo,
+) {
     info!("Registering container stopped: {id}");
 
-    let res = client
-        .upsert_workload(pb::UpsertWorkloadRequest {
-            workload_id: id,
-            end_time: info.end_time.map(|t| t.into()),
-            ..Default::default()
-        })
-        .await;
+    let req = pb::UpsertWorkloadRequest {
+        workload_id: id,
+        end_time: info.end_time.map(|t| t.into()),
+        ..Default::default()
+    };
+
+    outputs.workload(&req);
+    let res = client.upsert_workload(req).await;
 
     if let Err(err) = res {
         error!("Failed to register container stopped: {err}");
     }
 }
 
+// Returns the SBOM and the image id it is known under by EdgeBit
 async fn load_sbom(
     args: &CliArgs,
     config: Arc<Config>,
     client: &mut platform::Client,
-) -> Result<Sbom> {
+    startup: &StartupProfile,
+) -> Result<(Sbom, String)> {
     let sbom = match &args.sbom {
         Some(sbom_path) => {
             info!("Loading SBOM");
             let sbom = Sbom::load(&sbom_path.into())?;
 
-            if !args.no_sbom_upload {
-                upload_sbom(client, sbom_path, sbom.id()).await?;
-            }
+            let image_id = if !args.no_sbom_upload {
+                let phase = startup.begin("upload_sbom");
+                let image_id = upload_sbom(client, sbom_path, sbom.id()).await?;
+                startup.end(phase);
+                image_id
+            } else {
+                sbom.id()
+            };
 
-            sbom
+            (sbom, image_id)
         }
         None => {
             info!("Generating SBOM");
             let host_root = RootFsPath::from(config.host_root());
+            let phase = startup.begin("generate_sbom");
             let tmp_file = sbom::generate(config.clone(), &host_root).await?;
+            startup.end(phase);
             let sbom = Sbom::load(&tmp_file.path().into())?;
 
-            if !args.no_sbom_upload {
-                upload_sbom(client, tmp_file.path(), sbom.id()).await?;
-            }
+            let image_id = if !args.no_sbom_upload {
+                let phase = startup.begin("upload_sbom");
+                let image_id = upload_sbom(client, tmp_file.path(), sbom.id()).await?;
+                startup.end(phase);
+                image_id
+            } else {
+                sbom.id()
+            };
 
-            sbom
+            (sbom, image_id)
         }
     };
 
     Ok(sbom)
 }
 
-async fn upload_sbom(client: &mut platform::Client, path: &Path, image_id: String) -> Result<()> {
+// Skips the upload if an SBOM with the same content was already uploaded,
+// e.g. by another node built from the same image, and returns its image id
+async fn upload_sbom(
+    client: &mut platform::Client,
+    path: &Path,
+    image_id: String,
+) -> Result<String> {
+    let content_hash = match sbom::content_hash(path) {
+        Ok(hash) => Some(hash),
+        Err(err) => {
+            warn!("Failed to hash the SBOM: {err}");
+            None
+        }
+    };
+
+    if let Some(hash) = &content_hash {
+        match client.lookup_sbom(hash.clone()).await {
+            Ok(Some(existing_id)) => {
+                info!("SBOM already uploaded as {existing_id}, skipping the upload");
+                return Ok(existing_id);
+            }
+            Ok(None) => (),
+            Err(err) => warn!("Failed to look up the SBOM: {err}"),
+        }
+    }
+
     info!("Uploading SBOM to EdgeBit");
     let f = std::fs::File::open(path)?;
-    client.upload_sbom(image_id, f).await?;
-    Ok(())
+    client.upload_sbom(image_id.clone(), f).await?;
+
+    if let Some(hash) = content_hash {
+        if let Err(err) = client.record_sbom(hash, image_id.clone()).await {
+            warn!("Failed to record the SBOM content hash: {err}");
+        }
+    }
+
+    Ok(image_id)
 }
 
 async fn register_host_workload(
     client: &mut platform::Client,
+    outputs: &LocalOutputs,
     workload: &HostWorkload,
     extra_labels: HashMap<String, String>,
 ) -> Result<()> {
     info!("Registering BaseOS workload");
     let req = to_upsert_workload_req(workload, extra_labels);
+    outputs.workload(&req);
     client.upsert_workload(req).await?;
     Ok(())
 }
 
+fn process_filters(config: &Config, host_root: &RootFsPath) -> Result<ProcessFilters> {
+    let exes = config
+        .ignore_process_exes()
+        .iter()
+        .map(|exe| WorkloadPath::from(exe).to_rootfs(host_root))
+        .collect();
+
+    Ok(ProcessFilters {
+        comms: config.ignore_process_names(),
+        exes,
+        uids: config.ignore_process_uids()?,
+    })
+}
+
+fn file_type_filter(config: &Config, sbom: Option<&Sbom>) -> FileTypeFilter {
+    let mut suffixes = config.code_suffixes();
+
+    if config.code_suffixes_from_sbom() {
+        match sbom {
+            Some(sbom) => {
+                let paths = sbom.raw_file_paths();
+                let mut from_sbom =
+                    file_type::suffixes_from_stats(paths.iter().map(|p| p.as_path()));
+                info!("File suffixes derived from the SBOM: {from_sbom:?}");
+
+                let list = suffixes.get_or_insert_with(|| {
+                    file_type::DEFAULT_CODE_SUFFIXES
+                        .iter()
+                        .map(|s| s.to_string())
+                        .collect()
+                });
+                list.append(&mut from_sbom);
+            }
+            None => warn!("No machine SBOM to derive the file suffixes from"),
+        }
+    }
+
+    match suffixes {
+        Some(suffixes) => {
+            info!("Tracking only code files with suffixes: {suffixes:?}");
+            FileTypeFilter::new(&suffixes)
+        }
+        None => FileTypeFilter::none(),
+    }
+}
+
 fn read_machine_id(path: &RootFsPath) -> Result<String> {
     match std::fs::read_to_string(path.as_raw()) {
         Ok(id) => {
@@ -0,0 +1,460 @@
+// Sampling of the executable file mappings of all the processes, an
+// alternative to tracing the opens. The shared libraries and executables stay
+// mapped for the lifetime of a process, so sampling them every few seconds
+// finds them at a cost proportional to the sampling rate rather than to the
+// open rate. Walks the VMAs with a BPF task_vma iterator, or scans
+// /proc/*/maps on kernels without one. Files that are read and closed in
+// between the samples (scripts, data files) go unnoticed.
+
+use std::collections::{HashMap, HashSet};
+use std::io::Read;
+use std::path::Path;
+use std::time::{Duration, Instant};
+
+use anyhow::{anyhow, Result};
+use libbpf_rs::skel::{OpenSkel, SkelBuilder};
+use log::*;
+use tokio::sync::mpsc::Sender;
+
+use crate::open_monitor::{CgroupEvent, OpenEvent};
+use crate::scoped_path::*;
+use crate::sinks::SinkRegistryArc;
+
+mod vma_iter {
+    include!(concat!(env!("OUT_DIR"), "/vma_iter.skel.rs"));
+}
+
+// matches CGROUP_NAME_MAX and PATH_MAX_LEN in vma_iter.bpf.c
+const CGROUP_NAME_MAX: usize = 255;
+const PATH_MAX_LEN: usize = 512;
+
+const PROC_PATH: &str = "/proc";
+
+// Upper bound on the threads scanning /proc in parallel
+const MAX_SCAN_THREADS: usize = 4;
+
+// matches struct vma_record in vma_iter.bpf.c
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct VmaRecord {
+    pid: u32,
+    pad: u32,
+    cgroup_id: u64,
+    cgroup: [u8; CGROUP_NAME_MAX + 1],
+    path: [u8; PATH_MAX_LEN],
+}
+
+impl TryFrom<&[u8]> for VmaRecord {
+    type Error = ();
+
+    fn try_from(buf: &[u8]) -> Result<Self, ()> {
+        let sz = core::mem::size_of::<Self>();
+        if buf.len() < sz {
+            return Err(());
+        }
+
+        let val = unsafe { std::ptr::read_unaligned(buf.as_ptr() as *const Self) };
+        Ok(val)
+    }
+}
+
+fn nul_terminated(buf: &[u8]) -> &[u8] {
+    let nul = buf.iter().position(|b| *b == 0).unwrap_or(buf.len());
+    &buf[..nul]
+}
+
+// The mapped files of a cgroup (by name, as in OpenEvent::cgroup_name)
+#[derive(Default)]
+struct CgroupSample {
+    cgroup_id: Option<u64>,
+    // path -> a pid that maps it
+    files: HashMap<WorkloadPath, u32>,
+}
+
+type Sample = HashMap<String, CgroupSample>;
+
+fn add_mapping(sample: &mut Sample, cgroup: String, cgroup_id: Option<u64>, pid: u32, path: &[u8]) {
+    use std::os::unix::ffi::OsStrExt;
+
+    let entry = sample.entry(cgroup).or_default();
+    entry.cgroup_id = entry.cgroup_id.or(cgroup_id);
+    entry
+        .files
+        .entry(WorkloadPath::from(std::ffi::OsStr::from_bytes(path)))
+        .or_insert(pid);
+}
+
+// The files newly mapped in each cgroup since the previous sample
+fn diff(prev: &Sample, cur: &Sample) -> Vec<OpenEvent> {
+    let mut events = Vec::new();
+
+    for (cgroup, sample) in cur {
+        let prev_files = prev.get(cgroup).map(|s| &s.files);
+
+        for (path, pid) in &sample.files {
+            if prev_files.map_or(true, |files| !files.contains_key(path)) {
+                events.push(OpenEvent {
+                    pid: *pid,
+                    cgroup_name: Some(cgroup.clone()),
+                    cgroup_id: sample.cgroup_id,
+                    filename: path.clone(),
+                    exec: false,
+                });
+            }
+        }
+    }
+
+    events
+}
+
+// Cgroups with no processes left are reported as removed, the new ones as created
+fn cgroup_changes(prev: &Sample, cur: &Sample) -> Vec<CgroupEvent> {
+    let created = cur
+        .iter()
+        .filter(|(cgroup, _)| !prev.contains_key(*cgroup))
+        .map(|(cgroup, s)| CgroupEvent::Created(s.cgroup_id.unwrap_or(0), cgroup.clone()));
+
+    let removed = prev
+        .iter()
+        .filter(|(cgroup, _)| !cur.contains_key(*cgroup))
+        .map(|(cgroup, s)| CgroupEvent::Removed(s.cgroup_id.unwrap_or(0), cgroup.clone()));
+
+    created.chain(removed).collect()
+}
+
+enum Source {
+    Iter {
+        // Dropped before the skeleton
+        link: libbpf_rs::Link,
+        _skel: vma_iter::VmaIterSkel<'static>,
+    },
+    Procfs,
+}
+
+impl Source {
+    fn new() -> Self {
+        match Self::load_iter() {
+            Ok(source) => source,
+            Err(err) => {
+                info!("BPF task_vma iterator not available ({err}), scanning {PROC_PATH}");
+                Source::Procfs
+            }
+        }
+    }
+
+    fn load_iter() -> Result<Self> {
+        let mut skel = vma_iter::VmaIterSkelBuilder::default()
+            .open()
+            .map_err(|err| anyhow!("VmaIterSkelBuilder::open(): {err}"))?
+            .load()
+            .map_err(|err| anyhow!("VmaIterSkelBuilder::load(): {err}"))?;
+
+        let link = skel
+            .progs_mut()
+            .sample_exec_mappings()
+            .attach()
+            .map_err(|err| anyhow!("attach sample_exec_mappings: {err}"))?;
+
+        Ok(Source::Iter { link, _skel: skel })
+    }
+
+    fn sample(&self, own_pid: u32) -> Result<Sample> {
+        match self {
+            Source::Iter { link, .. } => sample_iter(link, own_pid),
+            Source::Procfs => Ok(sample_procfs(Path::new(PROC_PATH), own_pid)),
+        }
+    }
+}
+
+fn sample_iter(link: &libbpf_rs::Link, own_pid: u32) -> Result<Sample> {
+    let mut buf = Vec::new();
+    libbpf_rs::Iter::new(link)?.read_to_end(&mut buf)?;
+
+    let mut sample = Sample::new();
+    for chunk in buf.chunks_exact(std::mem::size_of::<VmaRecord>()) {
+        let Ok(rec) = VmaRecord::try_from(chunk) else {
+            continue;
+        };
+
+        if rec.pid == own_pid {
+            continue;
+        }
+
+        let cgroup = String::from_utf8_lossy(nul_terminated(&rec.cgroup)).to_string();
+        let path = nul_terminated(&rec.path);
+        if !is_file_path(path) {
+            continue;
+        }
+
+        add_mapping(&mut sample, cgroup, Some(rec.cgroup_id), rec.pid, path);
+    }
+
+    Ok(sample)
+}
+
+// The files mapped executable by any process at this point
+pub fn mapped_files() -> HashSet<WorkloadPath> {
+    sample_procfs(Path::new(PROC_PATH), std::process::id())
+        .into_values()
+        .flat_map(|sample| sample.files.into_keys())
+        .collect()
+}
+
+fn sample_procfs(proc_path: &Path, own_pid: u32) -> Sample {
+    let pids: Vec<u32> = match std::fs::read_dir(proc_path) {
+        Ok(entries) => entries
+            .filter_map(|e| e.ok()?.file_name().to_str()?.parse().ok())
+            .filter(|pid| *pid != own_pid)
+            .collect(),
+        Err(err) => {
+            error!("Failed to list {}: {err}", proc_path.display());
+            return Sample::new();
+        }
+    };
+
+    let threads = std::thread::available_parallelism()
+        .map_or(1, |n| n.get())
+        .min(MAX_SCAN_THREADS);
+    let chunk_size = pids.len().div_ceil(threads).max(1);
+
+    let partial: Vec<Sample> = std::thread::scope(|scope| {
+        let workers: Vec<_> = pids
+            .chunks(chunk_size)
+            .map(|pids| scope.spawn(move || scan_pids(proc_path, pids)))
+            .collect();
+
+        workers
+            .into_iter()
+            .filter_map(|worker| worker.join().ok())
+            .collect()
+    });
+
+    let mut sample = Sample::new();
+    for part in partial {
+        for (cgroup, part) in part {
+            let entry = sample.entry(cgroup).or_default();
+            for (path, pid) in part.files {
+                entry.files.entry(path).or_insert(pid);
+            }
+        }
+    }
+
+    sample
+}
+
+fn scan_pids(proc_path: &Path, pids: &[u32]) -> Sample {
+    let mut sample = Sample::new();
+
+    for pid in pids {
+        let dir = proc_path.join(pid.to_string());
+
+        // Gone in the meantime or a kernel thread
+        let (Ok(cgroup), Ok(maps)) = (
+            std::fs::read_to_string(dir.join("cgroup")),
+            std::fs::read_to_string(dir.join("maps")),
+        ) else {
+            continue;
+        };
+
+        let cgroup = parse_cgroup(&cgroup);
+        for path in maps.lines().filter_map(parse_exec_mapping) {
+            add_mapping(&mut sample, cgroup.clone(), None, *pid, path.as_bytes());
+        }
+    }
+
+    sample
+}
+
+// The name of the process cgroup, the last component of its path
+// in the unified hierarchy (or in the first one listed on cgroup v1)
+fn parse_cgroup(contents: &str) -> String {
+    let line = contents
+        .lines()
+        .find(|l| l.starts_with("0::"))
+        .or_else(|| contents.lines().next())
+        .unwrap_or("");
+
+    let path = line.splitn(3, ':').nth(2).unwrap_or("");
+    path.rsplit('/').next().unwrap_or("").to_string()
+}
+
+// The file of an executable mapping in a /proc/<pid>/maps line:
+// address perms offset dev inode pathname
+fn parse_exec_mapping(line: &str) -> Option<&str> {
+    let mut fields = line.splitn(6, ' ');
+    let perms = fields.nth(1)?;
+    let inode = fields.nth(2)?;
+    let path = fields.next()?.trim_start();
+
+    if perms.as_bytes().get(2) != Some(&b'x') || inode == "0" {
+        return None;
+    }
+
+    is_file_path(path.as_bytes()).then_some(path)
+}
+
+fn is_file_path(path: &[u8]) -> bool {
+    path.starts_with(b"/") && !path.ends_with(b" (deleted)")
+}
+
+// Samples the mappings every interval and publishes the newly mapped
+// files as open events, to be attributed to the workloads as usual
+pub fn start(
+    sinks: SinkRegistryArc,
+    cgroup_ch: Sender<CgroupEvent>,
+    interval: Duration,
+) -> Result<()> {
+    std::thread::Builder::new()
+        .name("mappings".to_string())
+        .spawn(move || {
+            let source = Source::new();
+            let own_pid = std::process::id();
+            let mut prev = Sample::new();
+
+            loop {
+                let start = Instant::now();
+
+                match source.sample(own_pid) {
+                    Ok(cur) => {
+                        for evt in cgroup_changes(&prev, &cur) {
+                            if cgroup_ch.blocking_send(evt).is_err() {
+                                return;
+                            }
+                        }
+
+                        let events = diff(&prev, &cur);
+                        debug!(
+                            "Mappings sampled in {:?}, {} cgroups, {} new files",
+                            start.elapsed(),
+                            cur.len(),
+                            events.len()
+                        );
+
+                        sinks.blocking_publish(events.into());
+                        prev = cur;
+                    }
+                    Err(err) => error!("Failed to sample the mappings: {err}"),
+                }
+
+                std::thread::sleep(interval.saturating_sub(start.elapsed()));
+            }
+        })
+        .map_err(|err| anyhow!("Failed to start the mappings sampler: {err}"))?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashSet;
+
+    use assert2::assert;
+
+    use super::*;
+
+    #[test]
+    fn test_parse_exec_mapping() {
+        let lines = [
+            "7f1c2a000000-7f1c2a028000 r--p 00000000 fd:01 1835082                    /usr/lib/x86_64-linux-gnu/libc.so.6",
+            "7f1c2a028000-7f1c2a1bd000 r-xp 00028000 fd:01 1835082                    /usr/lib/x86_64-linux-gnu/libc.so.6",
+            "7ffd4c5e2000-7ffd4c5e4000 r-xp 00000000 00:00 0                          [vdso]",
+            "7f1c2a400000-7f1c2a401000 r-xp 00000000 fd:01 1835099                    /opt/my app/bin",
+            "7f1c2a500000-7f1c2a501000 r-xp 00000000 fd:01 1835100                    /tmp/x.so (deleted)",
+            "7f1c2a600000-7f1c2a601000 rw-p 00000000 00:00 0 ",
+        ];
+
+        let paths: Vec<_> = lines.iter().filter_map(|l| parse_exec_mapping(l)).collect();
+        assert!(paths == vec!["/usr/lib/x86_64-linux-gnu/libc.so.6", "/opt/my app/bin"]);
+    }
+
+    #[test]
+    fn test_parse_cgroup() {
+        let v2 = "0::/system.slice/docker-0123abcd.scope\n";
+        assert!(parse_cgroup(v2) == "docker-0123abcd.scope");
+
+        let v1 = "12:cpuset:/kubepods/pod1/cri-containerd-abcd\n11:memory:/kubepods/pod1\n";
+        assert!(parse_cgroup(v1) == "cri-containerd-abcd");
+
+        assert!(parse_cgroup("0::/\n") == "");
+    }
+
+    #[test]
+    fn test_sample_procfs() {
+        let exe = WorkloadPath::from(std::env::current_exe().unwrap());
+        let sample = sample_procfs(Path::new(PROC_PATH), 0);
+
+        assert!(sample.values().any(|s| s.files.contains_key(&exe)));
+    }
+
+    #[test]
+    fn test_diff() {
+        let mut prev = Sample::new();
+        add_mapping(
+            &mut prev,
+            "a.scope".to_string(),
+            Some(1),
+            10,
+            b"/usr/bin/bash",
+        );
+        add_mapping(
+            &mut prev,
+            "gone.scope".to_string(),
+            Some(2),
+            20,
+            b"/usr/bin/sleep",
+        );
+
+        let mut cur = Sample::new();
+        add_mapping(
+            &mut cur,
+            "a.scope".to_string(),
+            Some(1),
+            10,
+            b"/usr/bin/bash",
+        );
+        add_mapping(
+            &mut cur,
+            "a.scope".to_string(),
+            Some(1),
+            11,
+            b"/usr/lib/libssl.so.3",
+        );
+        add_mapping(
+            &mut cur,
+            "b.scope".to_string(),
+            Some(3),
+            30,
+            b"/usr/bin/bash",
+        );
+
+        let mut events: Vec<_> = diff(&prev, &cur)
+            .into_iter()
+            .map(|e| (e.cgroup_name.unwrap(), e.pid, e.filename))
+            .collect();
+        events.sort_by(|a, b| a.0.cmp(&b.0));
+
+        assert!(
+            events
+                == vec![
+                    (
+                        "a.scope".to_string(),
+                        11,
+                        WorkloadPath::from("/usr/lib/libssl.so.3")
+                    ),
+                    (
+                        "b.scope".to_string(),
+                        30,
+                        WorkloadPath::from("/usr/bin/bash")
+                    ),
+                ]
+        );
+
+        let changes: HashSet<_> = cgroup_changes(&prev, &cur)
+            .into_iter()
+            .map(|e| format!("{e:?}"))
+            .collect();
+        assert!(changes.len() == 2);
+        assert!(changes.contains("Created(3, \"b.scope\")"));
+        assert!(changes.contains("Removed(2, \"gone.scope\")"));
+    }
+}
@@ -0,0 +1,54 @@
+use std::fs::File;
+use std::num::NonZeroUsize;
+use std::os::unix::io::AsRawFd;
+
+use anyhow::{anyhow, Result};
+
+// Read-only mapping of the beginning of a file
+pub struct Mmap {
+    addr: *mut std::ffi::c_void,
+    len: NonZeroUsize,
+}
+
+impl Mmap {
+    pub fn new(file: &File, len: NonZeroUsize) -> Result<Self> {
+        use nix::sys::mman::{mmap, MapFlags, ProtFlags};
+
+        let addr = unsafe {
+            mmap(
+                None,
+                len,
+                ProtFlags::PROT_READ,
+                MapFlags::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        }
+        .map_err(|err| anyhow!("mmap: {err}"))?;
+
+        Ok(Self { addr, len })
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.addr as *const u8, self.len.get()) }
+    }
+
+    // Number of the mapped pages that are in the page cache.
+    // Does not fault them in, unlike touching the slice.
+    pub fn resident_pages(&self) -> Result<usize> {
+        let page_size = unsafe { nix::libc::sysconf(nix::libc::_SC_PAGESIZE) } as usize;
+        let mut vec = vec![0u8; (self.len.get() + page_size - 1) / page_size];
+
+        if unsafe { nix::libc::mincore(self.addr, self.len.get(), vec.as_mut_ptr()) } != 0 {
+            return Err(anyhow!("mincore: {}", std::io::Error::last_os_error()));
+        }
+
+        Ok(vec.iter().filter(|v| *v & 1 != 0).count())
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        _ = unsafe { nix::sys::mman::munmap(self.addr, self.len.get()) };
+    }
+}
@@ -1,19 +1,33 @@
+use std::collections::{HashMap, VecDeque};
 use std::ffi::{c_char, CStr};
 use std::mem::size_of;
+use std::os::fd::{AsFd, AsRawFd, RawFd};
+use std::os::unix::fs::MetadataExt;
+use std::path::Path;
 use std::sync::{Arc, Mutex};
-use std::time::Duration;
+use std::time::{Duration, Instant};
 
 use anyhow::{anyhow, Result};
+use libbpf_rs::libbpf_sys::{
+    bpf_prog_test_run_opts, bpf_test_run_opts, user_ring_buffer, user_ring_buffer__free,
+    user_ring_buffer__new, user_ring_buffer__reserve, user_ring_buffer__submit,
+};
 use libbpf_rs::skel::{OpenSkel, Skel, SkelBuilder};
 use libbpf_rs::{Map, MapFlags, MapHandle, PerfBufferBuilder, RingBufferBuilder};
+use rand::Rng;
 use thiserror::Error;
 
 use log::*;
 use tokio::sync::mpsc::Sender;
 use tokio::task::JoinHandle;
 
+use crate::alloc_stats::{self, Stage};
+use crate::containers::container_id_from_cgroup;
 use crate::fanotify::Fanotify;
+use crate::file_type::FileTypeFilter;
+use crate::flight::{self, Verdict};
 use crate::scoped_path::*;
+use crate::sinks::{EventBatch, SinkRegistryArc};
 
 mod probes {
     include!(concat!(env!("OUT_DIR"), "/probes.skel.rs"));
@@ -21,6 +35,37 @@ mod probes {
 
 const OPEN_EVENTS_BUF_SIZE: usize = 256;
 const ZOMBIE_EVENTS_BUF_SIZE: usize = 4;
+const CGROUP_EVENTS_BUF_SIZE: usize = 16;
+
+// How long the info of an exited process is kept for its in-flight events
+const ZOMBIE_CLEANUP_LAG: Duration = Duration::from_secs(10);
+
+// matches TASK_COMM_LEN in probes.bpf.c
+const TASK_COMM_LEN: usize = 16;
+
+// matches FILTER_* in probes.bpf.c
+const FILTER_COMM: u32 = 1 << 0;
+const FILTER_EXE: u32 = 1 << 1;
+const FILTER_UID: u32 = 1 << 2;
+const FILTER_SUFFIX: u32 = 1 << 3;
+const FILTER_CGROUP_TIERS: u32 = 1 << 4;
+
+// matches TIER_* in probes.bpf.c
+const TIER_SAMPLED: u32 = 1;
+const TIER_EXEC_ONLY: u32 = 2;
+
+// matches CGROUP_* in probes.bpf.c
+const CGROUP_MKDIR: u32 = 1;
+const CGROUP_RMDIR: u32 = 2;
+
+// matches SUFFIX_MAX in probes.bpf.c
+const SUFFIX_MAX: usize = 8;
+
+// matches CTL_* in probes.bpf.c
+const CTL_REMOVE_PID: u32 = 1;
+const CTL_SET_CGROUP_CONFIG: u32 = 2;
+const CTL_DELETE_CGROUP_CONFIG: u32 = 3;
+const CTL_SET_FILTERS: u32 = 4;
 
 pub trait FileOpenMonitor {
     // NB: Adds the mountpoint of path, not the actual path.
@@ -28,6 +73,34 @@ pub trait FileOpenMonitor {
 
     // NB: Removes the mountpoint of path, not the actual path.
     fn remove_path(&self, path: &RootFsPath) -> Result<()>;
+
+    // Throttles the file opens reported for the processes in the cgroup.
+    // Process executions are always reported.
+    fn set_cgroup_tier(&self, cgroup_id: u64, tier: TracingTier) -> Result<()>;
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum TracingTier {
+    // Every open is reported
+    Full,
+
+    // 1 in N opens is reported
+    Sampled(u32),
+
+    // Only the process executions are reported
+    ExecOnly,
+}
+
+impl TracingTier {
+    // Decides if an open that made it past the kernel side filter
+    // (i.e. reported by fanotify) is to be dropped
+    fn drops_open(&self) -> bool {
+        match self {
+            TracingTier::Full => false,
+            TracingTier::Sampled(rate) => *rate > 1 && rand::thread_rng().gen_range(0..*rate) != 0,
+            TracingTier::ExecOnly => true,
+        }
+    }
 }
 
 pub type FileOpenMonitorArc = Arc<dyn FileOpenMonitor + Send + Sync>;
@@ -84,39 +157,94 @@ fn handle_lost_events(cpu: i32, count: u64) {
     warn!("Lost {count} events on CPU {cpu}");
 }
 
+// Processes whose file opens are not tracked
+#[derive(Default)]
+pub struct ProcessFilters {
+    pub comms: Vec<String>,
+    pub exes: Vec<RootFsPath>,
+    pub uids: Vec<u32>,
+}
+
 #[derive(Error, Debug)]
 #[error(transparent)]
 pub struct LoadError(#[from] libbpf_rs::Error);
 
+// The features the probes are loaded with, see BpfProbes::load
+#[derive(Clone, Copy, Debug, PartialEq)]
+struct LoadVariant {
+    use_btf: bool,
+    use_control: bool,
+    with_optional: bool,
+}
+
+impl LoadVariant {
+    // The variant to retry with after a LoadError, giving up the features in
+    // order: BTF tracepoints, the control channel, then the optional probes.
+    // The map syscalls do what the control channel does, openat2 is lost.
+    fn fallback(self) -> Option<(Self, &'static str)> {
+        if self.use_btf {
+            let next = Self {
+                use_btf: false,
+                ..self
+            };
+            Some((next, "the classic tracepoints"))
+        } else if self.use_control {
+            let next = Self {
+                use_control: false,
+                ..self
+            };
+            Some((next, "the control channel disabled"))
+        } else if self.with_optional {
+            let next = Self {
+                with_optional: false,
+                ..self
+            };
+            Some((next, "optional probes disabled"))
+        } else {
+            None
+        }
+    }
+}
+
 struct BpfProbes {
+    // Refers to the maps and programs of skel, dropped first
+    control: Option<ControlChannel>,
     // ProbesSkel contains OpenObject which has a *mut,
     // making it not possible to use with .await
     skel: probes::ProbesSkel<'static>,
     use_ring_buf: bool,
+    filters: u32,
 }
 
 impl BpfProbes {
-    fn load() -> Result<Self> {
+    // static_filters are the FILTER_* bits compiled into the programs,
+    // the code of the other filters is removed by the verifier
+    fn load(static_filters: u32) -> Result<Self> {
         // first thing is to bump the ulimit for locked memory for older kernels
         bump_rlimit()?;
 
         let use_ring_buf = supports_ring_buffer();
         info!("Using ring buffer: {use_ring_buf}");
 
-        let mut with_optional = true;
+        let mut variant = LoadVariant {
+            use_btf: supports_btf_tracepoints(),
+            use_control: supports_user_ring_buffer(),
+            with_optional: true,
+        };
+        info!("Using BTF tracepoints: {}", variant.use_btf);
+        info!("Using control channel: {}", variant.use_control);
 
         loop {
-            match Self::load_internal(use_ring_buf, with_optional) {
+            match Self::load_internal(use_ring_buf, variant, static_filters) {
                 Ok(skel) => return Ok(skel),
                 Err(err) => {
                     if err.is::<LoadError>() {
-                        if with_optional {
-                            info!(
-                                "Loading of BPF probes failed, retrying with optional probes disabled"
-                            );
-                            with_optional = false;
-                        } else {
-                            return Err(anyhow!("ProbesSkelBuilder::load(): {err}"));
+                        match variant.fallback() {
+                            Some((next, what)) => {
+                                info!("Loading of BPF probes failed, retrying with {what}");
+                                variant = next;
+                            }
+                            None => return Err(anyhow!("ProbesSkelBuilder::load(): {err}")),
                         }
                     } else {
                         return Err(err);
@@ -126,13 +254,62 @@ impl BpfProbes {
         }
     }
 
-    fn load_internal(use_ring_buf: bool, with_optional_probes: bool) -> Result<Self> {
+    fn load_internal(
+        use_ring_buf: bool,
+        variant: LoadVariant,
+        static_filters: u32,
+    ) -> Result<Self> {
+        let mut skel = Self::open_and_load(
+            use_ring_buf,
+            variant.use_btf,
+            variant.with_optional,
+            variant.use_control,
+            static_filters,
+        )?;
+
+        skel.attach().map_err(LoadError)?;
+
+        let control = if variant.use_control {
+            let channel =
+                ControlChannel::new(skel.maps().control_commands(), skel.progs().drain_control());
+
+            match channel {
+                Ok(channel) => Some(channel),
+                Err(err) => {
+                    warn!("Falling back to the BPF map syscalls: {err}");
+                    None
+                }
+            }
+        } else {
+            None
+        };
+
+        Ok(Self {
+            control,
+            skel,
+            use_ring_buf,
+            filters: 0,
+        })
+    }
+
+    // Opens and verifies the programs without attaching them
+    fn open_and_load(
+        use_ring_buf: bool,
+        use_btf: bool,
+        with_optional_probes: bool,
+        use_control: bool,
+        static_filters: u32,
+    ) -> Result<probes::ProbesSkel<'static>> {
         let skel_builder = probes::ProbesSkelBuilder::default();
 
         let mut open_skel = skel_builder
             .open()
             .map_err(|err| anyhow!("ProbesSkelBuilder::open(): {err}"))?;
 
+        // .rodata is frozen at load, the verifier prunes the branches these rule out
+        open_skel.rodata_mut().use_ringbuf = use_ring_buf;
+        open_skel.rodata_mut().static_filters = static_filters;
+
         open_skel
             .maps_mut()
             .rb_open_events()
@@ -153,6 +330,16 @@ impl BpfProbes {
             .pb_zombie_events()
             .set_autocreate(!use_ring_buf)?;
 
+        open_skel
+            .maps_mut()
+            .rb_cgroup_events()
+            .set_autocreate(use_ring_buf)?;
+
+        open_skel
+            .maps_mut()
+            .pb_cgroup_events()
+            .set_autocreate(!use_ring_buf)?;
+
         open_skel
             .progs_mut()
             .enter_openat2()
@@ -163,11 +350,38 @@ impl BpfProbes {
             .exit_openat2()
             .set_autoload(with_optional_probes)?;
 
-        let mut skel = open_skel.load().map_err(LoadError)?;
+        // The control channel goes with the optional probes, not the other way around
+        let use_control = use_control && with_optional_probes;
 
-        skel.attach().map_err(LoadError)?;
+        open_skel
+            .maps_mut()
+            .control_commands()
+            .set_autocreate(use_control)?;
 
-        Ok(Self { skel, use_ring_buf })
+        open_skel
+            .progs_mut()
+            .drain_control()
+            .set_autoload(use_control)?;
+
+        // Either the tp_btf programs or their kprobe/classic tracepoint equivalents
+        let mut progs = open_skel.progs_mut();
+        progs.kprobe__setup_new_exec().set_autoload(!use_btf)?;
+        progs.cgroup_attach_task().set_autoload(!use_btf)?;
+        progs.cgroup_transfer_tasks().set_autoload(!use_btf)?;
+        progs.cgroup_mkdir().set_autoload(!use_btf)?;
+        progs.cgroup_rmdir().set_autoload(!use_btf)?;
+        progs.sched_process_exit().set_autoload(!use_btf)?;
+
+        progs.tp_btf__sched_process_exec().set_autoload(use_btf)?;
+        progs.tp_btf__cgroup_attach_task().set_autoload(use_btf)?;
+        progs
+            .tp_btf__cgroup_transfer_tasks()
+            .set_autoload(use_btf)?;
+        progs.tp_btf__cgroup_mkdir().set_autoload(use_btf)?;
+        progs.tp_btf__cgroup_rmdir().set_autoload(use_btf)?;
+        progs.tp_btf__sched_process_exit().set_autoload(use_btf)?;
+
+        Ok(open_skel.load().map_err(LoadError)?)
     }
 
     fn open_events<'cb, F>(&self, cb: F) -> Result<CommBuffer<'cb>>
@@ -200,7 +414,190 @@ impl BpfProbes {
         }
     }
 
-    fn lookup_cgroup(&self, pid: u32) -> Result<Option<String>> {
+    fn cgroup_events<'cb, F>(&self, cb: F) -> Result<CommBuffer<'cb>>
+    where
+        F: Fn(&[u8]) + Send + Sync + 'static,
+    {
+        let maps = self.skel.maps();
+
+        if self.use_ring_buf {
+            let map = CommBufferMap::RingBuffer(maps.rb_cgroup_events());
+            CommBuffer::load(map, 0, cb)
+        } else {
+            let map = CommBufferMap::PerfBuffer(maps.pb_cgroup_events());
+            CommBuffer::load(map, CGROUP_EVENTS_BUF_SIZE, cb)
+        }
+    }
+
+    // Populates the maps of the filters enabled by static_filters()
+    fn set_filters(&mut self, filters: &ProcessFilters, file_types: &FileTypeFilter) -> Result<()> {
+        let mut maps = self.skel.maps_mut();
+
+        for comm in &filters.comms {
+            if comm.len() >= TASK_COMM_LEN {
+                warn!(
+                    "Process name '{comm}' is longer than {} chars, truncating",
+                    TASK_COMM_LEN - 1
+                );
+            }
+
+            let mut key = [0u8; TASK_COMM_LEN];
+            let len = std::cmp::min(comm.len(), TASK_COMM_LEN - 1);
+            key[..len].copy_from_slice(&comm.as_bytes()[..len]);
+
+            maps.ignored_comms()
+                .update(&key, &[1u8], MapFlags::ANY)
+                .map_err(|err| anyhow!("ignored_comms::update(): {err}"))?;
+        }
+
+        for exe in &filters.exes {
+            let md = match std::fs::metadata(exe.as_raw()) {
+                Ok(md) => md,
+                Err(err) => {
+                    warn!("Ignored executable {}: {err}", exe.display());
+                    continue;
+                }
+            };
+
+            let key = ExeKey {
+                ino: md.ino(),
+                dev: kernel_dev(md.dev()),
+                pad: 0,
+            };
+
+            maps.ignored_exes()
+                .update(key.as_bytes(), &[1u8], MapFlags::ANY)
+                .map_err(|err| anyhow!("ignored_exes::update(): {err}"))?;
+        }
+
+        for uid in &filters.uids {
+            maps.ignored_uids()
+                .update(&uid.to_ne_bytes(), &[1u8], MapFlags::ANY)
+                .map_err(|err| anyhow!("ignored_uids::update(): {err}"))?;
+        }
+
+        if file_types.is_enabled() {
+            for suffix in file_types.suffixes() {
+                if suffix.len() >= SUFFIX_MAX {
+                    warn!("File suffix '{suffix}' is too long to be matched in the kernel");
+                    continue;
+                }
+
+                let mut key = [0u8; SUFFIX_MAX];
+                key[..suffix.len()].copy_from_slice(suffix.as_bytes());
+
+                maps.code_suffixes()
+                    .update(&key, &[1u8], MapFlags::ANY)
+                    .map_err(|err| anyhow!("code_suffixes::update(): {err}"))?;
+            }
+        }
+
+        Ok(())
+    }
+
+    // Queues the map update on the control channel, it's applied by the next
+    // flush(). Without the channel it's applied right away.
+    fn command(&mut self, cmd: ControlCmd) -> Result<()> {
+        if let Some(control) = &mut self.control {
+            if control.push(&cmd) {
+                return Ok(());
+            }
+
+            // Full, make room
+            control.flush()?;
+            if control.push(&cmd) {
+                return Ok(());
+            }
+        }
+
+        self.apply(&cmd)
+    }
+
+    fn flush(&mut self) -> Result<()> {
+        match &mut self.control {
+            Some(control) => control.flush(),
+            None => Ok(()),
+        }
+    }
+
+    // The map syscalls equivalent to drain_control() in probes.bpf.c
+    fn apply(&mut self, cmd: &ControlCmd) -> Result<()> {
+        let mut maps = self.skel.maps_mut();
+
+        match cmd.kind {
+            CTL_REMOVE_PID => maps
+                .pid_to_info()
+                .delete(&cmd.pid.to_ne_bytes())
+                .map_err(|err| anyhow!("pid_to_info::delete(): {err}"))?,
+
+            CTL_SET_CGROUP_CONFIG => maps
+                .cgroup_config()
+                .update(
+                    &cmd.cgroup_id.to_ne_bytes(),
+                    cmd.cfg.as_bytes(),
+                    MapFlags::ANY,
+                )
+                .map_err(|err| anyhow!("cgroup_config::update(): {err}"))?,
+
+            CTL_DELETE_CGROUP_CONFIG => {
+                if let Err(err) = maps.cgroup_config().delete(&cmd.cgroup_id.to_ne_bytes()) {
+                    debug!("cgroup_config::delete(): {err}");
+                }
+            }
+
+            CTL_SET_FILTERS => maps
+                .probe_config()
+                .update(
+                    &0u32.to_ne_bytes(),
+                    &cmd.filters.to_ne_bytes(),
+                    MapFlags::ANY,
+                )
+                .map_err(|err| anyhow!("probe_config::update(): {err}"))?,
+
+            kind => return Err(anyhow!("Unknown control command: {kind}")),
+        }
+
+        Ok(())
+    }
+
+    fn set_probe_config(&mut self, flags: u32) -> Result<()> {
+        self.command(ControlCmd::set_filters(flags))?;
+
+        self.filters = flags;
+        Ok(())
+    }
+
+    fn set_cgroup_tier(&mut self, cgroup_id: u64, tier: TracingTier) -> Result<()> {
+        let cfg = match tier {
+            // Missing entry means full tracing
+            TracingTier::Full => None,
+            TracingTier::Sampled(rate) => Some(CgroupConfig {
+                tier: TIER_SAMPLED,
+                sample_rate: rate,
+            }),
+            TracingTier::ExecOnly => Some(CgroupConfig {
+                tier: TIER_EXEC_ONLY,
+                sample_rate: 0,
+            }),
+        };
+
+        match cfg {
+            Some(cfg) => {
+                self.command(ControlCmd::set_cgroup_config(cgroup_id, cfg))?;
+
+                // The per open cgroup lookup is only paid once there's something to throttle
+                if self.filters & FILTER_CGROUP_TIERS == 0 {
+                    self.set_probe_config(self.filters | FILTER_CGROUP_TIERS)?;
+                }
+            }
+            None => self.command(ControlCmd::delete_cgroup_config(cgroup_id))?,
+        }
+
+        // The config and the filter flag are applied together
+        self.flush()
+    }
+
+    fn lookup_process(&self, pid: u32) -> Result<Option<ProcessInfo>> {
         let key = pid.to_ne_bytes();
         let val = self
             .skel
@@ -216,33 +613,162 @@ impl BpfProbes {
                     .try_into()
                     .map_err(|_| anyhow!("error casting bytes into ProcessInfo"))?;
 
-                let cgroup = info.cgroup_path()?.to_string();
-
-                Some(cgroup)
+                Some(info)
             }
             None => None,
         })
     }
 
-    fn remove_pid(&mut self, pid: &[u8]) -> Result<()> {
-        self.skel
-            .maps_mut()
-            .pid_to_info()
-            .delete(pid)
-            .map_err(|err| anyhow!("pid_to_info::delete(): {err}"))?;
+    // Returns the cgroup name and id
+    fn lookup_cgroup(&self, pid: u32) -> Result<Option<(String, u64)>> {
+        match self.lookup_process(pid)? {
+            Some(info) => Ok(Some((info.cgroup_path()?.to_string(), info.cgroup_id))),
+            None => Ok(None),
+        }
+    }
 
+    // Applied by the next flush()
+    fn remove_pid(&mut self, pid: u32) -> Result<()> {
+        self.command(ControlCmd::remove_pid(pid))
+    }
+}
+
+// Batches the map updates of the userspace into the control_commands user
+// ring buffer. Queuing a command is a memory write, the whole batch is then
+// applied by a single run of drain_control (see probes.bpf.c).
+struct ControlChannel {
+    rb: *mut user_ring_buffer,
+    // Owned by the skeleton
+    drain_fd: RawFd,
+    queued: usize,
+}
+
+// The ring buffer is only used under the BpfProbes mutex
+unsafe impl Send for ControlChannel {}
+
+impl ControlChannel {
+    fn new(map: &Map, drain: &libbpf_rs::Program) -> Result<Self> {
+        let rb = unsafe { user_ring_buffer__new(map.as_fd().as_raw_fd(), std::ptr::null()) };
+        if rb.is_null() {
+            return Err(anyhow!(
+                "user_ring_buffer__new(): {}",
+                std::io::Error::last_os_error()
+            ));
+        }
+
+        Ok(Self {
+            rb,
+            drain_fd: drain.as_fd().as_raw_fd(),
+            queued: 0,
+        })
+    }
+
+    // Returns false if the ring buffer is full
+    fn push(&mut self, cmd: &ControlCmd) -> bool {
+        let sample = unsafe { user_ring_buffer__reserve(self.rb, size_of::<ControlCmd>() as u32) };
+        if sample.is_null() {
+            return false;
+        }
+
+        unsafe {
+            std::ptr::write_unaligned(sample as *mut ControlCmd, *cmd);
+            user_ring_buffer__submit(self.rb, sample);
+        }
+
+        self.queued += 1;
+        true
+    }
+
+    fn flush(&mut self) -> Result<()> {
+        if self.queued == 0 {
+            return Ok(());
+        }
+
+        let mut opts = bpf_test_run_opts {
+            sz: size_of::<bpf_test_run_opts>() as _,
+            ..Default::default()
+        };
+
+        let ret = unsafe { bpf_prog_test_run_opts(self.drain_fd, &mut opts) };
+        if ret < 0 {
+            return Err(anyhow!(
+                "drain_control: {}",
+                std::io::Error::from_raw_os_error(-ret)
+            ));
+        }
+
+        self.queued = self.queued.saturating_sub(opts.retval as usize);
         Ok(())
     }
 }
 
+impl Drop for ControlChannel {
+    fn drop(&mut self) {
+        unsafe { user_ring_buffer__free(self.rb) };
+    }
+}
+
+// matches ctl_cmd in probes.bpf.c
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct ControlCmd {
+    kind: u32,
+    pid: u32,
+    cgroup_id: u64,
+    cfg: CgroupConfig,
+    filters: u32,
+    pad: u32,
+}
+
+impl ControlCmd {
+    fn remove_pid(pid: u32) -> Self {
+        Self {
+            kind: CTL_REMOVE_PID,
+            pid,
+            ..Default::default()
+        }
+    }
+
+    fn set_cgroup_config(cgroup_id: u64, cfg: CgroupConfig) -> Self {
+        Self {
+            kind: CTL_SET_CGROUP_CONFIG,
+            cgroup_id,
+            cfg,
+            ..Default::default()
+        }
+    }
+
+    fn delete_cgroup_config(cgroup_id: u64) -> Self {
+        Self {
+            kind: CTL_DELETE_CGROUP_CONFIG,
+            cgroup_id,
+            ..Default::default()
+        }
+    }
+
+    fn set_filters(filters: u32) -> Self {
+        Self {
+            kind: CTL_SET_FILTERS,
+            filters,
+            ..Default::default()
+        }
+    }
+}
+
 #[repr(C)]
 #[derive(Clone, Copy)]
 struct ProcessInfo {
+    cgroup_id: u64,
     zombie: u8,
+    ignored: u8,
     cgroup: [u8; 255],
 }
 
 impl ProcessInfo {
+    fn is_ignored(&self) -> bool {
+        self.ignored != 0
+    }
+
     fn cgroup_path(&self) -> Result<&str> {
         let nul = self
             .cgroup
@@ -270,37 +796,117 @@ impl TryFrom<&[u8]> for ProcessInfo {
             return Err(());
         }
 
-        let val = unsafe { *(buf.as_ptr() as *const Self) };
+        let val = unsafe { std::ptr::read_unaligned(buf.as_ptr() as *const Self) };
         Ok(val)
     }
 }
 
+// matches cgroup_config in probes.bpf.c
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct CgroupConfig {
+    tier: u32,
+    sample_rate: u32,
+}
+
+impl CgroupConfig {
+    fn as_bytes(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self as *const Self as *const u8, size_of::<Self>()) }
+    }
+}
+
+// matches exe_key in probes.bpf.c
+#[repr(C)]
+struct ExeKey {
+    ino: u64,
+    dev: u32,
+    pad: u32,
+}
+
+impl ExeKey {
+    fn as_bytes(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self as *const Self as *const u8, size_of::<Self>()) }
+    }
+}
+
+// Kernel's internal dev_t (inode->i_sb->s_dev) encodes major:minor differently
+// than the st_dev returned by stat()
+fn kernel_dev(dev: u64) -> u32 {
+    let major = nix::sys::stat::major(dev);
+    let minor = nix::sys::stat::minor(dev);
+    ((major << 20) | minor) as u32
+}
+
+// The filters that can ever be active, they can't be turned on after the load
+fn static_filters(filters: &ProcessFilters, file_types: &FileTypeFilter) -> u32 {
+    let mut flags = 0;
+
+    if !filters.comms.is_empty() {
+        flags |= FILTER_COMM;
+    }
+
+    if !filters.exes.is_empty() {
+        flags |= FILTER_EXE;
+    }
+
+    if !filters.uids.is_empty() {
+        flags |= FILTER_UID;
+    }
+
+    if file_types.is_enabled() {
+        flags |= FILTER_SUFFIX;
+    }
+
+    flags
+}
+
 pub struct OpenMonitor {
     fan: Arc<Fanotify>,
     fan_task: JoinHandle<()>,
-    _probes: Arc<Mutex<BpfProbes>>,
+    probes: Arc<Mutex<BpfProbes>>,
+    // The fanotify events are not filtered in the kernel, the tiers are applied here
+    tiers: Arc<Mutex<HashMap<u64, TracingTier>>>,
     zombie_task: JoinHandle<()>,
     opens_task: JoinHandle<()>,
+    cgroups_task: JoinHandle<()>,
 }
 
 impl OpenMonitor {
-    pub fn start(ch: Sender<OpenEvent>) -> Result<Self> {
+    pub fn start(
+        sinks: SinkRegistryArc,
+        cgroup_ch: Sender<CgroupEvent>,
+        filters: &ProcessFilters,
+        file_types: &FileTypeFilter,
+    ) -> Result<Self> {
         let fan = Arc::new(Fanotify::new()?);
-        let probes = Arc::new(Mutex::new(BpfProbes::load()?));
 
-        let fan_task =
-            tokio::task::spawn(monitor_fanotify(fan.clone(), probes.clone(), ch.clone()));
+        let mut probes = BpfProbes::load(static_filters(filters, file_types))?;
+        probes.set_filters(filters, file_types)?;
+        let probes = Arc::new(Mutex::new(probes));
+
+        let tiers = Arc::new(Mutex::new(HashMap::new()));
+
+        let fan_task = tokio::task::spawn(monitor_fanotify(
+            fan.clone(),
+            probes.clone(),
+            tiers.clone(),
+            sinks.clone(),
+        ));
 
-        let opens_task = monitor_bpf_open_events(probes.clone(), ch)?;
+        let opens_task = monitor_bpf_open_events(probes.clone(), sinks)?;
 
         let zombie_task = monitor_zombies(probes.clone())?;
 
+        let cgroups_task = monitor_cgroups(probes.clone(), cgroup_ch)?;
+
         Ok(Self {
             fan,
             fan_task,
-            _probes: probes,
+            probes,
+            tiers,
             zombie_task,
             opens_task,
+            cgroups_task,
         })
     }
 
@@ -313,6 +919,9 @@ impl OpenMonitor {
 
         self.opens_task.abort();
         _ = self.opens_task.await;
+
+        self.cgroups_task.abort();
+        _ = self.cgroups_task.await;
     }
 }
 
@@ -326,12 +935,29 @@ impl FileOpenMonitor for OpenMonitor {
     fn remove_path(&self, path: &RootFsPath) -> Result<()> {
         self.fan.remove_open_mark(path.as_raw().to_path_buf())
     }
+
+    fn set_cgroup_tier(&self, cgroup_id: u64, tier: TracingTier) -> Result<()> {
+        self.probes
+            .lock()
+            .unwrap()
+            .set_cgroup_tier(cgroup_id, tier)?;
+
+        let mut tiers = self.tiers.lock().unwrap();
+        if tier == TracingTier::Full {
+            tiers.remove(&cgroup_id);
+        } else {
+            tiers.insert(cgroup_id, tier);
+        }
+
+        Ok(())
+    }
 }
 
 async fn monitor_fanotify(
     fan: Arc<Fanotify>,
     probes: Arc<Mutex<BpfProbes>>,
-    ch: Sender<OpenEvent>,
+    tiers: Arc<Mutex<HashMap<u64, TracingTier>>>,
+    sinks: SinkRegistryArc,
 ) {
     loop {
         let events = match fan.next().await {
@@ -342,7 +968,15 @@ async fn monitor_fanotify(
             }
         };
 
+        let _stage = alloc_stats::enter(Stage::Decode);
+        let mut batch = Vec::with_capacity(events.len());
+
         for e in events {
+            // Our own opens (e.g. reading the file magic) are not interesting
+            if e.pid as u32 == std::process::id() {
+                continue;
+            }
+
             let filename = match e.path() {
                 Ok(path) => WorkloadPath::from(path),
                 Err(err) => {
@@ -351,82 +985,221 @@ async fn monitor_fanotify(
                 }
             };
 
-            let cgroup_name = match probes.lock().unwrap().lookup_cgroup(e.pid as u32) {
-                Ok(cgroup) => cgroup,
-                Err(err) => {
-                    error!("lookup_cgroup: {err}");
-                    None
+            let (cgroup_name, cgroup_id, ignored) =
+                match probes.lock().unwrap().lookup_process(e.pid as u32) {
+                    Ok(Some(info)) => match info.cgroup_path() {
+                        Ok(cgroup) => (
+                            Some(cgroup.to_string()),
+                            Some(info.cgroup_id),
+                            info.is_ignored(),
+                        ),
+                        Err(err) => {
+                            error!("lookup_process: {err}");
+                            (None, Some(info.cgroup_id), info.is_ignored())
+                        }
+                    },
+                    Ok(None) => (None, None, false),
+                    Err(err) => {
+                        error!("lookup_process: {err}");
+                        (None, None, false)
+                    }
+                };
+
+            if ignored {
+                record_dropped(
+                    Verdict::IgnoredProcess,
+                    e.pid as u32,
+                    &cgroup_name,
+                    &filename,
+                );
+                continue;
+            }
+
+            if let Some(id) = cgroup_id {
+                let tier = tiers.lock().unwrap().get(&id).copied();
+                if tier.map_or(false, |t| t.drops_open()) {
+                    record_dropped(Verdict::Sampled, e.pid as u32, &cgroup_name, &filename);
+                    continue;
                 }
-            };
+            }
 
             trace!("fanotify: {} / {:?}", filename.display(), cgroup_name);
 
+            // The execs are reported by the probes
             let open = OpenEvent {
+                pid: e.pid as u32,
                 cgroup_name,
+                cgroup_id,
                 filename,
+                exec: false,
             };
 
-            _ = ch.send(open).await;
+            batch.push(open);
         }
+
+        alloc_stats::events_decoded(batch.len());
+        let batch: EventBatch = batch.into();
+        drop(_stage);
+
+        sinks.publish(batch).await;
     }
 }
 
+// The events dropped before the attribution to a workload are recorded under
+// the container id (or "host") the attribution would have found
+fn record_dropped(verdict: Verdict, pid: u32, cgroup: &Option<String>, path: &WorkloadPath) {
+    if !flight::is_enabled() {
+        return;
+    }
+
+    let id = cgroup.as_deref().and_then(container_id_from_cgroup);
+    flight::record(verdict, pid, id.as_deref().unwrap_or("host"), path.as_raw());
+}
+
 fn monitor_bpf_open_events(
     probes_arc: Arc<Mutex<BpfProbes>>,
-    ch: Sender<OpenEvent>,
+    sinks: SinkRegistryArc,
 ) -> Result<JoinHandle<()>> {
+    // Filled by the callback, published as one batch per poll
+    let batch = Arc::new(Mutex::new(Vec::new()));
+
     let events = {
         let probes = probes_arc.lock().unwrap();
         let probes_arc = probes_arc.clone();
+        let batch = batch.clone();
+        let own_pid = std::process::id();
 
         probes.open_events(move |buf| {
+            let _stage = alloc_stats::enter(Stage::Decode);
             let evt = buf.as_ptr() as *const EvtOpen;
-            let fname = unsafe { CStr::from_ptr(&((*evt).filename) as *const c_char) };
             let pid = unsafe { u32::from_ne_bytes((*evt).pid) };
+            let exec = unsafe { u32::from_ne_bytes((*evt).flags) } & EVT_OPEN_EXEC != 0;
+
+            if pid == own_pid {
+                return;
+            }
+
+            let fname = unsafe { CStr::from_ptr(&((*evt).filename) as *const c_char) };
 
             let filename = WorkloadPath::from_cstr(fname);
 
-            let cgroup_name = match probes_arc.lock().unwrap().lookup_cgroup(pid) {
-                Ok(cgroup) => cgroup,
+            let (cgroup_name, cgroup_id) = match probes_arc.lock().unwrap().lookup_cgroup(pid) {
+                Ok(Some((name, id))) => (Some(name), Some(id)),
+                Ok(None) => (None, None),
                 Err(err) => {
                     error!("lookup_cgroup: {err}");
-                    None
+                    (None, None)
                 }
             };
 
             trace!("bpf: {} / {:?}", filename.display(), cgroup_name);
 
             let open = OpenEvent {
+                pid,
                 cgroup_name,
+                cgroup_id,
                 filename,
+                exec,
             };
 
-            if let Err(err) = ch.blocking_send(open) {
-                error!("Error sending OpenEvent on a channel: {err}");
-            }
+            batch.lock().unwrap().push(open);
+            alloc_stats::events_decoded(1);
         })?
     };
 
     Ok(tokio::task::spawn_blocking(move || loop {
         _ = events.poll(Duration::from_millis(100));
+
+        let opens = std::mem::take(&mut *batch.lock().unwrap());
+        sinks.blocking_publish(opens.into());
     }))
 }
 
 fn monitor_zombies(probes_arc: Arc<Mutex<BpfProbes>>) -> Result<JoinHandle<()>> {
+    // One queue rather than a task per exited process, the delay is the same
+    // for all so the queue is ordered by the due time
+    let exited = Arc::new(Mutex::new(VecDeque::<(Instant, u32)>::new()));
+
     let events = {
         let probes = probes_arc.lock().unwrap();
-        let probes_arc = probes_arc.clone();
+        let exited = exited.clone();
 
         probes.zombie_events(move |buf| {
-            let pid = buf.to_vec();
-            let probes_arc = probes_arc.clone();
+            let Some(pid) = buf.get(..4).and_then(|b| b.try_into().ok()) else {
+                error!("Short zombie event: {} bytes", buf.len());
+                return;
+            };
+
+            let due = Instant::now() + ZOMBIE_CLEANUP_LAG;
+            exited
+                .lock()
+                .unwrap()
+                .push_back((due, u32::from_ne_bytes(pid)));
+        })?
+    };
 
-            tokio::task::spawn(async move {
-                tokio::time::sleep(Duration::from_secs(10)).await;
-                if let Err(err) = probes_arc.lock().unwrap().remove_pid(&pid) {
-                    error!("Failed to remove process info from BPF map: {err}");
+    Ok(tokio::task::spawn_blocking(move || loop {
+        _ = events.poll(Duration::from_millis(100));
+
+        let now = Instant::now();
+        let mut due = Vec::new();
+        {
+            let mut exited = exited.lock().unwrap();
+            while exited.front().map_or(false, |(at, _)| *at <= now) {
+                due.push(exited.pop_front().unwrap().1);
+            }
+        }
+
+        if due.is_empty() {
+            continue;
+        }
+
+        // One batch for all the processes that are due
+        let mut probes = probes_arc.lock().unwrap();
+        for pid in due {
+            if let Err(err) = probes.remove_pid(pid) {
+                error!("Failed to remove process info from BPF map: {err}");
+            }
+        }
+
+        if let Err(err) = probes.flush() {
+            error!("Failed to remove process info from BPF map: {err}");
+        }
+    }))
+}
+
+fn monitor_cgroups(
+    probes_arc: Arc<Mutex<BpfProbes>>,
+    ch: Sender<CgroupEvent>,
+) -> Result<JoinHandle<()>> {
+    let events = {
+        let probes = probes_arc.lock().unwrap();
+
+        probes.cgroup_events(move |buf| {
+            if buf.len() < size_of::<EvtCgroup>() {
+                error!("Short cgroup event: {} bytes", buf.len());
+                return;
+            }
+
+            let evt = unsafe { std::ptr::read_unaligned(buf.as_ptr() as *const EvtCgroup) };
+            let path = unsafe { CStr::from_ptr(&evt.path as *const c_char) }
+                .to_string_lossy()
+                .into_owned();
+
+            trace!("cgroup event {}: {path} ({})", evt.kind, evt.id);
+
+            let evt = match evt.kind {
+                CGROUP_MKDIR => CgroupEvent::Created(evt.id, path),
+                CGROUP_RMDIR => CgroupEvent::Removed(evt.id, path),
+                kind => {
+                    error!("Unknown cgroup event kind: {kind}");
+                    return;
                 }
-            });
+            };
+
+            if let Err(err) = ch.blocking_send(evt) {
+                error!("Error sending CgroupEvent on a channel: {err}");
+            }
         })?
     };
 
@@ -435,16 +1208,41 @@ fn monitor_zombies(probes_arc: Arc<Mutex<BpfProbes>>) -> Result<JoinHandle<()>>
     }))
 }
 
+// evt_open.flags
+const EVT_OPEN_EXEC: u32 = 1;
+
 // matches evt_open in probes.bpf.c
 #[repr(C)]
 struct EvtOpen {
     pid: [u8; 4],
+    flags: [u8; 4],
     filename: [std::ffi::c_char; 256],
 }
 
+// matches evt_cgroup in probes.bpf.c
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct EvtCgroup {
+    id: u64,
+    kind: u32,
+    path: [std::ffi::c_char; 256],
+}
+
+#[derive(Clone)]
 pub struct OpenEvent {
+    pub pid: u32,
     pub cgroup_name: Option<String>,
+    pub cgroup_id: Option<u64>,
     pub filename: WorkloadPath,
+    // The file is being executed, not opened
+    pub exec: bool,
+}
+
+// Cgroup (by id and path) creation and removal
+#[derive(Debug)]
+pub enum CgroupEvent {
+    Created(u64, String),
+    Removed(u64, String),
 }
 
 fn bump_rlimit() -> Result<()> {
@@ -478,6 +1276,18 @@ fn supports_ring_buffer() -> bool {
     .is_ok()
 }
 
+// BPF_MAP_TYPE_USER_RINGBUF and bpf_user_ringbuf_drain() are in 6.1+
+fn supports_user_ring_buffer() -> bool {
+    use libbpf_rs::libbpf_sys::{libbpf_probe_bpf_map_type, BPF_MAP_TYPE_USER_RINGBUF};
+
+    unsafe { libbpf_probe_bpf_map_type(BPF_MAP_TYPE_USER_RINGBUF, std::ptr::null()) == 1 }
+}
+
+// tp_btf programs need the kernel BTF to resolve the tracepoint arguments
+fn supports_btf_tracepoints() -> bool {
+    Path::new("/sys/kernel/btf/vmlinux").exists()
+}
+
 pub struct NullOpenMonitor;
 
 impl FileOpenMonitor for NullOpenMonitor {
@@ -489,4 +1299,415 @@ impl FileOpenMonitor for NullOpenMonitor {
     fn remove_path(&self, _path: &RootFsPath) -> Result<()> {
         Ok(())
     }
+
+    fn set_cgroup_tier(&self, _cgroup_id: u64, _tier: TracingTier) -> Result<()> {
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::BTreeMap;
+    use std::path::PathBuf;
+
+    use serde::{Deserialize, Serialize};
+
+    use super::*;
+
+    // Allowed growth over the baseline before a probe change is flagged
+    const INSNS_SLACK: f64 = 1.10;
+    const TIME_SLACK: f64 = 1.50;
+    const TIME_SLACK_MS: f64 = 20.0;
+
+    #[derive(Serialize, Deserialize, Default)]
+    struct Baseline {
+        // Verified instructions and timings depend on the kernel,
+        // they are only compared when it matches
+        kernel: String,
+        variants: BTreeMap<String, VariantStats>,
+    }
+
+    #[derive(Serialize, Deserialize, Clone)]
+    struct VariantStats {
+        load_ms: f64,
+        attach_ms: f64,
+        programs: BTreeMap<String, ProgramStats>,
+    }
+
+    #[derive(Serialize, Deserialize, Clone, Copy)]
+    struct ProgramStats {
+        // Size of the program as compiled
+        insns: usize,
+
+        // Instructions processed by the verifier, 0 if the kernel doesn't report it
+        verified_insns: u32,
+    }
+
+    fn baseline_path() -> PathBuf {
+        PathBuf::from(env!("CARGO_MANIFEST_DIR")).join("src/bpf/probes.baseline.json")
+    }
+
+    fn kernel_release() -> String {
+        std::fs::read_to_string("/proc/sys/kernel/osrelease")
+            .map(|r| r.trim().to_string())
+            .unwrap_or_default()
+    }
+
+    #[test]
+    fn test_control_cmd_layout() {
+        // struct ctl_cmd in probes.bpf.c
+        assert!(size_of::<ControlCmd>() == 32);
+        assert!(std::mem::offset_of!(ControlCmd, cgroup_id) == 8);
+        assert!(std::mem::offset_of!(ControlCmd, cfg) == 16);
+        assert!(std::mem::offset_of!(ControlCmd, filters) == 24);
+    }
+
+    #[test]
+    fn test_load_fallback_order() {
+        let fallbacks = |mut variant: LoadVariant| {
+            let mut order = vec![variant];
+            while let Some((next, _)) = variant.fallback() {
+                order.push(next);
+                variant = next;
+            }
+            order
+        };
+
+        let full = LoadVariant {
+            use_btf: true,
+            use_control: true,
+            with_optional: true,
+        };
+
+        // The control channel goes before openat2 and the other optional probes
+        let order = fallbacks(full);
+        assert!(
+            order
+                == [
+                    full,
+                    LoadVariant {
+                        use_btf: false,
+                        ..full
+                    },
+                    LoadVariant {
+                        use_btf: false,
+                        use_control: false,
+                        with_optional: true,
+                    },
+                    LoadVariant {
+                        use_btf: false,
+                        use_control: false,
+                        with_optional: false,
+                    },
+                ]
+        );
+
+        // Kernels without the user ring buffer go straight to the optional probes
+        let no_control = LoadVariant {
+            use_btf: false,
+            use_control: false,
+            with_optional: true,
+        };
+        assert!(fallbacks(no_control).len() == 2);
+    }
+
+    fn prog_info(prog: &libbpf_rs::Program) -> Option<libbpf_rs::libbpf_sys::bpf_prog_info> {
+        use libbpf_rs::libbpf_sys::{bpf_prog_get_info_by_fd, bpf_prog_info};
+
+        let mut info: bpf_prog_info = unsafe { std::mem::zeroed() };
+        let mut len = size_of::<bpf_prog_info>() as u32;
+        let fd = prog.as_fd().as_raw_fd();
+
+        match unsafe { bpf_prog_get_info_by_fd(fd, &mut info, &mut len) } {
+            0 => Some(info),
+            _ => None,
+        }
+    }
+
+    fn verified_insns(prog: &libbpf_rs::Program) -> u32 {
+        prog_info(prog).map_or(0, |info| info.verified_insns)
+    }
+
+    fn measure(
+        use_ring_buf: bool,
+        use_btf: bool,
+        with_optional: bool,
+        filters: u32,
+    ) -> Result<VariantStats> {
+        let start = Instant::now();
+        let use_control = supports_user_ring_buffer();
+        let mut skel =
+            BpfProbes::open_and_load(use_ring_buf, use_btf, with_optional, use_control, filters)?;
+        let load_ms = start.elapsed().as_secs_f64() * 1000.0;
+
+        let programs = skel
+            .object()
+            .progs_iter()
+            .map(|prog| {
+                let stats = ProgramStats {
+                    insns: prog.insn_cnt(),
+                    verified_insns: verified_insns(prog),
+                };
+                (prog.name().to_string(), stats)
+            })
+            .collect();
+
+        let start = Instant::now();
+        skel.attach().map_err(LoadError)?;
+        let attach_ms = start.elapsed().as_secs_f64() * 1000.0;
+
+        Ok(VariantStats {
+            load_ms,
+            attach_ms,
+            programs,
+        })
+    }
+
+    fn compare(
+        name: &str,
+        old: &VariantStats,
+        new: &VariantStats,
+        same_kernel: bool,
+    ) -> Vec<String> {
+        let mut regressions = Vec::new();
+
+        for (prog, stats) in &new.programs {
+            let Some(base) = old.programs.get(prog) else {
+                println!("{name}/{prog}: new program, {} insns", stats.insns);
+                continue;
+            };
+
+            if stats.insns as f64 > base.insns as f64 * INSNS_SLACK {
+                regressions.push(format!(
+                    "{name}/{prog}: {} insns, baseline {}",
+                    stats.insns, base.insns
+                ));
+            }
+
+            if same_kernel && stats.verified_insns as f64 > base.verified_insns as f64 * INSNS_SLACK
+            {
+                regressions.push(format!(
+                    "{name}/{prog}: {} verified insns, baseline {}",
+                    stats.verified_insns, base.verified_insns
+                ));
+            }
+        }
+
+        if same_kernel {
+            let timings = [
+                ("load", new.load_ms, old.load_ms),
+                ("attach", new.attach_ms, old.attach_ms),
+            ];
+
+            for (what, ms, base_ms) in timings {
+                if ms > base_ms * TIME_SLACK + TIME_SLACK_MS {
+                    regressions.push(format!(
+                        "{name}: {what} took {ms:.1}ms, baseline {base_ms:.1}ms"
+                    ));
+                }
+            }
+        }
+
+        regressions
+    }
+
+    // Loads every variant of the probes and compares the program sizes, the
+    // verifier complexity and the load/attach times against the stored baseline.
+    // Run as root with: cargo test probe_complexity -- --ignored --nocapture
+    // Set EDGEBIT_BPF_BASELINE=update to record a new baseline. Without a
+    // baseline the measurements are only printed, a variant missing from an
+    // existing baseline fails the test.
+    #[test]
+    #[ignore = "needs root and a BPF capable kernel"]
+    fn test_probe_complexity() {
+        bump_rlimit().unwrap();
+
+        let all_filters = FILTER_COMM | FILTER_EXE | FILTER_UID | FILTER_SUFFIX;
+        let mut variants = vec![
+            ("perfbuf", false, false, true, 0),
+            ("perfbuf-filters", false, false, true, all_filters),
+            ("perfbuf-no-optional", false, false, false, 0),
+        ];
+
+        if supports_btf_tracepoints() {
+            variants.push(("perfbuf-btf", false, true, true, 0));
+        }
+
+        if supports_ring_buffer() {
+            variants.extend([
+                ("ringbuf", true, false, true, 0),
+                ("ringbuf-filters", true, false, true, all_filters),
+                ("ringbuf-no-optional", true, false, false, 0),
+            ]);
+
+            if supports_btf_tracepoints() {
+                variants.push(("ringbuf-btf", true, true, true, 0));
+            }
+        }
+
+        let mut measured = Baseline {
+            kernel: kernel_release(),
+            variants: BTreeMap::new(),
+        };
+
+        for (name, use_ring_buf, use_btf, with_optional, filters) in variants {
+            match measure(use_ring_buf, use_btf, with_optional, filters) {
+                Ok(stats) => {
+                    println!(
+                        "{name}: load {:.1}ms, attach {:.1}ms",
+                        stats.load_ms, stats.attach_ms
+                    );
+                    for (prog, p) in &stats.programs {
+                        println!("  {prog}: {} insns, {} verified", p.insns, p.verified_insns);
+                    }
+                    measured.variants.insert(name.to_string(), stats);
+                }
+
+                // e.g. openat2 is missing on older kernels, as in BpfProbes::load
+                Err(err) if (with_optional || use_btf) && err.is::<LoadError>() => {
+                    println!("{name}: not supported on this kernel: {err}");
+                }
+                Err(err) => panic!("{name}: {err}"),
+            }
+        }
+
+        let path = baseline_path();
+        let update = std::env::var("EDGEBIT_BPF_BASELINE").is_ok_and(|v| v == "update");
+
+        let json = serde_json::to_string_pretty(&measured).unwrap();
+
+        if update {
+            std::fs::write(&path, json + "\n").unwrap();
+            println!("Recorded the baseline in {}", path.display());
+            return;
+        }
+
+        if !path.exists() {
+            println!(
+                "SKIPPED: no baseline in {}, nothing to compare against. Record one on \
+                 the reference kernel with EDGEBIT_BPF_BASELINE=update. Measured:\n{json}",
+                path.display()
+            );
+            return;
+        }
+
+        let baseline: Baseline =
+            serde_json::from_str(&std::fs::read_to_string(&path).unwrap()).unwrap();
+
+        let same_kernel = baseline.kernel == measured.kernel;
+        if !same_kernel {
+            println!(
+                "Baseline was taken on {}, only comparing the program sizes",
+                baseline.kernel
+            );
+        }
+
+        let regressions: Vec<_> = measured
+            .variants
+            .iter()
+            .flat_map(|(name, new)| match baseline.variants.get(name) {
+                Some(old) => compare(name, old, new, same_kernel),
+                None => vec![format!(
+                    "{name}: not in the baseline, record it with EDGEBIT_BPF_BASELINE=update"
+                )],
+            })
+            .collect();
+
+        assert!(regressions.is_empty(), "{}", regressions.join("\n"));
+    }
+
+    // Runs execs and exits, plus cgroup creations, moves and removals on cgroup v2
+    fn exercise_hooks(rounds: usize) {
+        let cgroup_v2 = Path::new("/sys/fs/cgroup/cgroup.controllers").exists();
+        let cgroup = PathBuf::from(format!(
+            "/sys/fs/cgroup/edgebit-overhead-{}",
+            uuid::Uuid::new_v4()
+        ));
+
+        for _ in 0..rounds {
+            let mut child = std::process::Command::new("sleep")
+                .arg("10")
+                .spawn()
+                .unwrap();
+
+            if cgroup_v2 && std::fs::create_dir(&cgroup).is_ok() {
+                _ = std::fs::write(cgroup.join("cgroup.procs"), child.id().to_string());
+            }
+
+            _ = child.kill();
+            _ = child.wait();
+
+            if cgroup_v2 {
+                _ = std::fs::remove_dir(&cgroup);
+            }
+        }
+    }
+
+    // Measures the per-invocation cost of the exec, cgroup and exit hooks, the
+    // kprobe/classic tracepoints against the tp_btf programs, from the kernel
+    // BPF run time stats. The open probes run along, their cost is shown too.
+    // Run as root with: cargo test probe_overhead -- --ignored --nocapture
+    #[test]
+    #[ignore = "needs root and a BPF capable kernel"]
+    fn test_probe_overhead() {
+        use libbpf_rs::libbpf_sys::{bpf_enable_stats, BPF_STATS_RUN_TIME};
+
+        const ROUNDS: usize = 500;
+
+        bump_rlimit().unwrap();
+
+        // The stats are collected while the fd is open
+        let stats_fd = unsafe { bpf_enable_stats(BPF_STATS_RUN_TIME) };
+        assert!(stats_fd >= 0, "Failed to enable the BPF run time stats");
+
+        let use_ring_buf = supports_ring_buffer();
+        let mut costs: BTreeMap<String, Vec<(&str, f64)>> = BTreeMap::new();
+
+        for (name, use_btf) in [("classic", false), ("btf", true)] {
+            if use_btf && !supports_btf_tracepoints() {
+                println!("{name}: no kernel BTF, skipped");
+                continue;
+            }
+
+            let mut skel = BpfProbes::open_and_load(use_ring_buf, use_btf, false, 0).unwrap();
+            skel.attach().unwrap();
+
+            exercise_hooks(ROUNDS);
+
+            for prog in skel.object().progs_iter() {
+                let Some(info) = prog_info(prog) else {
+                    continue;
+                };
+
+                if info.run_cnt == 0 {
+                    continue;
+                }
+
+                let ns = info.run_time_ns as f64 / info.run_cnt as f64;
+                println!(
+                    "{name}/{}: {} runs, {ns:.0} ns/run",
+                    prog.name(),
+                    info.run_cnt
+                );
+
+                let hook = prog
+                    .name()
+                    .trim_start_matches("tp_btf__")
+                    .trim_start_matches("kprobe__")
+                    .replace("setup_new_exec", "sched_process_exec");
+                costs.entry(hook).or_default().push((name, ns));
+            }
+        }
+
+        unsafe { nix::libc::close(stats_fd) };
+
+        for (hook, variants) in &costs {
+            if let [(_, classic), (_, btf)] = variants.as_slice() {
+                println!(
+                    "{hook}: {classic:.0} -> {btf:.0} ns/run ({:+.0}%)",
+                    (btf / classic - 1.0) * 100.0
+                );
+            }
+        }
+    }
 }
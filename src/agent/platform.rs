@@ -11,7 +11,7 @@ use tokio::task::JoinHandle;
 use tonic::codegen::InterceptedService;
 use tonic::metadata::AsciiMetadataValue;
 use tonic::service::Interceptor;
-use tonic::transport::{Channel, Uri};
+use tonic::transport::{Channel, Endpoint, Uri};
 use tonic::{Request, Status};
 
 pub mod pb {
@@ -19,18 +19,49 @@ pub mod pb {
 }
 
 use pb::inventory_service_client::InventoryServiceClient;
+use pb::sbom_service_client::SbomServiceClient;
 use pb::token_service_client::TokenServiceClient;
+use pb::usage_service_client::UsageServiceClient;
 
+use crate::alloc_stats::{self, Stage};
+use crate::backoff::Backoff;
+use crate::binary_id::{BinaryId, IdentifiedBinary};
 use crate::scoped_path::WorkloadPath;
+use crate::usage::{FileUsage, USAGE_EPOCH};
 use crate::version::VERSION;
 
 const EXPIRATION_SLACK: Duration = Duration::from_secs(10 * 60);
 const DEFAULT_EXPIRATION: Duration = Duration::from_secs(60 * 60);
-const RETRY_INTERVAL: Duration = Duration::from_secs(1);
+
+// Enrollment and session refresh retries, see Backoff
+const RETRY_BASE: Duration = Duration::from_secs(1);
+const RETRY_CAP: Duration = Duration::from_secs(5 * 60);
+
+// The control channel (enrollment, session refresh, reports) keeps the default,
+// small, HTTP/2 windows and pings the server to detect a dead connection early
+const CONTROL_KEEPALIVE_INTERVAL: Duration = Duration::from_secs(30);
+const CONTROL_KEEPALIVE_TIMEOUT: Duration = Duration::from_secs(10);
+
+// The bulk channel (SBOM uploads) is a separate connection with large windows
+// so that an upload does not stall the reports waiting for flow control credit
+const BULK_STREAM_WINDOW: u32 = 4 * 1024 * 1024;
+const BULK_CONNECTION_WINDOW: u32 = 8 * 1024 * 1024;
+const BULK_TCP_KEEPALIVE: Duration = Duration::from_secs(60);
 
 pub struct Client {
     inventory_svc: InventoryServiceClient<InterceptedService<Channel, AuthToken>>,
+    bulk_svc: InventoryServiceClient<InterceptedService<Channel, AuthToken>>,
+    usage_svc: UsageServiceClient<InterceptedService<Channel, AuthToken>>,
+    sbom_svc: SbomServiceClient<InterceptedService<Channel, AuthToken>>,
     sess_keeper_task: JoinHandle<()>,
+
+    // Cleared if the backend does not implement the respective UsageService RPC,
+    // a backend may well have one and not the other
+    binary_ids_supported: bool,
+    usage_summary_supported: bool,
+
+    // Cleared if the backend does not implement the SbomService
+    sbom_dedup_supported: bool,
 }
 
 impl Client {
@@ -40,7 +71,20 @@ impl Client {
         hostname: String,
         machine_id: String,
     ) -> Result<Self> {
-        let channel = Channel::builder(endpoint).connect().await?;
+        let channel = Endpoint::from(endpoint.clone())
+            .http2_keep_alive_interval(CONTROL_KEEPALIVE_INTERVAL)
+            .keep_alive_timeout(CONTROL_KEEPALIVE_TIMEOUT)
+            .keep_alive_while_idle(true)
+            .tcp_nodelay(true)
+            .connect()
+            .await?;
+
+        // Connected on the first bulk upload, which may never come
+        let bulk_channel = Endpoint::from(endpoint)
+            .initial_stream_window_size(BULK_STREAM_WINDOW)
+            .initial_connection_window_size(BULK_CONNECTION_WINDOW)
+            .tcp_keepalive(Some(BULK_TCP_KEEPALIVE))
+            .connect_lazy();
 
         let mut token = enroll_loop(
             channel.clone(),
@@ -55,16 +99,26 @@ impl Client {
         let inventory_svc =
             InventoryServiceClient::with_interceptor(channel.clone(), auth_token.clone());
 
+        let usage_svc = UsageServiceClient::with_interceptor(channel.clone(), auth_token.clone());
+
+        let sbom_svc = SbomServiceClient::with_interceptor(channel.clone(), auth_token.clone());
+
+        let bulk_svc = InventoryServiceClient::with_interceptor(bulk_channel, auth_token.clone());
+
         let sess_keeper_task = tokio::task::spawn(async move {
+            let mut backoff = Backoff::new("session", RETRY_BASE, RETRY_CAP);
+
             while let Err(err) = refresh_loop(
                 channel.clone(),
                 token.refresh_token.clone(),
                 auth_token.clone(),
                 token.expiration,
+                &mut backoff,
             )
             .await
             {
                 error!("Session renewal failed: {err}");
+                backoff.retry(&err, retry_after(&err)).await;
 
                 // try re-enrolling
                 token = enroll_loop(
@@ -80,7 +134,13 @@ impl Client {
 
         Ok(Self {
             inventory_svc,
+            bulk_svc,
+            usage_svc,
+            sbom_svc,
             sess_keeper_task,
+            binary_ids_supported: true,
+            usage_summary_supported: true,
+            sbom_dedup_supported: true,
         })
     }
 
@@ -108,10 +168,7 @@ impl Client {
         let result = Arc::new(Mutex::new(Result::Ok(())));
         let stream = header_stream.chain(data_stream(sbom_reader, result.clone()));
 
-        self.inventory_svc
-            .upload_sbom(stream)
-            .await
-            .map_err(|e| anyhow!("{}", e.message()))?;
+        self.bulk_svc.upload_sbom(stream).await.map_err(rpc_error)?;
 
         std::sync::Arc::<std::sync::Mutex<Result<(), anyhow::Error>>>::try_unwrap(result)
             .unwrap()
@@ -119,40 +176,161 @@ impl Client {
             .unwrap()
     }
 
+    // Image id of an already uploaded SBOM with the same content hash
+    pub async fn lookup_sbom(&mut self, content_hash: String) -> Result<Option<String>> {
+        if !self.sbom_dedup_supported {
+            return Ok(None);
+        }
+
+        let req = pb::LookupSbomRequest { content_hash };
+
+        match self.sbom_svc.lookup_sbom(req).await {
+            Ok(resp) => {
+                let image_id = resp.into_inner().image_id;
+                Ok(if image_id.is_empty() {
+                    None
+                } else {
+                    Some(image_id)
+                })
+            }
+            Err(status) if status.code() == tonic::Code::Unimplemented => {
+                info!("Backend does not support SBOM deduplication, disabling it");
+                self.sbom_dedup_supported = false;
+                Ok(None)
+            }
+            Err(status) => Err(rpc_error(status)),
+        }
+    }
+
+    pub async fn record_sbom(&mut self, content_hash: String, image_id: String) -> Result<()> {
+        if !self.sbom_dedup_supported {
+            return Ok(());
+        }
+
+        let req = pb::RecordSbomRequest {
+            content_hash,
+            image_id,
+        };
+
+        self.sbom_svc.record_sbom(req).await.map_err(rpc_error)?;
+        Ok(())
+    }
+
     pub async fn upsert_workload(&mut self, workload: pb::UpsertWorkloadRequest) -> Result<()> {
         self.inventory_svc
             .upsert_workload(workload)
             .await
-            .map_err(|e| anyhow!("{}", e.message()))?;
+            .map_err(rpc_error)?;
         Ok(())
     }
 
     pub async fn report_in_use(
         &mut self,
         workload_id: String,
-        files: Vec<WorkloadPath>,
+        files: &[WorkloadPath],
     ) -> Result<()> {
-        let in_use = files
-            .into_iter()
-            .map(|f| pb::PkgInUse {
-                id: String::new(),
-                files: vec![f.as_raw().display().to_string()],
-            })
-            .collect();
-
-        let req = pb::ReportInUseRequest {
-            in_use,
-            workload_id,
+        let req = {
+            let _stage = alloc_stats::enter(Stage::RpcEncode);
+
+            let in_use = files
+                .iter()
+                .map(|f| pb::PkgInUse {
+                    id: String::new(),
+                    files: vec![f.as_raw().display().to_string()],
+                })
+                .collect();
+
+            pb::ReportInUseRequest {
+                in_use,
+                workload_id,
+            }
         };
 
         trace!("ReportInUse: {req:?}");
         self.inventory_svc
             .report_in_use(req)
             .await
-            .map_err(|e| anyhow!("{}", e.message()))?;
+            .map_err(rpc_error)?;
         Ok(())
     }
 
+    pub async fn report_binary_ids(
+        &mut self,
+        workload_id: String,
+        binaries: Vec<IdentifiedBinary>,
+    ) -> Result<()> {
+        if !self.binary_ids_supported {
+            return Ok(());
+        }
+
+        let binary_ids = binaries
+            .into_iter()
+            .map(|b| pb::BinaryId {
+                path: b.path.as_raw().display().to_string(),
+                id: Some(match b.id {
+                    BinaryId::BuildId(id) => pb::binary_id::Id::BuildId(id),
+                    BinaryId::ContentHash(hash) => pb::binary_id::Id::ContentHash(hash),
+                }),
+            })
+            .collect();
+
+        let req = pb::ReportBinaryIdsRequest {
+            workload_id,
+            binary_ids,
+        };
+
+        trace!("ReportBinaryIds: {req:?}");
+        match self.usage_svc.report_binary_ids(req).await {
+            Ok(_) => Ok(()),
+            Err(status) if status.code() == tonic::Code::Unimplemented => {
+                info!("Backend does not support binary id reports, disabling them");
+                self.binary_ids_supported = false;
+                Ok(())
+            }
+            Err(status) => Err(rpc_error(status)),
+        }
+    }
+
+    pub async fn report_usage_summary(
+        &mut self,
+        workload_id: String,
+        usage: Vec<FileUsage>,
+    ) -> Result<()> {
+        if !self.usage_summary_supported {
+            return Ok(());
+        }
+
+        let req = {
+            let _stage = alloc_stats::enter(Stage::RpcEncode);
+
+            let files = usage
+                .into_iter()
+                .map(|u| pb::FileUsage {
+                    path: u.path.as_raw().display().to_string(),
+                    count: u.count,
+                    last_seen: u.last_seen,
+                })
+                .collect();
+
+            pb::ReportUsageSummaryRequest {
+                workload_id,
+                epoch_secs: USAGE_EPOCH.as_secs() as u32,
+                files,
+            }
+        };
+
+        trace!("ReportUsageSummary: {req:?}");
+        match self.usage_svc.report_usage_summary(req).await {
+            Ok(_) => Ok(()),
+            Err(status) if status.code() == tonic::Code::Unimplemented => {
+                info!("Backend does not support usage summaries, disabling them");
+                self.usage_summary_supported = false;
+                Ok(())
+            }
+            Err(status) => Err(rpc_error(status)),
+        }
+    }
+
     pub async fn reset_workloads(&mut self) -> Result<()> {
         self.inventory_svc
             .reset_workloads(pb::ResetWorkloadsRequest {
@@ -160,7 +338,7 @@ impl Client {
                 workloads: Vec::new(),
             })
             .await
-            .map_err(|e| anyhow!("{}", e.message()))?;
+            .map_err(rpc_error)?;
         Ok(())
     }
 
@@ -231,7 +409,7 @@ async fn enroll(
     let resp = token_svc
         .enroll_agent(req)
         .await
-        .map_err(|e| anyhow!("{}", e.message()))?
+        .map_err(rpc_error)?
         .into_inner();
 
     // ensure the token is ascii
@@ -251,6 +429,8 @@ async fn enroll_loop(
     hostname: String,
     machine_id: String,
 ) -> EnrolledToken {
+    let mut backoff = Backoff::new("enroll", RETRY_BASE, RETRY_CAP);
+
     loop {
         match enroll(
             channel.clone(),
@@ -260,10 +440,13 @@ async fn enroll_loop(
         )
         .await
         {
-            Ok(tok) => return tok,
+            Ok(tok) => {
+                backoff.succeeded();
+                return tok;
+            }
             Err(err) => {
                 error!("Agent enrollment failed: {err}");
-                tokio::time::sleep(RETRY_INTERVAL).await;
+                backoff.retry(&err, retry_after(&err)).await;
             }
         }
     }
@@ -274,6 +457,7 @@ async fn refresh_loop(
     refresh_token: String,
     auth_token: AuthToken,
     mut expiration: SystemTime,
+    backoff: &mut Backoff,
 ) -> Result<()> {
     let mut token_svc = TokenServiceClient::with_interceptor(channel, auth_token.clone());
 
@@ -297,7 +481,7 @@ async fn refresh_loop(
         let resp = token_svc
             .get_session_token(req)
             .await
-            .map_err(|e| anyhow!("{}", e.message()))?
+            .map_err(rpc_error)?
             .into_inner();
 
         // ensure the token is ascii
@@ -306,11 +490,55 @@ async fn refresh_loop(
 
         auth_token.set(&resp.session_token);
         expiration = get_expiration(resp.session_token_expiration);
+        backoff.succeeded();
 
         info!("Session renewed");
     }
 }
 
+// A failed RPC, with the retry hint of the server if it gave one
+#[derive(Debug)]
+pub struct RpcError {
+    message: String,
+    retry_after: Option<Duration>,
+}
+
+impl std::fmt::Display for RpcError {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.write_str(&self.message)
+    }
+}
+
+impl std::error::Error for RpcError {}
+
+fn rpc_error(status: Status) -> anyhow::Error {
+    let metadata = status.metadata();
+    let header = |name: &str| {
+        metadata
+            .get(name)?
+            .to_str()
+            .ok()?
+            .trim()
+            .parse::<u64>()
+            .ok()
+    };
+
+    // gRPC retry pushback (ms) or the HTTP Retry-After (secs) of a proxy
+    let retry_after = header("grpc-retry-pushback-ms")
+        .map(Duration::from_millis)
+        .or_else(|| header("retry-after").map(Duration::from_secs));
+
+    RpcError {
+        message: status.message().to_string(),
+        retry_after,
+    }
+    .into()
+}
+
+pub fn retry_after(err: &anyhow::Error) -> Option<Duration> {
+    err.downcast_ref::<RpcError>()?.retry_after
+}
+
 fn get_expiration(expiration: Option<prost_types::Timestamp>) -> SystemTime {
     match expiration {
         Some(expiration) => match SystemTime::try_from(expiration) {
@@ -0,0 +1,318 @@
+// Passive in-use inference from the page cache, an alternative to tracing the
+// file opens for hosts that cannot afford any per-open cost. The package files
+// of the host SBOM are checked for residency at a low rate and the ones whose
+// resident pages grew are reported as if opened. Less precise than tracing:
+// files that stay cached between the scans and the data read via the already
+// resident pages go unnoticed, and only the host workload is covered.
+
+use std::collections::HashSet;
+use std::fs::{File, OpenOptions};
+use std::num::NonZeroUsize;
+use std::os::unix::fs::OpenOptionsExt;
+use std::os::unix::io::AsRawFd;
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+use anyhow::{anyhow, Result};
+use log::*;
+
+use crate::file_type::FileTypeFilter;
+use crate::mappings;
+use crate::mmap::Mmap;
+use crate::scoped_path::*;
+use crate::workloads::host::HostWorkload;
+
+const SCAN_INTERVAL: Duration = Duration::from_secs(60);
+
+// A pause every so many files to spread the scan out
+const SCAN_BATCH: usize = 256;
+const SCAN_BATCH_PAUSE: Duration = Duration::from_millis(5);
+
+// Not in the libc crate for all the targets, the same number on all of them
+const SYS_CACHESTAT: nix::libc::c_long = 451;
+
+// Cleared on the first ENOSYS, mmap + mincore is used from then on
+static HAS_CACHESTAT: AtomicBool = AtomicBool::new(true);
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum InUseEngine {
+    // File opens traced with BPF (or fanotify)
+    Tracing,
+    // Inferred from the page cache, no probes attached
+    Residency,
+    // The executable mappings of the processes, sampled periodically
+    Mappings,
+}
+
+impl std::str::FromStr for InUseEngine {
+    type Err = anyhow::Error;
+
+    fn from_str(s: &str) -> Result<Self> {
+        match s.to_lowercase().as_str() {
+            "tracing" => Ok(InUseEngine::Tracing),
+            "residency" => Ok(InUseEngine::Residency),
+            "mappings" => Ok(InUseEngine::Mappings),
+            _ => Err(anyhow!(
+                "'{s}', expected 'tracing', 'residency' or 'mappings'"
+            )),
+        }
+    }
+}
+
+#[repr(C)]
+struct CachestatRange {
+    off: u64,
+    // 0 is up to the end of the file
+    len: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+#[allow(dead_code)]
+struct Cachestat {
+    nr_cache: u64,
+    nr_dirty: u64,
+    nr_writeback: u64,
+    nr_evicted: u64,
+    nr_recently_evicted: u64,
+}
+
+struct ScannedFile {
+    path: WorkloadPath,
+    // None until the first successful scan
+    resident: Option<u64>,
+}
+
+pub struct ResidencyScanner {
+    root: RootFsPath,
+    files: Vec<ScannedFile>,
+}
+
+impl ResidencyScanner {
+    // Keeps the code files among the paths, by their canonical path
+    pub fn new(root: RootFsPath, paths: &[WorkloadPath], file_types: &FileTypeFilter) -> Self {
+        let mut seen = HashSet::new();
+        let mut files = Vec::new();
+
+        for path in paths {
+            let Ok(rp) = path.to_rootfs(&root).realpath() else {
+                continue;
+            };
+
+            let is_code = match std::fs::metadata(rp.as_raw()) {
+                Ok(md) if md.is_file() => file_types.is_code(&rp, &md),
+                _ => false,
+            };
+
+            if let (true, Ok(path)) = (is_code, WorkloadPath::from_rootfs(&root, &rp)) {
+                if seen.insert(path.clone()) {
+                    files.push(ScannedFile {
+                        path,
+                        resident: None,
+                    });
+                }
+            }
+        }
+
+        Self { root, files }
+    }
+
+    // Returns the files that look to have been used since the previous scan.
+    // `mapped` is only looked at for the files scanned for the first time.
+    pub fn scan(&mut self, mapped: &HashSet<WorkloadPath>) -> Vec<WorkloadPath> {
+        let mut used = Vec::new();
+
+        for (i, file) in self.files.iter_mut().enumerate() {
+            if i > 0 && i % SCAN_BATCH == 0 {
+                std::thread::sleep(SCAN_BATCH_PAUSE);
+            }
+
+            let rootfs_path = file.path.to_rootfs(&self.root);
+            let resident = match resident_pages(rootfs_path.as_raw()) {
+                Ok(resident) => resident,
+                Err(err) => {
+                    trace!("{}: {err}", rootfs_path.display());
+                    continue;
+                }
+            };
+
+            let is_mapped = || mapped.contains(&file.path);
+            if became_used(file.resident, resident, is_mapped) {
+                used.push(file.path.clone());
+            }
+            file.resident = Some(resident);
+        }
+
+        used
+    }
+}
+
+// On the first scan only the resident files that are also mapped count as
+// used: the SBOM generation and the agent's own reads (binary ids, file
+// types) leave the package files resident whether in use or not. After
+// that, the files that got more pages cached.
+fn became_used(prev: Option<u64>, now: u64, is_mapped: impl FnOnce() -> bool) -> bool {
+    match prev {
+        Some(prev) => now > prev,
+        None => now > 0 && is_mapped(),
+    }
+}
+
+// Number of pages of the file in the page cache. Reading the residency
+// does not read the file, so the scan itself does not make it resident.
+fn resident_pages(path: &Path) -> Result<u64> {
+    let file = open_noatime(path)?;
+
+    if HAS_CACHESTAT.load(Ordering::Relaxed) {
+        match cachestat(&file) {
+            Ok(cs) => return Ok(cs.nr_cache),
+            Err(err) if err.raw_os_error() == Some(nix::libc::ENOSYS) => {
+                debug!("cachestat(2) is not available, falling back to mincore(2)");
+                HAS_CACHESTAT.store(false, Ordering::Relaxed);
+            }
+            Err(err) => return Err(err.into()),
+        }
+    }
+
+    let len = file.metadata()?.len() as usize;
+    match NonZeroUsize::new(len) {
+        Some(len) => Ok(Mmap::new(&file, len)?.resident_pages()? as u64),
+        None => Ok(0),
+    }
+}
+
+fn cachestat(file: &File) -> std::io::Result<Cachestat> {
+    let range = CachestatRange { off: 0, len: 0 };
+    let mut cs = Cachestat::default();
+
+    let ret = unsafe {
+        nix::libc::syscall(
+            SYS_CACHESTAT,
+            file.as_raw_fd(),
+            &range as *const CachestatRange,
+            &mut cs as *mut Cachestat,
+            0,
+        )
+    };
+
+    if ret == 0 {
+        Ok(cs)
+    } else {
+        Err(std::io::Error::last_os_error())
+    }
+}
+
+// The scan is not to update the access times of all the package files
+fn open_noatime(path: &Path) -> std::io::Result<File> {
+    match OpenOptions::new()
+        .read(true)
+        .custom_flags(nix::libc::O_NOATIME)
+        .open(path)
+    {
+        // O_NOATIME is only allowed to the owner (or with CAP_FOWNER)
+        Err(err) if err.raw_os_error() == Some(nix::libc::EPERM) => File::open(path),
+        res => res,
+    }
+}
+
+// Feeds the files inferred as used into the host workload, as if they were opened
+pub fn start(
+    root: RootFsPath,
+    paths: Vec<WorkloadPath>,
+    file_types: Arc<FileTypeFilter>,
+    host: Arc<Mutex<HostWorkload>>,
+) -> Result<()> {
+    std::thread::Builder::new()
+        .name("residency".to_string())
+        .spawn(move || {
+            crate::binary_id::lower_priority("residency scanner");
+
+            let mut scanner = ResidencyScanner::new(root, &paths, &file_types);
+            drop(paths);
+            info!(
+                "Inferring the files in use from the page cache, {} files",
+                scanner.files.len()
+            );
+
+            // The executables and libraries in use since before the agent
+            // started, for the first scan. The scripts and other files among
+            // them are only reported once they get more pages cached.
+            let mut mapped = mappings::mapped_files();
+
+            loop {
+                let start = Instant::now();
+                let used = scanner.scan(&mapped);
+                mapped = HashSet::new();
+                debug!(
+                    "Residency scan took {:?}, {} files used",
+                    start.elapsed(),
+                    used.len()
+                );
+
+                if !used.is_empty() {
+                    let mut host = host.lock().unwrap();
+                    for path in &used {
+                        host.file_opened(path);
+                    }
+                }
+
+                std::thread::sleep(SCAN_INTERVAL);
+            }
+        })
+        .map_err(|err| anyhow!("Failed to start the residency scanner: {err}"))?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    #[test]
+    fn test_became_used() {
+        assert!(became_used(None, 1, || true));
+        assert!(!became_used(None, 1, || false));
+        assert!(!became_used(None, 0, || true));
+        assert!(became_used(Some(2), 3, || false));
+        assert!(!became_used(Some(3), 3, || true));
+        assert!(!became_used(Some(3), 1, || true));
+    }
+
+    #[test]
+    fn test_resident_pages() {
+        let dir = TempDir::new("residency");
+
+        // Just written, so in the page cache
+        std::fs::write(dir.join("libfoo.so"), vec![1u8; 64 * 1024]).unwrap();
+        std::fs::write(dir.join("empty.so"), b"").unwrap();
+
+        assert!(resident_pages(&dir.join("libfoo.so")).unwrap() > 0);
+        assert!(resident_pages(&dir.join("empty.so")).unwrap() == 0);
+
+        let root = RootFsPath::from(dir.path());
+        let paths = vec![
+            WorkloadPath::from("/libfoo.so"),
+            WorkloadPath::from("/libfoo.so"),
+            WorkloadPath::from("/missing.so"),
+        ];
+        let file_types = FileTypeFilter::new(&["so"]);
+        let mut scanner = ResidencyScanner::new(root.clone(), &paths, &file_types);
+        assert!(scanner.files.len() == 1);
+
+        let mapped = HashSet::from([WorkloadPath::from("/libfoo.so")]);
+        assert!(scanner.scan(&mapped) == vec![WorkloadPath::from("/libfoo.so")]);
+        assert!(scanner.scan(&mapped).is_empty());
+
+        // Resident but not mapped, e.g. cached by the SBOM generation
+        let mut scanner = ResidencyScanner::new(root, &paths, &file_types);
+        assert!(scanner.scan(&HashSet::new()).is_empty());
+
+        std::fs::write(dir.join("libfoo.so"), vec![1u8; 128 * 1024]).unwrap();
+        assert!(scanner.scan(&HashSet::new()) == vec![WorkloadPath::from("/libfoo.so")]);
+    }
+}
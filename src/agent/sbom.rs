@@ -7,12 +7,26 @@ use anyhow::{anyhow, Result};
 use log::*;
 use nix::sys::wait::WaitStatus;
 use serde::Deserialize;
+use serde_json::Value;
+use sha2::{Digest, Sha256};
 use temp_file::TempFile;
 
+use crate::alloc_stats::{self, Stage};
 use crate::chroot_cmd::{CommandWithChroot, TmpFS};
 use crate::config::Config;
+use crate::json_decode;
 use crate::scoped_path::*;
 
+// Top level fields that differ between the scans of identical file systems
+// (syft-json and spdx-json)
+const VOLATILE_FIELDS: &[&str] = &[
+    "descriptor",
+    "source",
+    "creationInfo",
+    "documentNamespace",
+    "name",
+];
+
 pub async fn generate(config: Arc<Config>, root: &RootFsPath) -> Result<TempFile> {
     // If the agent is running in a container, the host FS is mounted at
     // at /host or similar. Since some symlinks are absolute, e.g. /usr/bin => /bin,
@@ -97,11 +111,13 @@ pub struct Sbom {
 
 impl Sbom {
     pub fn load(path: &RootFsPath) -> Result<Self> {
-        let file = std::fs::File::open(path.as_raw())?;
-        let reader = BufReader::new(file);
+        let _stage = alloc_stats::enter(Stage::SbomLoad);
+
+        // Only the artifacts and their files are decoded, see SbomDoc
+        let mut buf = std::fs::read(path.as_raw())?;
 
         Ok(Self {
-            doc: serde_json::from_reader(reader)?,
+            doc: json_decode::from_slice(&mut buf)?,
         })
     }
 
@@ -112,6 +128,75 @@ impl Sbom {
     pub fn id(&self) -> String {
         self.doc.source.id.clone()
     }
+
+    // Paths of all the package files as listed in the SBOM (not normalized)
+    pub fn raw_file_paths(&self) -> Vec<PathBuf> {
+        self.doc
+            .artifacts
+            .iter()
+            .filter_map(|a| a.metadata.as_ref())
+            .flat_map(|meta| meta.raw_file_paths())
+            .collect()
+    }
+
+    // Paths of all the package files, with the symlinks resolved under host_root
+    // as in the paths of the file open events
+    pub fn file_paths(&self, host_root: &RootFsPath) -> Vec<WorkloadPath> {
+        self.raw_file_paths()
+            .into_iter()
+            .map(|path| normalize(host_root, &WorkloadPath::from(path)))
+            .collect()
+    }
+}
+
+// SHA-256 (hex) of the SBOM document without the volatile fields and with the
+// object keys sorted. The same for all the nodes built from the same image.
+pub fn content_hash(path: &Path) -> Result<String> {
+    let file = std::fs::File::open(path)?;
+    let mut doc: Value = serde_json::from_reader(BufReader::new(file))?;
+
+    if let Some(obj) = doc.as_object_mut() {
+        for field in VOLATILE_FIELDS {
+            obj.remove(*field);
+        }
+    }
+
+    let mut hasher = Sha256::new();
+    hash_json(&doc, &mut hasher);
+
+    Ok(hasher
+        .finalize()
+        .iter()
+        .map(|b| format!("{b:02x}"))
+        .collect())
+}
+
+// Canonical serialization: the keys are sorted regardless of how the map preserves them
+fn hash_json(val: &Value, hasher: &mut Sha256) {
+    match val {
+        Value::Object(obj) => {
+            let mut keys: Vec<&String> = obj.keys().collect();
+            keys.sort();
+
+            hasher.update(b"{");
+            for key in keys {
+                hasher.update(Value::from(key.as_str()).to_string().as_bytes());
+                hasher.update(b":");
+                hash_json(&obj[key], hasher);
+                hasher.update(b",");
+            }
+            hasher.update(b"}");
+        }
+        Value::Array(arr) => {
+            hasher.update(b"[");
+            for item in arr {
+                hash_json(item, hasher);
+                hasher.update(b",");
+            }
+            hasher.update(b"]");
+        }
+        scalar => hasher.update(scalar.to_string().as_bytes()),
+    }
 }
 
 #[derive(Deserialize)]
@@ -173,6 +258,22 @@ struct Metadata {
 }
 
 impl Metadata {
+    fn raw_file_paths(&self) -> Vec<PathBuf> {
+        let files = match self.files {
+            Some(ref files) => files,
+            None => return Vec::new(),
+        };
+
+        files
+            .iter()
+            .filter_map(|f| f.path.as_ref())
+            .map(|path| match self.site_packages_root_path {
+                Some(ref root) => PathBuf::from(root).join(path),
+                None => PathBuf::from(path),
+            })
+            .collect()
+    }
+
     fn file_paths(
         &self,
         pkg_type: PackageType,
@@ -245,3 +346,98 @@ fn normalize(host_root: &RootFsPath, path: &WorkloadPath) -> WorkloadPath {
         Err(_) => path.clone(),
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+
+    #[test]
+    fn test_content_hash() {
+        let a = temp_file::with_contents(
+            br#"{"artifacts": [{"id": "1", "name": "bash"}], "source": {"id": "a"},
+                "descriptor": {"timestamp": "2024-01-01"}}"#,
+        );
+        let b = temp_file::with_contents(
+            br#"{"descriptor": {"timestamp": "2024-02-02"}, "source": {"id": "b"},
+                "artifacts": [{"name": "bash", "id": "1"}]}"#,
+        );
+        let c = temp_file::with_contents(
+            br#"{"artifacts": [{"id": "1", "name": "zsh"}], "source": {"id": "a"}}"#,
+        );
+
+        let hash = content_hash(a.path()).unwrap();
+        assert!(hash.len() == 64);
+        assert!(hash == content_hash(b.path()).unwrap());
+        assert!(hash != content_hash(c.path()).unwrap());
+    }
+
+    #[test]
+    fn test_load() {
+        let doc = temp_file::with_contents(
+            br#"{"artifacts": [
+                    {"id": "1", "name": "bash", "type": "deb", "metadataType": "DpkgMetadata",
+                     "licenses": [], "cpes": ["cpe:2.3:a:bash:bash:5.1:*:*:*:*:*:*:*"],
+                     "metadata": {"package": "bash", "files": [
+                        {"path": "/bin/bash", "digest": {"algorithm": "md5", "value": "00"}},
+                        {"path": "/usr/share/doc/bash/README"}
+                     ]}},
+                    {"id": "2", "name": "requests", "type": "python",
+                     "metadataType": "PythonPackageMetadata",
+                     "metadata": {"sitePackagesRootPath": "/usr/lib/python3/dist-packages",
+                                  "files": [{"path": "requests/api.py"}]}},
+                    {"id": "3", "name": "empty", "type": "rpm"}
+                ],
+                "source": {"id": "abc", "type": "directory", "target": "/"},
+                "distro": {"name": "debian"}}"#,
+        );
+
+        let sbom = Sbom::load(&doc.path().into()).unwrap();
+        assert!(sbom.id() == "abc");
+        assert!(sbom.artifacts().len() == 3);
+        assert!(
+            sbom.raw_file_paths()
+                == [
+                    PathBuf::from("/bin/bash"),
+                    PathBuf::from("/usr/share/doc/bash/README"),
+                    PathBuf::from("/usr/lib/python3/dist-packages/requests/api.py"),
+                ]
+        );
+
+        let bad = temp_file::with_contents(br#"{"artifacts": [{"id": 1}]}"#);
+        assert!(Sbom::load(&bad.path().into()).is_err());
+    }
+
+    #[test]
+    fn test_file_paths() {
+        let dir = crate::test_util::TempDir::new("sbom");
+        let host_root = RootFsPath::from(dir.path()).realpath().unwrap();
+
+        std::fs::create_dir_all(dir.join("usr/lib")).unwrap();
+        std::fs::write(dir.join("usr/lib/libc.so.6"), b"").unwrap();
+        std::os::unix::fs::symlink("usr/lib", dir.join("lib")).unwrap();
+
+        let doc = temp_file::with_contents(
+            br#"{"artifacts": [
+                    {"id": "1", "name": "libc6", "type": "deb", "metadataType": "DpkgMetadata",
+                     "metadata": {"package": "libc6", "files": [
+                        {"path": "/lib/libc.so.6"},
+                        {"path": "/lib/missing.so"}
+                     ]}}
+                ],
+                "source": {"id": "abc", "type": "directory", "target": "/"}}"#,
+        );
+
+        let sbom = Sbom::load(&doc.path().into()).unwrap();
+
+        // missing files are kept as listed
+        assert!(
+            sbom.file_paths(&host_root)
+                == [
+                    WorkloadPath::from("/usr/lib/libc.so.6"),
+                    WorkloadPath::from("/lib/missing.so"),
+                ]
+        );
+    }
+}
@@ -0,0 +1,178 @@
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+
+use log::*;
+use tokio::sync::mpsc::error::TrySendError;
+use tokio::sync::mpsc::{Receiver, Sender};
+
+use crate::open_monitor::OpenEvent;
+
+// Decoded events are published once per batch and shared, read-only,
+// by all the sinks. Publishing costs one Arc clone per sink, not per event.
+pub type EventBatch = Arc<[OpenEvent]>;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Backpressure {
+    // Wait for the sink to catch up. For the sinks that must not lose events.
+    Block,
+
+    // Drop the batch if the sink is full
+    Drop,
+}
+
+struct Sink {
+    name: String,
+    policy: Backpressure,
+    tx: Sender<EventBatch>,
+    dropped: AtomicU64,
+}
+
+impl Sink {
+    fn record_drop(&self, batch: &EventBatch) {
+        let n = batch.len() as u64;
+        let prev = self.dropped.fetch_add(n, Ordering::Relaxed);
+
+        // Don't flood the log, once per ~1000 events is enough
+        if prev / 1000 != (prev + n) / 1000 {
+            warn!(
+                "Sink {} is falling behind, dropped {} events",
+                self.name,
+                prev + n
+            );
+        }
+    }
+}
+
+// The set of consumers of the open events. Sinks are registered
+// before the producers start and the registry is immutable afterwards.
+#[derive(Default)]
+pub struct SinkRegistry {
+    sinks: Vec<Sink>,
+}
+
+impl SinkRegistry {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    // capacity is in batches
+    pub fn register(
+        &mut self,
+        name: &str,
+        capacity: usize,
+        policy: Backpressure,
+    ) -> Receiver<EventBatch> {
+        let (tx, rx) = tokio::sync::mpsc::channel(capacity);
+
+        self.sinks.push(Sink {
+            name: name.to_string(),
+            policy,
+            tx,
+            dropped: AtomicU64::new(0),
+        });
+
+        rx
+    }
+
+    pub async fn publish(&self, batch: EventBatch) {
+        if batch.is_empty() {
+            return;
+        }
+
+        for sink in &self.sinks {
+            match sink.policy {
+                Backpressure::Block => {
+                    if sink.tx.send(batch.clone()).await.is_err() {
+                        debug!("Sink {} is closed", sink.name);
+                    }
+                }
+                Backpressure::Drop => self.try_publish(sink, &batch),
+            }
+        }
+    }
+
+    // For the producers running outside of the async runtime
+    pub fn blocking_publish(&self, batch: EventBatch) {
+        if batch.is_empty() {
+            return;
+        }
+
+        for sink in &self.sinks {
+            match sink.policy {
+                Backpressure::Block => {
+                    if sink.tx.blocking_send(batch.clone()).is_err() {
+                        debug!("Sink {} is closed", sink.name);
+                    }
+                }
+                Backpressure::Drop => self.try_publish(sink, &batch),
+            }
+        }
+    }
+
+    // Total number of events dropped by the sink
+    pub fn dropped(&self, name: &str) -> u64 {
+        self.sinks
+            .iter()
+            .filter(|s| s.name == name)
+            .map(|s| s.dropped.load(Ordering::Relaxed))
+            .sum()
+    }
+
+    fn try_publish(&self, sink: &Sink, batch: &EventBatch) {
+        match sink.tx.try_send(batch.clone()) {
+            Ok(()) => (),
+            Err(TrySendError::Full(_)) => sink.record_drop(batch),
+            Err(TrySendError::Closed(_)) => debug!("Sink {} is closed", sink.name),
+        }
+    }
+}
+
+pub type SinkRegistryArc = Arc<SinkRegistry>;
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+    use crate::scoped_path::WorkloadPath;
+
+    fn batch(n: usize) -> EventBatch {
+        (0..n)
+            .map(|i| OpenEvent {
+                pid: i as u32,
+                cgroup_name: None,
+                cgroup_id: None,
+                filename: WorkloadPath::from("/usr/bin/sh"),
+                exec: false,
+            })
+            .collect()
+    }
+
+    #[test]
+    fn test_shared_batches() {
+        let mut sinks = SinkRegistry::new();
+        let mut rx1 = sinks.register("first", 4, Backpressure::Block);
+        let mut rx2 = sinks.register("second", 4, Backpressure::Drop);
+
+        let b = batch(3);
+        sinks.blocking_publish(b.clone());
+
+        let b1 = rx1.try_recv().unwrap();
+        let b2 = rx2.try_recv().unwrap();
+        assert!(Arc::ptr_eq(&b, &b1));
+        assert!(Arc::ptr_eq(&b, &b2));
+    }
+
+    #[test]
+    fn test_drop_when_full() {
+        let mut sinks = SinkRegistry::new();
+        let mut rx = sinks.register("slow", 1, Backpressure::Drop);
+
+        sinks.blocking_publish(batch(2));
+        sinks.blocking_publish(batch(5));
+
+        assert!(rx.try_recv().unwrap().len() == 2);
+        assert!(rx.try_recv().is_err());
+        assert!(sinks.dropped("slow") == 5);
+    }
+}
@@ -0,0 +1,207 @@
+// Soak test of the container and workload bookkeeping under accelerated churn.
+// Run with: EDGEBIT_SOAK_MINUTES=240 cargo test soak -- --ignored --nocapture
+
+use std::collections::HashMap;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::{Duration, Instant, SystemTime};
+
+use assert2::assert;
+
+use crate::cloud_metadata::CloudMetadata;
+use crate::config::Config;
+use crate::containers::{ContainerInfo, ContainerRuntimeEvents, Containers, Runtime};
+use crate::file_type::FileTypeFilter;
+use crate::open_monitor::{FileOpenMonitorArc, NullOpenMonitor};
+use crate::scoped_path::*;
+use crate::startup::StartupProfile;
+use crate::test_util::TempDir;
+use crate::workloads::containers::ContainerWorkloads;
+use crate::workloads::track_container_lifecycle;
+
+// Per round: containers started, of which some get their stop reported
+// before their start, and short-lived processes (cgroups) and new files each
+const CONTAINERS: usize = 20;
+const EARLY_STOPS: usize = 5;
+const PROCESSES: u64 = 10;
+const NEW_FILES: usize = 10;
+
+// Rounds before the memory is considered warmed up
+const WARMUP_ROUNDS: usize = 20;
+
+// Allowed RSS growth between the first half and the last quarter of the run
+const RSS_SLACK: f64 = 1.10;
+const RSS_SLACK_KB: u64 = 4096;
+
+fn rss_kb() -> u64 {
+    let status = std::fs::read_to_string("/proc/self/status").unwrap();
+    status
+        .lines()
+        .find_map(|l| l.strip_prefix("VmRSS:"))
+        .and_then(|v| v.trim().trim_end_matches("kB").trim().parse().ok())
+        .unwrap_or(0)
+}
+
+fn container_info(rootfs: &Path, start_time: SystemTime) -> ContainerInfo {
+    ContainerInfo {
+        name: None,
+        image_id: Some("sha256:soak".to_string()),
+        image: None,
+        rootfs: Some(HostPath::from(rootfs)),
+        start_time: Some(start_time),
+        end_time: None,
+        mounts: Vec::new(),
+        labels: HashMap::new(),
+    }
+}
+
+fn load_config() -> Config {
+    let yaml = "edgebit_id: soak\n\
+                edgebit_url: http://localhost:7777\n\
+                syft_path: /bin/true\n\
+                syft_config: /dev/null\n\
+                convergence_minutes: 1\n";
+
+    let file = temp_file::with_contents(yaml.as_bytes());
+    Config::load(file.path(), None, Some(PathBuf::from("/"))).unwrap()
+}
+
+#[tokio::test(start_paused = true)]
+#[ignore = "long running, set EDGEBIT_SOAK_MINUTES"]
+async fn test_soak() {
+    let minutes: u64 = std::env::var("EDGEBIT_SOAK_MINUTES")
+        .ok()
+        .and_then(|m| m.parse().ok())
+        .unwrap_or(1);
+    let deadline = Instant::now() + Duration::from_secs(minutes * 60);
+
+    let config = Arc::new(load_config());
+    let open_mon: FileOpenMonitorArc = Arc::new(NullOpenMonitor);
+    let workloads = Arc::new(std::sync::Mutex::new(ContainerWorkloads::new(
+        config.clone(),
+        open_mon,
+        Arc::new(FileTypeFilter::none()),
+        None,
+    )));
+
+    let (cont_tx, cont_rx) = tokio::sync::mpsc::channel(10);
+    let (events_tx, mut events_rx) = tokio::sync::mpsc::channel(1000);
+    let containers = Containers::new(
+        config,
+        CloudMetadata::null(),
+        cont_tx,
+        Arc::new(StartupProfile::new()),
+    );
+    let runtime = containers.events();
+
+    tokio::task::spawn(track_container_lifecycle(
+        cont_rx,
+        workloads.clone(),
+        events_tx,
+    ));
+    tokio::task::spawn(async move { while events_rx.recv().await.is_some() {} });
+
+    let rootfs = TempDir::new("soak");
+    let mut rss = Vec::new();
+    let mut next_id = 0u64;
+
+    while Instant::now() < deadline {
+        let mut ids = Vec::new();
+
+        for i in 0..CONTAINERS {
+            let id = format!("{next_id:064x}");
+            next_id += 1;
+
+            let started = SystemTime::now();
+            if i < EARLY_STOPS {
+                runtime
+                    .container_stopped(id.clone(), SystemTime::now())
+                    .await;
+            }
+
+            runtime
+                .container_started(
+                    Runtime::Docker,
+                    id.clone(),
+                    container_info(&rootfs, started),
+                )
+                .await;
+            ids.push(id);
+        }
+
+        // Let the lifecycle task create the workloads
+        tokio::time::sleep(Duration::from_millis(100)).await;
+
+        let mut files = Vec::new();
+        for n in 0..NEW_FILES {
+            let name = format!("lib{next_id}-{n}.so");
+            std::fs::write(rootfs.join(&name), b"").unwrap();
+            files.push(name);
+        }
+
+        {
+            let mut workloads = workloads.lock().unwrap();
+            for id in &ids {
+                for pid in 0..PROCESSES {
+                    let cgroup_id = next_id * PROCESSES + pid;
+                    for name in &files {
+                        let path = WorkloadPath::from(format!("/{name}"));
+                        workloads.file_opened(id, &path, Some(cgroup_id), false);
+                    }
+                    workloads.cgroup_removed(id, cgroup_id);
+                }
+            }
+
+            // The processes are gone, so are their cgroups
+            assert!(workloads.sizes() == (CONTAINERS - EARLY_STOPS, 0));
+        }
+
+        for name in &files {
+            _ = std::fs::remove_file(rootfs.join(name));
+        }
+
+        for id in ids {
+            runtime.container_stopped(id, SystemTime::now()).await;
+        }
+
+        // Past the cleanup lag of the stopped containers
+        tokio::time::sleep(Duration::from_secs(11)).await;
+
+        let (cont_map, registered, tombstones) = containers.sizes();
+        let (wrklds, _) = {
+            let mut workloads = workloads.lock().unwrap();
+
+            // As reported periodically by the agent, including the stopped ones
+            workloads.flush_in_use();
+            workloads.sizes()
+        };
+
+        assert!(cont_map == 0);
+        assert!(registered == 0);
+        assert!(wrklds == 0);
+
+        // Tombstones are kept for a minute (of the paused clock)
+        assert!(tombstones <= EARLY_STOPS * 8);
+
+        rss.push(rss_kb());
+    }
+
+    drop(rootfs);
+
+    let samples = &rss[WARMUP_ROUNDS.min(rss.len())..];
+    println!("{} rounds, RSS samples (kB): {samples:?}", rss.len());
+
+    if samples.len() < 8 {
+        println!("Too short a run to check the RSS trend");
+        return;
+    }
+
+    let first_half = samples[..samples.len() / 2].iter().max().unwrap();
+    let last_quarter = &samples[samples.len() * 3 / 4..];
+    let last_mean = last_quarter.iter().sum::<u64>() / last_quarter.len() as u64;
+
+    assert!(
+        last_mean as f64 <= *first_half as f64 * RSS_SLACK + RSS_SLACK_KB as f64,
+        "RSS grew from {first_half}kB to {last_mean}kB"
+    );
+}
@@ -0,0 +1,238 @@
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use anyhow::Result;
+use log::*;
+use serde_json::json;
+
+// A completed startup phase, relative to the start of the agent
+struct Phase {
+    name: String,
+    start: Duration,
+    duration: Duration,
+}
+
+// Returned by begin(), passed back to end() when the phase completes
+pub struct PhaseStart {
+    name: String,
+    start: Instant,
+}
+
+struct State {
+    phases: Vec<Phase>,
+
+    // Set once the agent starts monitoring. Phases running in the
+    // background (e.g. container bootstrap) may complete after that.
+    ready: Option<Duration>,
+}
+
+// Monotonic timings of the startup phases. Logged as one summary once the
+// agent is up, served by the admin interface and optionally written
+// out in the Chrome trace event format (chrome://tracing, Perfetto).
+pub struct StartupProfile {
+    origin: Instant,
+    origin_wall: SystemTime,
+    trace_path: Option<PathBuf>,
+    state: Mutex<State>,
+}
+
+impl StartupProfile {
+    pub fn new() -> Self {
+        Self {
+            origin: Instant::now(),
+            origin_wall: SystemTime::now(),
+            trace_path: None,
+            state: Mutex::new(State {
+                phases: Vec::new(),
+                ready: None,
+            }),
+        }
+    }
+
+    // Known only once the config is loaded, which is already a phase
+    pub fn set_trace_path(&mut self, path: Option<PathBuf>) {
+        self.trace_path = path;
+    }
+
+    pub fn begin(&self, name: &str) -> PhaseStart {
+        PhaseStart {
+            name: name.to_string(),
+            start: Instant::now(),
+        }
+    }
+
+    pub fn end(&self, phase: PhaseStart) {
+        self.record(phase.name, phase.start);
+    }
+
+    // Records a phase that started at start and ends now
+    pub fn record(&self, name: String, start: Instant) {
+        let phase = Phase {
+            start: start.saturating_duration_since(self.origin),
+            duration: start.elapsed(),
+            name,
+        };
+
+        // Late phases are not in the summary, log them on their own
+        let late = format!("{} took {}", phase.name, format_secs(phase.duration));
+
+        let ready = {
+            let mut state = self.state.lock().unwrap();
+            state.phases.push(phase);
+            state.ready.is_some()
+        };
+
+        if ready {
+            info!("Startup phase {late}");
+            self.write_trace();
+        }
+    }
+
+    // Marks the agent as up: logs the summary and writes the trace
+    pub fn ready(&self) {
+        let summary = {
+            let mut state = self.state.lock().unwrap();
+            let total = self.origin.elapsed();
+            state.ready = Some(total);
+
+            let phases: Vec<_> = state
+                .phases
+                .iter()
+                .map(|p| format!("{}={}", p.name, format_secs(p.duration)))
+                .collect();
+
+            format!("total={} {}", format_secs(total), phases.join(" "))
+        };
+
+        info!("Startup: {summary}");
+        self.write_trace();
+    }
+
+    pub fn to_json(&self) -> serde_json::Value {
+        let state = self.state.lock().unwrap();
+
+        let phases: Vec<_> = state
+            .phases
+            .iter()
+            .map(|p| {
+                json!({
+                    "name": p.name,
+                    "start_ms": p.start.as_millis() as u64,
+                    "duration_ms": p.duration.as_millis() as u64,
+                })
+            })
+            .collect();
+
+        json!({
+            "ready": state.ready.is_some(),
+            "ready_ms": state.ready.map(|d| d.as_millis() as u64),
+            "phases": phases,
+        })
+    }
+
+    fn write_trace(&self) {
+        if let Some(path) = &self.trace_path {
+            if let Err(err) = self.try_write_trace(path) {
+                warn!(
+                    "Failed to write the startup trace to {}: {err}",
+                    path.display()
+                );
+            }
+        }
+    }
+
+    fn try_write_trace(&self, path: &Path) -> Result<()> {
+        let trace = self.to_trace();
+
+        // Written as a whole and renamed so the readers never see a partial file
+        let tmp_path = path.with_extension("tmp");
+        std::fs::write(&tmp_path, serde_json::to_vec(&trace)?)?;
+        std::fs::rename(&tmp_path, path)?;
+
+        Ok(())
+    }
+
+    fn to_trace(&self) -> serde_json::Value {
+        let state = self.state.lock().unwrap();
+        let pid = std::process::id();
+
+        // Complete ("X") events, timestamps are in microseconds
+        let mut events: Vec<_> = state
+            .phases
+            .iter()
+            .map(|p| {
+                json!({
+                    "name": p.name,
+                    "cat": "startup",
+                    "ph": "X",
+                    "ts": p.start.as_micros() as u64,
+                    "dur": p.duration.as_micros() as u64,
+                    "pid": pid,
+                    "tid": 1,
+                })
+            })
+            .collect();
+
+        if let Some(ready) = state.ready {
+            events.push(json!({
+                "name": "ready",
+                "cat": "startup",
+                "ph": "i",
+                "s": "g",
+                "ts": ready.as_micros() as u64,
+                "pid": pid,
+                "tid": 1,
+            }));
+        }
+
+        let origin = self
+            .origin_wall
+            .duration_since(UNIX_EPOCH)
+            .unwrap_or_default()
+            .as_secs();
+
+        json!({
+            "traceEvents": events,
+            "displayTimeUnit": "ms",
+            "otherData": { "start_time": origin },
+        })
+    }
+}
+
+pub type StartupProfileArc = Arc<StartupProfile>;
+
+fn format_secs(d: Duration) -> String {
+    format!("{:.3}s", d.as_secs_f64())
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+
+    #[test]
+    fn test_startup_trace() {
+        let profile = StartupProfile::new();
+
+        let phase = profile.begin("connect");
+        profile.end(phase);
+        profile.ready();
+        profile.record("docker_bootstrap".to_string(), profile.origin);
+
+        let trace = profile.to_trace();
+        let events = trace["traceEvents"].as_array().unwrap();
+
+        assert!(events.len() == 3);
+        assert!(events[0]["name"] == "connect");
+        assert!(events[0]["ph"] == "X");
+        assert!(events[1]["ph"] == "X");
+        assert!(events[1]["ts"] == 0);
+        assert!(events[2]["name"] == "ready");
+
+        let json = profile.to_json();
+        assert!(json["ready"] == true);
+        assert!(json["phases"].as_array().unwrap().len() == 2);
+    }
+}
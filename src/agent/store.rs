@@ -0,0 +1,900 @@
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::fs::{File, OpenOptions};
+use std::io::{ErrorKind, Read, Write};
+use std::num::NonZeroUsize;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use anyhow::{anyhow, Result};
+use log::*;
+
+use crate::mmap::Mmap;
+use crate::scoped_path::WorkloadPath;
+
+pub const DEFAULT_STORE_DIR: &str = "/var/lib/edgebit";
+pub const DEFAULT_STORE_RETENTION_DAYS: u32 = 30;
+
+// The in-use records are kept at an hour resolution until they
+// get compacted into the per-day bitmaps
+const BUCKET_SECS: u64 = 3600;
+const BUCKETS_PER_DAY: u32 = 24;
+
+const KEYS_FILE: &str = "keys";
+const LOG_FILE: &str = "in-use.log";
+const UNSYNCED_FILE: &str = "unsynced";
+const DAYS_DIR: &str = "days";
+
+// Present while the renumbered files are being put in place, see finish_rewrite()
+const REWRITE_MARKER: &str = "rewrite";
+const NEW_SUFFIX: &str = ".new";
+
+// workload (u32), path (u32), bucket (u32); all little endian
+const RECORD_SIZE: usize = 12;
+
+// Day file layout (little endian):
+//   "EBIU", version (u32), number of workloads (u32)
+//   per workload: workload (u32), offset of the bitmap (u32), bitmap length in u64 words (u32)
+//   the bitmaps, bit N is set if the path with id N was in use that day
+const DAY_MAGIC: &[u8; 4] = b"EBIU";
+const DAY_VERSION: u32 = 1;
+const DAY_HEADER_SIZE: usize = 12;
+const DAY_ENTRY_SIZE: usize = 12;
+
+#[derive(Clone, Copy, PartialEq, Eq, Hash)]
+struct Record {
+    workload: u32,
+    path: u32,
+    bucket: u32,
+}
+
+impl Record {
+    fn to_bytes(self) -> [u8; RECORD_SIZE] {
+        let mut buf = [0u8; RECORD_SIZE];
+        buf[0..4].copy_from_slice(&self.workload.to_le_bytes());
+        buf[4..8].copy_from_slice(&self.path.to_le_bytes());
+        buf[8..12].copy_from_slice(&self.bucket.to_le_bytes());
+        buf
+    }
+
+    fn from_bytes(buf: &[u8]) -> Self {
+        Self {
+            workload: read_u32(buf, 0),
+            path: read_u32(buf, 4),
+            bucket: read_u32(buf, 8),
+        }
+    }
+
+    fn day(&self) -> u32 {
+        self.bucket / BUCKETS_PER_DAY
+    }
+}
+
+// Append-only mapping of the workload ids and paths to small integers
+struct Keys {
+    ids: HashMap<String, u32>,
+    names: Vec<String>,
+    file: File,
+}
+
+impl Keys {
+    // Entries are a u32 (little endian) length followed by the key
+    fn open(path: &Path) -> Result<Self> {
+        let mut data = Vec::new();
+        if let Ok(mut file) = File::open(path) {
+            file.read_to_end(&mut data)?;
+        }
+
+        let mut ids = HashMap::new();
+        let mut names = Vec::new();
+        let mut pos = 0;
+
+        while pos + 4 <= data.len() {
+            let len = read_u32(&data, pos) as usize;
+            if pos + 4 + len > data.len() {
+                break;
+            }
+
+            let name = String::from_utf8_lossy(&data[pos + 4..pos + 4 + len]).to_string();
+            ids.insert(name.clone(), names.len() as u32);
+            names.push(name);
+            pos += 4 + len;
+        }
+
+        let file = OpenOptions::new().create(true).append(true).open(path)?;
+
+        // drop a partially written entry
+        if pos != data.len() {
+            warn!(
+                "Truncating the partial entry at the end of {}",
+                path.display()
+            );
+            file.set_len(pos as u64)?;
+        }
+
+        Ok(Self { ids, names, file })
+    }
+
+    fn intern(&mut self, name: &str) -> Result<u32> {
+        if let Some(id) = self.ids.get(name) {
+            return Ok(*id);
+        }
+
+        let mut buf = Vec::with_capacity(4 + name.len());
+        encode_key(&mut buf, name);
+        self.file.write_all(&buf)?;
+
+        let id = self.names.len() as u32;
+        self.ids.insert(name.to_string(), id);
+        self.names.push(name.to_string());
+        Ok(id)
+    }
+
+    fn get(&self, name: &str) -> Option<u32> {
+        self.ids.get(name).copied()
+    }
+
+    fn name(&self, id: u32) -> Option<&str> {
+        self.names.get(id as usize).map(|s| s.as_str())
+    }
+}
+
+fn encode_key(buf: &mut Vec<u8>, name: &str) {
+    buf.extend_from_slice(&(name.len() as u32).to_le_bytes());
+    buf.extend_from_slice(name.as_bytes());
+}
+
+// Node local history of the in-use files. New records are appended to a log
+// and the days that are over get compacted into per-day, per-workload bitmaps.
+pub struct InUseStore {
+    dir: PathBuf,
+    keys: Keys,
+    log: File,
+
+    // The records in the log, i.e. not compacted yet
+    recent: HashSet<Record>,
+    compacted_day: u32,
+    retention_days: u32,
+
+    // Bucket of the first record that may not have made it to the server
+    unsynced_since: Option<u32>,
+}
+
+impl InUseStore {
+    pub fn open(dir: &Path, retention_days: u32) -> Result<Self> {
+        std::fs::create_dir_all(dir.join(DAYS_DIR))
+            .map_err(|err| anyhow!("Failed to create {}: {err}", dir.display()))?;
+
+        finish_rewrite(dir)?;
+
+        let keys = Keys::open(&dir.join(KEYS_FILE))?;
+        let recent = read_log(&dir.join(LOG_FILE))?;
+        let log = OpenOptions::new()
+            .create(true)
+            .append(true)
+            .open(dir.join(LOG_FILE))?;
+
+        let unsynced_since = match std::fs::read(dir.join(UNSYNCED_FILE)) {
+            Ok(data) if data.len() == 4 => Some(read_u32(&data, 0)),
+            _ => None,
+        };
+
+        let mut store = Self {
+            dir: dir.to_path_buf(),
+            keys,
+            log,
+            recent,
+            compacted_day: 0,
+            retention_days,
+            unsynced_since,
+        };
+
+        store.compact()?;
+        Ok(store)
+    }
+
+    pub fn record(&mut self, workload_id: &str, files: &[WorkloadPath]) -> Result<()> {
+        self.record_at(workload_id, files, current_bucket())
+    }
+
+    fn record_at(&mut self, workload_id: &str, files: &[WorkloadPath], bucket: u32) -> Result<()> {
+        let workload = self.keys.intern(workload_id)?;
+
+        let mut buf = Vec::new();
+        for f in files {
+            let path = self.keys.intern(&f.as_raw().to_string_lossy())?;
+            let rec = Record {
+                workload,
+                path,
+                bucket,
+            };
+
+            if self.recent.insert(rec) {
+                buf.extend_from_slice(&rec.to_bytes());
+            }
+        }
+
+        self.log.write_all(&buf)?;
+        Ok(())
+    }
+
+    // Cheap unless the day has changed since the last compaction
+    pub fn compact(&mut self) -> Result<()> {
+        self.compact_before(current_bucket() / BUCKETS_PER_DAY)
+    }
+
+    // Folds the records of the days before `today` into the day files
+    fn compact_before(&mut self, today: u32) -> Result<()> {
+        if self.compacted_day == today {
+            return Ok(());
+        }
+
+        let (old, keep): (Vec<Record>, Vec<Record>) =
+            self.recent.iter().copied().partition(|r| r.day() < today);
+
+        if !old.is_empty() {
+            let mut days = BTreeMap::<u32, BTreeMap<u32, Vec<u64>>>::new();
+            for r in &old {
+                let bitmap = days
+                    .entry(r.day())
+                    .or_default()
+                    .entry(r.workload)
+                    .or_default();
+                set_bit(bitmap, r.path);
+            }
+
+            // The day files are updated first, merging is idempotent if the
+            // log rewrite does not happen
+            for (day, mut bitmaps) in days {
+                let path = day_path(&self.dir, day);
+                if let Some(existing) = DayBitmaps::open(&path)? {
+                    existing.merge_into(&mut bitmaps);
+                }
+
+                write_day(&path, &bitmaps)?;
+            }
+
+            let mut buf = Vec::with_capacity(keep.len() * RECORD_SIZE);
+            for r in &keep {
+                buf.extend_from_slice(&r.to_bytes());
+            }
+
+            let log_path = self.dir.join(LOG_FILE);
+            write_atomic(&log_path, &buf)?;
+            self.log = OpenOptions::new().append(true).open(&log_path)?;
+            self.recent = keep.into_iter().collect();
+
+            debug!("Compacted {} in-use records", old.len());
+        }
+
+        self.prune(today)?;
+
+        self.compacted_day = today;
+        Ok(())
+    }
+
+    // Removes the days past the retention and the keys only they used
+    fn prune(&mut self, today: u32) -> Result<()> {
+        let oldest = today.saturating_sub(self.retention_days);
+        let expired: Vec<u32> = self
+            .stored_days(0)?
+            .into_iter()
+            .filter(|day| *day < oldest)
+            .collect();
+
+        if expired.is_empty() {
+            return Ok(());
+        }
+
+        for day in &expired {
+            std::fs::remove_file(day_path(&self.dir, *day))?;
+        }
+
+        info!("Removed {} days of in-use history", expired.len());
+        self.rewrite_keys()
+    }
+
+    // The ids are the positions in the keys file, dropping the unused keys
+    // renumbers the others in the day files and the log too. All the new
+    // files are written before any of them replaces the current one.
+    fn rewrite_keys(&mut self) -> Result<()> {
+        let mut days = Vec::new();
+        for day in self.stored_days(0)? {
+            if let Some(bitmaps) = DayBitmaps::open(&day_path(&self.dir, day))? {
+                days.push((day, bitmaps));
+            }
+        }
+
+        let mut live = vec![false; self.keys.names.len()];
+        let mut mark = |id: u32| {
+            if let Some(l) = live.get_mut(id as usize) {
+                *l = true;
+            }
+        };
+
+        for (_, bitmaps) in &days {
+            for workload in bitmaps.workloads() {
+                mark(workload);
+                bitmaps.paths(workload).into_iter().for_each(&mut mark);
+            }
+        }
+
+        for r in &self.recent {
+            mark(r.workload);
+            mark(r.path);
+        }
+
+        let mut new_ids = vec![None; live.len()];
+        let mut keys = Vec::new();
+        let mut count = 0;
+        for (id, name) in self.keys.names.iter().enumerate() {
+            if live[id] {
+                new_ids[id] = Some(count);
+                encode_key(&mut keys, name);
+                count += 1;
+            }
+        }
+
+        if count as usize == live.len() {
+            return Ok(());
+        }
+
+        let renumber = |id: u32| new_ids.get(id as usize).copied().flatten();
+
+        for (day, bitmaps) in &days {
+            let mut renumbered = BTreeMap::<u32, Vec<u64>>::new();
+            for workload in bitmaps.workloads() {
+                let Some(new_workload) = renumber(workload) else {
+                    continue;
+                };
+
+                let bitmap = renumbered.entry(new_workload).or_default();
+                for path in bitmaps.paths(workload).into_iter().filter_map(renumber) {
+                    set_bit(bitmap, path);
+                }
+            }
+
+            write_day(&new_path(&day_path(&self.dir, *day)), &renumbered)?;
+        }
+        drop(days);
+
+        let mut log = Vec::with_capacity(self.recent.len() * RECORD_SIZE);
+        for r in &self.recent {
+            if let (Some(workload), Some(path)) = (renumber(r.workload), renumber(r.path)) {
+                let rec = Record {
+                    workload,
+                    path,
+                    bucket: r.bucket,
+                };
+                log.extend_from_slice(&rec.to_bytes());
+            }
+        }
+
+        let log_path = self.dir.join(LOG_FILE);
+        let keys_path = self.dir.join(KEYS_FILE);
+        write_atomic(&new_path(&log_path), &log)?;
+        write_atomic(&new_path(&keys_path), &keys)?;
+
+        write_atomic(&self.dir.join(REWRITE_MARKER), &[])?;
+        finish_rewrite(&self.dir)?;
+
+        self.keys = Keys::open(&keys_path)?;
+        self.recent = read_log(&log_path)?;
+        self.log = OpenOptions::new().append(true).open(&log_path)?;
+
+        debug!("Dropped {} unused keys", live.len() - count as usize);
+        Ok(())
+    }
+
+    // Workloads with in-use records within the last `days` days
+    pub fn workloads(&self, days: u32) -> Result<Vec<String>> {
+        let ids = self.workloads_since(today().saturating_sub(days))?;
+
+        let mut names: Vec<String> = ids
+            .into_iter()
+            .filter_map(|id| self.keys.name(id).map(|n| n.to_string()))
+            .collect();
+
+        names.sort();
+        Ok(names)
+    }
+
+    // Files used by the workload within the last `days` days with
+    // the last day (since UNIX epoch) they were used on
+    pub fn in_use(&self, workload_id: &str, days: u32) -> Result<Vec<(String, u32)>> {
+        self.in_use_since(workload_id, today().saturating_sub(days))
+    }
+
+    fn in_use_since(&self, workload_id: &str, since: u32) -> Result<Vec<(String, u32)>> {
+        let workload = match self.keys.get(workload_id) {
+            Some(id) => id,
+            None => return Ok(Vec::new()),
+        };
+
+        let mut last_day = HashMap::<u32, u32>::new();
+
+        // ascending, the later days overwrite the earlier ones
+        for day in self.stored_days(since)? {
+            if let Some(bitmaps) = DayBitmaps::open(&day_path(&self.dir, day))? {
+                for path in bitmaps.paths(workload) {
+                    last_day.insert(path, day);
+                }
+            }
+        }
+
+        for r in &self.recent {
+            if r.workload == workload && r.day() >= since {
+                let last = last_day.entry(r.path).or_default();
+                *last = (*last).max(r.day());
+            }
+        }
+
+        let mut files: Vec<(String, u32)> = last_day
+            .into_iter()
+            .filter_map(|(path, day)| self.keys.name(path).map(|p| (p.to_string(), day)))
+            .collect();
+
+        files.sort();
+        Ok(files)
+    }
+
+    fn workloads_since(&self, since: u32) -> Result<HashSet<u32>> {
+        let mut ids = HashSet::new();
+
+        for day in self.stored_days(since)? {
+            if let Some(bitmaps) = DayBitmaps::open(&day_path(&self.dir, day))? {
+                ids.extend(bitmaps.workloads());
+            }
+        }
+
+        ids.extend(
+            self.recent
+                .iter()
+                .filter(|r| r.day() >= since)
+                .map(|r| r.workload),
+        );
+
+        Ok(ids)
+    }
+
+    // The days, starting with `since`, that have a day file
+    fn stored_days(&self, since: u32) -> Result<Vec<u32>> {
+        let mut days: Vec<u32> = std::fs::read_dir(self.dir.join(DAYS_DIR))?
+            .filter_map(|entry| entry.ok())
+            .filter_map(|entry| {
+                entry
+                    .file_name()
+                    .to_str()
+                    .and_then(|name| name.strip_suffix(".bm"))
+                    .and_then(|day| day.parse().ok())
+            })
+            .filter(|day| *day >= since)
+            .collect();
+
+        days.sort();
+        Ok(days)
+    }
+
+    // Called when a report to the server fails, the history gets resent
+    // in bulk once the connectivity is back
+    pub fn mark_unsynced(&mut self) -> Result<()> {
+        if self.unsynced_since.is_none() {
+            let bucket = current_bucket();
+            write_atomic(&self.dir.join(UNSYNCED_FILE), &bucket.to_le_bytes())?;
+            self.unsynced_since = Some(bucket);
+        }
+
+        Ok(())
+    }
+
+    pub fn mark_synced(&mut self) -> Result<()> {
+        self.unsynced_since = None;
+
+        match std::fs::remove_file(self.dir.join(UNSYNCED_FILE)) {
+            Err(err) if err.kind() != ErrorKind::NotFound => Err(err.into()),
+            _ => Ok(()),
+        }
+    }
+
+    pub fn is_unsynced(&self) -> bool {
+        self.unsynced_since.is_some()
+    }
+
+    // Everything in use since the first failed report, by workload. The
+    // compacted days are resent in full, the server side is idempotent.
+    pub fn unsynced(&self) -> Result<HashMap<String, Vec<WorkloadPath>>> {
+        let since = match self.unsynced_since {
+            Some(bucket) => bucket / BUCKETS_PER_DAY,
+            None => return Ok(HashMap::new()),
+        };
+
+        let mut result = HashMap::new();
+        for workload in self.workloads_since(since)? {
+            let workload_id = match self.keys.name(workload) {
+                Some(id) => id,
+                None => continue,
+            };
+
+            let files = self
+                .in_use_since(workload_id, since)?
+                .into_iter()
+                .map(|(path, _)| WorkloadPath::from(path))
+                .collect();
+
+            result.insert(workload_id.to_string(), files);
+        }
+
+        Ok(result)
+    }
+}
+
+pub type InUseStoreArc = Arc<Mutex<InUseStore>>;
+
+// Memory mapped day file
+struct DayBitmaps {
+    map: Mmap,
+    count: usize,
+}
+
+impl DayBitmaps {
+    fn open(path: &Path) -> Result<Option<Self>> {
+        let file = match File::open(path) {
+            Ok(file) => file,
+            Err(err) if err.kind() == ErrorKind::NotFound => return Ok(None),
+            Err(err) => return Err(err.into()),
+        };
+
+        let len = match NonZeroUsize::new(file.metadata()?.len() as usize) {
+            Some(len) => len,
+            None => return Ok(None),
+        };
+
+        let map = Mmap::new(&file, len)?;
+        let data = map.as_slice();
+
+        if data.len() < DAY_HEADER_SIZE
+            || &data[0..4] != DAY_MAGIC
+            || read_u32(data, 4) != DAY_VERSION
+        {
+            return Err(anyhow!("{}: not a day file", path.display()));
+        }
+
+        let count = read_u32(data, 8) as usize;
+        if data.len() < DAY_HEADER_SIZE + count * DAY_ENTRY_SIZE {
+            return Err(anyhow!("{}: truncated day file", path.display()));
+        }
+
+        let me = Self { map, count };
+
+        // validate once, so that the lookups don't have to
+        let len = len.get();
+        if me
+            .entries()
+            .any(|(_, offset, words)| offset + words * 8 > len)
+        {
+            return Err(anyhow!("{}: truncated day file", path.display()));
+        }
+
+        Ok(Some(me))
+    }
+
+    // (workload, offset, words)
+    fn entries(&self) -> impl Iterator<Item = (u32, usize, usize)> + '_ {
+        let data = self.map.as_slice();
+
+        (0..self.count).map(move |i| {
+            let pos = DAY_HEADER_SIZE + i * DAY_ENTRY_SIZE;
+            (
+                read_u32(data, pos),
+                read_u32(data, pos + 4) as usize,
+                read_u32(data, pos + 8) as usize,
+            )
+        })
+    }
+
+    fn workloads(&self) -> Vec<u32> {
+        self.entries().map(|(workload, _, _)| workload).collect()
+    }
+
+    fn bitmap(&self, workload: u32) -> Option<impl Iterator<Item = u64> + '_> {
+        let (_, offset, words) = self.entries().find(|(w, _, _)| *w == workload)?;
+        let data = &self.map.as_slice()[offset..offset + words * 8];
+
+        Some(
+            data.chunks_exact(8)
+                .map(|word| u64::from_le_bytes(word.try_into().unwrap())),
+        )
+    }
+
+    fn paths(&self, workload: u32) -> Vec<u32> {
+        let mut paths = Vec::new();
+
+        if let Some(bitmap) = self.bitmap(workload) {
+            for (i, mut word) in bitmap.enumerate() {
+                while word != 0 {
+                    let bit = word.trailing_zeros();
+                    paths.push(i as u32 * 64 + bit);
+                    word &= word - 1;
+                }
+            }
+        }
+
+        paths
+    }
+
+    fn merge_into(&self, bitmaps: &mut BTreeMap<u32, Vec<u64>>) {
+        for workload in self.workloads() {
+            let dst = bitmaps.entry(workload).or_default();
+
+            for (i, word) in self.bitmap(workload).into_iter().flatten().enumerate() {
+                if i >= dst.len() {
+                    dst.resize(i + 1, 0);
+                }
+                dst[i] |= word;
+            }
+        }
+    }
+}
+
+fn write_day(path: &Path, bitmaps: &BTreeMap<u32, Vec<u64>>) -> Result<()> {
+    let words: usize = bitmaps.values().map(|b| b.len()).sum();
+    let index_size = DAY_HEADER_SIZE + bitmaps.len() * DAY_ENTRY_SIZE;
+    let mut buf = Vec::with_capacity(index_size + words * 8);
+
+    buf.extend_from_slice(DAY_MAGIC);
+    buf.extend_from_slice(&DAY_VERSION.to_le_bytes());
+    buf.extend_from_slice(&(bitmaps.len() as u32).to_le_bytes());
+
+    let mut offset = index_size;
+    for (workload, bitmap) in bitmaps {
+        buf.extend_from_slice(&workload.to_le_bytes());
+        buf.extend_from_slice(&(offset as u32).to_le_bytes());
+        buf.extend_from_slice(&(bitmap.len() as u32).to_le_bytes());
+        offset += bitmap.len() * 8;
+    }
+
+    for bitmap in bitmaps.values() {
+        for word in bitmap {
+            buf.extend_from_slice(&word.to_le_bytes());
+        }
+    }
+
+    write_atomic(path, &buf)
+}
+
+fn read_log(path: &Path) -> Result<HashSet<Record>> {
+    let data = match std::fs::read(path) {
+        Ok(data) => data,
+        Err(err) if err.kind() == ErrorKind::NotFound => return Ok(HashSet::new()),
+        Err(err) => return Err(err.into()),
+    };
+
+    // a partially written record at the end is ignored
+    Ok(data
+        .chunks_exact(RECORD_SIZE)
+        .map(Record::from_bytes)
+        .collect())
+}
+
+// Puts the files written by rewrite_keys() in place. Without the marker the
+// rewrite didn't complete and the current files are still consistent.
+fn finish_rewrite(dir: &Path) -> Result<()> {
+    let marker = dir.join(REWRITE_MARKER);
+    let complete = marker.exists();
+
+    for dir in [dir.to_path_buf(), dir.join(DAYS_DIR)] {
+        for entry in std::fs::read_dir(&dir)? {
+            let path = entry?.path();
+            let Some(dst) = path
+                .to_str()
+                .and_then(|p| p.strip_suffix(NEW_SUFFIX))
+                .map(PathBuf::from)
+            else {
+                continue;
+            };
+
+            if complete {
+                std::fs::rename(&path, dst)?;
+            } else {
+                std::fs::remove_file(&path)?;
+            }
+        }
+    }
+
+    if complete {
+        std::fs::remove_file(&marker)?;
+    }
+
+    Ok(())
+}
+
+fn new_path(path: &Path) -> PathBuf {
+    let mut new = path.as_os_str().to_owned();
+    new.push(NEW_SUFFIX);
+    PathBuf::from(new)
+}
+
+fn write_atomic(path: &Path, data: &[u8]) -> Result<()> {
+    let mut tmp = path.as_os_str().to_owned();
+    tmp.push(".tmp");
+
+    let mut file = File::create(&tmp)?;
+    file.write_all(data)?;
+    file.sync_data()?;
+    std::fs::rename(&tmp, path)?;
+    Ok(())
+}
+
+fn day_path(dir: &Path, day: u32) -> PathBuf {
+    dir.join(DAYS_DIR).join(format!("{day}.bm"))
+}
+
+fn set_bit(bitmap: &mut Vec<u64>, bit: u32) {
+    let idx = (bit / 64) as usize;
+    if idx >= bitmap.len() {
+        bitmap.resize(idx + 1, 0);
+    }
+    bitmap[idx] |= 1 << (bit % 64);
+}
+
+fn read_u32(buf: &[u8], pos: usize) -> u32 {
+    u32::from_le_bytes(buf[pos..pos + 4].try_into().unwrap())
+}
+
+fn current_bucket() -> u32 {
+    let now = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .unwrap_or_default()
+        .as_secs();
+
+    (now / BUCKET_SECS) as u32
+}
+
+fn today() -> u32 {
+    current_bucket() / BUCKETS_PER_DAY
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    // The days used by the tests are long past
+    const KEEP_ALL: u32 = u32::MAX;
+
+    #[test]
+    fn test_compaction() {
+        let dir = TempDir::new("store");
+        let day = 19000;
+        let bucket = day * BUCKETS_PER_DAY;
+
+        let libc = WorkloadPath::from("/usr/lib/libc.so.6");
+        let sh = WorkloadPath::from("/usr/bin/sh");
+
+        {
+            let mut store = InUseStore::open(&dir, KEEP_ALL).unwrap();
+            store.record_at("w1", &[libc.clone()], bucket).unwrap();
+            store
+                .record_at("w1", &[libc.clone(), sh.clone()], bucket + 25)
+                .unwrap();
+            store.record_at("w2", &[sh.clone()], bucket + 1).unwrap();
+
+            store.compact_before(day + 1).unwrap();
+            assert!(store.recent.len() == 2);
+            assert!(store.stored_days(0).unwrap() == vec![day]);
+        }
+
+        // survives reopening, the compacted day and the log are merged
+        let store = InUseStore::open(&dir, KEEP_ALL).unwrap();
+        let files = store.in_use_since("w1", day).unwrap();
+        assert!(
+            files
+                == vec![
+                    ("/usr/bin/sh".to_string(), day + 1),
+                    ("/usr/lib/libc.so.6".to_string(), day + 1),
+                ]
+        );
+
+        let files = store.in_use_since("w2", day).unwrap();
+        assert!(files == vec![("/usr/bin/sh".to_string(), day)]);
+
+        assert!(store.in_use_since("w2", day + 1).unwrap().is_empty());
+        assert!(store.in_use_since("w3", day).unwrap().is_empty());
+    }
+
+    #[test]
+    fn test_merge_day() {
+        let dir = TempDir::new("store");
+        let day = 19000;
+        let bucket = day * BUCKETS_PER_DAY;
+
+        let mut store = InUseStore::open(&dir, KEEP_ALL).unwrap();
+        store
+            .record_at("w1", &[WorkloadPath::from("/bin/a")], bucket)
+            .unwrap();
+        store.compact_before(day + 1).unwrap();
+
+        // late records for an already compacted day
+        store
+            .record_at("w1", &[WorkloadPath::from("/bin/b")], bucket + 2)
+            .unwrap();
+        store.compacted_day = 0;
+        store.compact_before(day + 1).unwrap();
+
+        let files = store.in_use_since("w1", day).unwrap();
+        assert!(files.len() == 2);
+        assert!(store.recent.is_empty());
+    }
+
+    #[test]
+    fn test_prune() {
+        let dir = TempDir::new("store");
+        let day = 19000;
+        let bucket = day * BUCKETS_PER_DAY;
+
+        let old = WorkloadPath::from("/bin/old");
+        let both = WorkloadPath::from("/bin/both");
+        let new = WorkloadPath::from("/bin/new");
+
+        let mut store = InUseStore::open(&dir, KEEP_ALL).unwrap();
+        store.record_at("gone", &[old.clone()], bucket).unwrap();
+        store
+            .record_at("w1", &[old.clone(), both.clone()], bucket)
+            .unwrap();
+        store
+            .record_at("w1", &[both.clone()], bucket + BUCKETS_PER_DAY)
+            .unwrap();
+        store.compact_before(day + 2).unwrap();
+
+        // not compacted yet
+        store
+            .record_at("w1", &[new.clone()], bucket + 2 * BUCKETS_PER_DAY)
+            .unwrap();
+
+        store.retention_days = 1;
+        store.compacted_day = 0;
+        store.compact_before(day + 2).unwrap();
+
+        assert!(store.stored_days(0).unwrap() == vec![day + 1]);
+        assert!(store.keys.names == vec!["w1", "/bin/both", "/bin/new"]);
+        assert!(!dir.join(REWRITE_MARKER).exists());
+
+        let expected = vec![
+            ("/bin/both".to_string(), day + 1),
+            ("/bin/new".to_string(), day + 2),
+        ];
+        assert!(store.in_use_since("w1", 0).unwrap() == expected);
+        assert!(store.workloads_since(0).unwrap().len() == 1);
+
+        // the renumbered log keeps being appended to
+        store
+            .record_at("w1", &[old.clone()], bucket + 2 * BUCKETS_PER_DAY)
+            .unwrap();
+        drop(store);
+
+        let store = InUseStore::open(&dir, KEEP_ALL).unwrap();
+        let files = store.in_use_since("w1", 0).unwrap();
+        assert!(files.len() == 3);
+        assert!(files.contains(&("/bin/old".to_string(), day + 2)));
+    }
+
+    #[test]
+    fn test_interrupted_rewrite() {
+        let dir = TempDir::new("store");
+
+        let mut store = InUseStore::open(&dir, KEEP_ALL).unwrap();
+        store.record("w1", &[WorkloadPath::from("/bin/a")]).unwrap();
+        drop(store);
+
+        // new files written, the marker not yet
+        std::fs::write(new_path(&dir.join(KEYS_FILE)), b"garbage").unwrap();
+        std::fs::write(new_path(&day_path(&dir, 1)), b"garbage").unwrap();
+
+        let store = InUseStore::open(&dir, KEEP_ALL).unwrap();
+        assert!(store.keys.names == vec!["w1", "/bin/a"]);
+        assert!(!new_path(&dir.join(KEYS_FILE)).exists());
+        assert!(!new_path(&day_path(&dir, 1)).exists());
+    }
+}
@@ -0,0 +1,192 @@
+use std::collections::hash_map::DefaultHasher;
+use std::hash::{Hash, Hasher};
+use std::num::NonZeroUsize;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+use lru::LruCache;
+
+use crate::scoped_path::WorkloadPath;
+
+// Length of the epochs the last-seen times are rounded to
+pub const USAGE_EPOCH: Duration = Duration::from_secs(5 * 60);
+
+// Count-min sketch dimensions, 16KiB of counters per workload
+const SKETCH_WIDTH: usize = 1024;
+const SKETCH_DEPTH: usize = 4;
+
+// Number of files whose last-seen epoch is kept per workload
+const LAST_SEEN_SIZE: NonZeroUsize = unsafe { NonZeroUsize::new_unchecked(4096) };
+
+// Approximate counts in fixed memory. Estimates are never lower than the
+// true count and overestimate by at most 2/width of the total with
+// probability 1 - (1/2)^depth.
+pub struct CountMinSketch {
+    width: usize,
+    depth: usize,
+    counters: Vec<u32>,
+}
+
+impl CountMinSketch {
+    pub fn new(width: usize, depth: usize) -> Self {
+        Self {
+            width,
+            depth,
+            counters: vec![0; width * depth],
+        }
+    }
+
+    pub fn add<T: Hash>(&mut self, key: &T, count: u32) {
+        for row in 0..self.depth {
+            let idx = self.index(row, key);
+            self.counters[idx] = self.counters[idx].saturating_add(count);
+        }
+    }
+
+    pub fn estimate<T: Hash>(&self, key: &T) -> u32 {
+        (0..self.depth)
+            .map(|row| self.counters[self.index(row, key)])
+            .min()
+            .unwrap_or(0)
+    }
+
+    fn index<T: Hash>(&self, row: usize, key: &T) -> usize {
+        // The row acts as the seed of an independent hash function
+        let mut hasher = DefaultHasher::new();
+        row.hash(&mut hasher);
+        key.hash(&mut hasher);
+
+        row * self.width + (hasher.finish() as usize % self.width)
+    }
+}
+
+pub struct FileUsage {
+    pub path: WorkloadPath,
+
+    // Approximate number of opens since the workload started
+    pub count: u32,
+
+    // Start (in seconds since UNIX epoch) of the USAGE_EPOCH the file was last opened in
+    pub last_seen: u64,
+}
+
+struct LastSeen {
+    epoch: u64,
+
+    // Not opened since it was included in a summary
+    summarized: bool,
+}
+
+// Per workload usage frequency and recency of the reported files
+pub struct UsageTracker {
+    opens: CountMinSketch,
+    last_seen: LruCache<WorkloadPath, LastSeen>,
+}
+
+impl UsageTracker {
+    pub fn new() -> Self {
+        Self {
+            opens: CountMinSketch::new(SKETCH_WIDTH, SKETCH_DEPTH),
+            last_seen: LruCache::new(LAST_SEEN_SIZE),
+        }
+    }
+
+    // Weight > 1 makes up for the opens that were sampled out
+    pub fn record(&mut self, path: &WorkloadPath, weight: u32) {
+        self.opens.add(path, weight);
+
+        let seen = LastSeen {
+            epoch: current_epoch(),
+            summarized: false,
+        };
+
+        match self.last_seen.get_mut(path) {
+            Some(last) => *last = seen,
+            None => {
+                self.last_seen.put(path.clone(), seen);
+            }
+        }
+    }
+
+    // Files opened since the previous summary
+    pub fn summary(&mut self) -> Vec<FileUsage> {
+        let mut usage = Vec::new();
+
+        for (path, seen) in self.last_seen.iter_mut() {
+            if !seen.summarized {
+                seen.summarized = true;
+                usage.push(FileUsage {
+                    path: path.clone(),
+                    count: self.opens.estimate(path),
+                    last_seen: seen.epoch,
+                });
+            }
+        }
+
+        usage
+    }
+}
+
+fn current_epoch() -> u64 {
+    let now = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .unwrap_or_default()
+        .as_secs();
+
+    now - now % USAGE_EPOCH.as_secs()
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+
+    #[test]
+    fn test_count_min_sketch() {
+        let mut sketch = CountMinSketch::new(64, 4);
+
+        for i in 0..100u32 {
+            sketch.add(&i, 1);
+        }
+        sketch.add(&"hot", 1000);
+
+        // never underestimates
+        for i in 0..100u32 {
+            assert!(sketch.estimate(&i) >= 1);
+        }
+        assert!(sketch.estimate(&"hot") >= 1000);
+
+        // the error is bounded by the total count
+        assert!(sketch.estimate(&"hot") <= 1100);
+        assert!(sketch.estimate(&"cold") <= 1100);
+    }
+
+    #[test]
+    fn test_usage_summary() {
+        let mut usage = UsageTracker::new();
+        let lib = WorkloadPath::from("/usr/lib/libc.so.6");
+
+        for _ in 0..10 {
+            usage.record(&lib, 1);
+        }
+        usage.record(&WorkloadPath::from("/usr/bin/sh"), 16);
+
+        let mut summary = usage.summary();
+        summary.sort_by_key(|u| u.count);
+
+        assert!(summary.len() == 2);
+        assert!(summary[0].path == lib);
+        assert!(summary[0].count >= 10);
+        assert!(summary[1].count >= 16);
+        assert!(summary[0].last_seen % USAGE_EPOCH.as_secs() == 0);
+
+        // Only what was opened since, even within the same epoch
+        assert!(usage.summary().is_empty());
+
+        usage.record(&lib, 1);
+        let summary = usage.summary();
+        assert!(summary.len() == 1);
+        assert!(summary[0].path == lib);
+        assert!(summary[0].count >= 11);
+    }
+}
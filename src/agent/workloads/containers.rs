@@ -1,27 +1,71 @@
-use std::collections::HashMap;
-use std::path::PathBuf;
+use std::collections::{HashMap, HashSet};
+use std::num::NonZeroUsize;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
 use std::sync::Arc;
+use std::time::{Duration, Instant};
 
 use anyhow::Result;
 use log::*;
 use lru::LruCache;
 
+use crate::alloc_stats::{self, Stage};
+use crate::binary_id::BinaryIdentifierArc;
 use crate::config::Config;
 use crate::containers::ContainerInfo;
-use crate::open_monitor::FileOpenMonitorArc;
+use crate::file_type::FileTypeFilter;
+use crate::flight::Verdict;
+use crate::open_monitor::{FileOpenMonitor, FileOpenMonitorArc, TracingTier};
 use crate::scoped_path::*;
+use crate::usage::{FileUsage, UsageTracker};
 
-use super::PathSet;
+use super::resolve_cache::{self, ResolveCache, ResolveCacheArc};
+use super::{PathSet, Resolved};
+
+// How long a provisional workload waits for the runtime to report its container.
+// Cgroups of containers managed by runtimes we don't track end up here.
+const PROVISIONAL_TTL: Duration = Duration::from_secs(30);
+
+// Number of images whose converged working set is remembered
+const CONVERGED_IMAGES_LRU_SIZE: NonZeroUsize = unsafe { NonZeroUsize::new_unchecked(128) };
+
+// Upper bound on the resolve cache of a replica, sized to the working set it's seeded with
+const RESOLVE_CACHE_SIZE: usize = 4096;
 
 struct ContainerWorkload {
     root: RootFsPath,
+    image_id: Option<String>,
     excludes: PathSet,
+    file_types: Arc<FileTypeFilter>,
     reported: LruCache<WorkloadPath, ()>,
+    // Only for the replicas of a converged image, warmed with its working set
+    resolve_cache: Option<ResolveCacheArc>,
     in_use_batch: Vec<WorkloadPath>,
+
+    // Convergence tracking, only populated if enabled.
+    // Unlike `reported`, not bounded so that a working set bigger
+    // than the LRU does not keep on producing "new" files.
+    seen: Option<HashSet<WorkloadPath>>,
+    last_new: Instant,
+    cgroup_ids: HashSet<u64>,
+    tier: TracingTier,
+
+    // Created from the cgroup before the runtime reported the container,
+    // the rootfs is that of a process in it and there are no excludes.
+    provisional: bool,
+    created: Instant,
+
+    usage: UsageTracker,
 }
 
 impl ContainerWorkload {
-    fn new(root: RootFsPath, excludes: &[PathBuf]) -> Result<Self> {
+    fn new(
+        root: RootFsPath,
+        image_id: Option<String>,
+        excludes: &[PathBuf],
+        file_types: Arc<FileTypeFilter>,
+        track_convergence: bool,
+    ) -> Result<Self> {
         let mut exclude_set = PathSet::new()?;
         for path in excludes {
             let path = WorkloadPath::from(path);
@@ -41,27 +85,89 @@ impl ContainerWorkload {
 
         Ok(Self {
             root,
+            image_id,
             excludes: exclude_set,
+            file_types,
             reported: LruCache::new(super::REPORTED_LRU_SIZE),
+            resolve_cache: None,
             in_use_batch: Vec::new(),
+            seen: track_convergence.then(HashSet::new),
+            last_new: Instant::now(),
+            cgroup_ids: HashSet::new(),
+            tier: TracingTier::Full,
+            provisional: false,
+            created: Instant::now(),
+            usage: UsageTracker::new(),
         })
     }
 
-    fn resolve(&self, path: &WorkloadPath) -> Result<Option<WorkloadPath>> {
-        let rp = path.to_rootfs(&self.root).realpath()?;
+    // Takes over what a provisional workload of the same container collected
+    fn adopt(&mut self, prov: ContainerWorkload) {
+        for path in prov.in_use_batch {
+            if !self.excludes.contains(&path) {
+                self.in_use_batch.push(path);
+            }
+        }
+
+        for (path, _) in prov.reported.iter() {
+            self.reported.put(path.clone(), ());
+        }
+
+        self.seen = prov.seen;
+        self.last_new = prov.last_new;
+        self.cgroup_ids = prov.cgroup_ids;
+        self.tier = prov.tier;
+        self.usage = prov.usage;
+    }
 
-        if !super::is_file(&rp) {
-            debug!("{} is not a file", rp.display());
-            return Ok(None);
+    // Takes over the files the previous run of the container didn't get to report
+    fn carry_over(&mut self, prev: ContainerWorkload) {
+        for path in prev.in_use_batch {
+            if !self.excludes.contains(&path) && !self.check_and_mark_reported(path.clone()) {
+                self.in_use_batch.push(path);
+            }
         }
+    }
+
+    fn resolve(&self, path: &WorkloadPath) -> Result<Resolved> {
+        let _stage = alloc_stats::enter(Stage::Resolve);
+
+        let cached = self
+            .resolve_cache
+            .as_ref()
+            .and_then(|cache| cache.get(path));
 
-        let path = WorkloadPath::from_rootfs(&self.root, &rp)?;
+        let path = match cached {
+            Some(resolved) => resolved,
+            None => {
+                let rp = path.to_rootfs(&self.root).realpath()?;
+
+                let md = match super::file_metadata(&rp) {
+                    Some(md) => md,
+                    None => {
+                        debug!("{} is not a file", rp.display());
+                        return Ok(Resolved::Skipped(Verdict::NotAFile));
+                    }
+                };
+
+                if !self.file_types.is_code(&rp, &md) {
+                    debug!("{} is not a code file", rp.display());
+                    return Ok(Resolved::Skipped(Verdict::NotCode));
+                }
+
+                let resolved = WorkloadPath::from_rootfs(&self.root, &rp)?;
+                if let Some(cache) = &self.resolve_cache {
+                    cache.insert(path.clone(), resolved.clone());
+                }
+                resolved
+            }
+        };
 
         if self.excludes.contains(&path) {
             debug!("{} was excluded", path.display());
-            Ok(None)
+            Ok(Resolved::Skipped(Verdict::Excluded))
         } else {
-            Ok(Some(path))
+            Ok(Resolved::File(path))
         }
     }
 
@@ -72,21 +178,81 @@ impl ContainerWorkload {
 
     // Returns true if the file was already reported
     fn check_and_mark_reported(&mut self, filename: WorkloadPath) -> bool {
+        let _stage = alloc_stats::enter(Stage::Dedup);
+
         self.reported.put(filename, ()).is_some()
     }
 
-    fn file_opened(&mut self, path: &WorkloadPath) {
+    fn file_opened(
+        &mut self,
+        path: &WorkloadPath,
+        cgroup_id: Option<u64>,
+        exec: bool,
+        open_mon: &dyn FileOpenMonitor,
+    ) -> Verdict {
+        // A process in a cgroup we haven't seen yet (e.g. a replica started
+        // in a reduced tier), apply the tier to it as well.
+        if let Some(cgroup_id) = cgroup_id {
+            if self.cgroup_ids.insert(cgroup_id) && self.tier != TracingTier::Full {
+                if let Err(err) = open_mon.set_cgroup_tier(cgroup_id, self.tier) {
+                    error!("Failed to set tracing tier of cgroup {cgroup_id}: {err}");
+                }
+            }
+        }
+
+        // A process starting may well be a change of the working set, whether
+        // the executable is new or not. Converges again over a whole window.
+        if exec {
+            self.last_new = Instant::now();
+
+            if self.tier != TracingTier::Full {
+                debug!(
+                    "Exec of {} in a converged workload, resuming full tracing",
+                    path.display()
+                );
+                self.set_tier(TracingTier::Full, open_mon);
+            }
+        }
+
         match self.resolve(path) {
-            Ok(Some(filepath)) => {
+            Ok(Resolved::File(filepath)) => {
+                // Sampled opens stand for the ones that were dropped
+                let weight = match self.tier {
+                    TracingTier::Sampled(rate) => rate,
+                    _ => 1,
+                };
+                self.usage.record(&filepath, weight);
+
+                let first_seen = match &mut self.seen {
+                    Some(seen) => seen.insert(filepath.clone()),
+                    None => false,
+                };
+
+                if first_seen {
+                    self.last_new = Instant::now();
+
+                    if self.tier != TracingTier::Full {
+                        debug!(
+                            "New file {} in a converged workload, resuming full tracing",
+                            filepath.display()
+                        );
+                        self.set_tier(TracingTier::Full, open_mon);
+                    }
+                }
+
                 // if already reported, no need to do it again
                 if !self.check_and_mark_reported(filepath.clone()) {
                     self.in_use_batch.push(filepath);
+                    Verdict::Reported
+                } else {
+                    Verdict::AlreadyReported
                 }
             }
-            Ok(None) => (),
+            Ok(Resolved::Skipped(verdict)) => verdict,
             Err(err) => {
                 debug!("{}: {err}", path.display());
                 super::resolve_failed(path, err);
+                Verdict::ResolveFailed
             }
         }
     }
@@ -94,33 +260,216 @@ impl ContainerWorkload {
     fn flush_in_use(&mut self) -> Vec<WorkloadPath> {
         self.in_use_batch.split_off(0)
     }
+
+    fn set_tier(&mut self, tier: TracingTier, open_mon: &dyn FileOpenMonitor) {
+        self.tier = tier;
+
+        for cgroup_id in &self.cgroup_ids {
+            if let Err(err) = open_mon.set_cgroup_tier(*cgroup_id, tier) {
+                error!("Failed to set tracing tier of cgroup {cgroup_id}: {err}");
+            }
+        }
+    }
+
+    fn is_converged(&self, window: Duration) -> bool {
+        self.tier == TracingTier::Full
+            && !self.cgroup_ids.is_empty()
+            && self.last_new.elapsed() >= window
+    }
+
+    // Starts off a replica with the working set of an already converged one.
+    // Only as far as the convergence goes: what the replica itself opens is
+    // reported as it's seen (possibly sampled), not what the other one did.
+    fn seed(
+        &mut self,
+        working_set: &[WorkloadPath],
+        tier: TracingTier,
+        open_mon: &dyn FileOpenMonitor,
+    ) {
+        if let Some(seen) = &mut self.seen {
+            seen.extend(working_set.iter().cloned());
+        }
+
+        // The tier is applied to the cgroups as they are discovered
+        self.set_tier(tier, open_mon);
+
+        // The replica is going to open the same files, resolve them in its rootfs
+        if let Some(size) = NonZeroUsize::new(working_set.len().min(RESOLVE_CACHE_SIZE)) {
+            let cache = Arc::new(ResolveCache::new(size));
+            self.resolve_cache = Some(cache.clone());
+
+            resolve_cache::warm(
+                cache,
+                self.root.clone(),
+                self.file_types.clone(),
+                working_set.to_vec(),
+            );
+        }
+    }
+
+    fn working_set(&self) -> Vec<WorkloadPath> {
+        match &self.seen {
+            Some(seen) => seen.iter().cloned().collect(),
+            None => Vec::new(),
+        }
+    }
 }
 
 pub struct ContainerWorkloads {
     config: Arc<Config>,
     workloads: HashMap<String, ContainerWorkload>,
     open_monitor: FileOpenMonitorArc,
+    file_types: Arc<FileTypeFilter>,
+    convergence_window: Option<Duration>,
+    converged_tier: TracingTier,
+
+    // image id -> working set of its converged container
+    converged_images: LruCache<String, Vec<WorkloadPath>>,
+
+    // The unflushed files of the containers stopped since the last flush
+    stopped_batches: Vec<(String, Vec<WorkloadPath>)>,
+
+    binary_ids: Option<BinaryIdentifierArc>,
 }
 
 impl ContainerWorkloads {
-    pub fn new(config: Arc<Config>, open_mon: FileOpenMonitorArc) -> Self {
+    pub fn new(
+        config: Arc<Config>,
+        open_mon: FileOpenMonitorArc,
+        file_types: Arc<FileTypeFilter>,
+        binary_ids: Option<BinaryIdentifierArc>,
+    ) -> Self {
+        let convergence_window = config.convergence_window();
+        // validated on config load
+        let converged_tier = config.converged_tier().unwrap();
+
         Self {
             config,
             workloads: HashMap::new(),
             open_monitor: open_mon,
+            file_types,
+            convergence_window,
+            converged_tier,
+            converged_images: LruCache::new(CONVERGED_IMAGES_LRU_SIZE),
+            stopped_batches: Vec::new(),
+            binary_ids,
         }
     }
 
-    pub fn file_opened(&mut self, id: &str, filename: &WorkloadPath) {
+    // Returns None if there's no workload for the container (yet)
+    pub fn file_opened(
+        &mut self,
+        id: &str,
+        filename: &WorkloadPath,
+        cgroup_id: Option<u64>,
+        exec: bool,
+    ) -> Option<Verdict> {
         trace!("Container match: {id} for {}", filename.display());
 
-        if let Some(workload) = self.workloads.get_mut(id) {
-            workload.file_opened(filename);
-        } else {
-            error!("Container workload missing for id={id}");
+        let workload = self.workloads.get_mut(id)?;
+        Some(workload.file_opened(filename, cgroup_id, exec, self.open_monitor.as_ref()))
+    }
+
+    // Creates a workload for a container that the runtime has not reported yet.
+    // Its rootfs is taken from the process that opened a file in it.
+    // Returns false if the workload could not be created (e.g. the process
+    // has not switched to the container's rootfs yet).
+    pub fn provisional_started(&mut self, id: &str, pid: u32) -> bool {
+        if self.workloads.contains_key(id) {
+            return true;
+        }
+
+        let rootfs = match proc_rootfs(&self.config.host_root(), pid) {
+            Some(rootfs) => rootfs,
+            None => return false,
+        };
+
+        let workload = ContainerWorkload::new(
+            rootfs,
+            None,
+            &[],
+            self.file_types.clone(),
+            self.convergence_window.is_some(),
+        );
+
+        match workload {
+            Ok(mut workload) => {
+                debug!(
+                    "Provisional workload for container {id} at {}",
+                    workload.root.display()
+                );
+
+                workload.provisional = true;
+
+                for path in workload.watchset() {
+                    _ = self.open_monitor.add_path(&path);
+                }
+
+                self.workloads.insert(id.to_string(), workload);
+                true
+            }
+            Err(err) => {
+                error!("Failed to create a provisional container workload: {err}");
+                false
+            }
+        }
+    }
+
+    // Drops the provisional workloads that the runtime never reported
+    // and returns their ids
+    pub fn expire_provisional(&mut self) -> Vec<String> {
+        let expired: Vec<String> = self
+            .workloads
+            .iter()
+            .filter(|(_, w)| w.provisional && w.created.elapsed() >= PROVISIONAL_TTL)
+            .map(|(id, _)| id.clone())
+            .collect();
+
+        for id in &expired {
+            debug!("Container {id} was not reported by a runtime, dropping its workload");
+            self.drop_provisional(id);
+        }
+
+        expired
+    }
+
+    // A cgroup of the container is gone. If the runtime never reported the
+    // container, it won't and the provisional workload is dropped.
+    pub fn cgroup_removed(&mut self, id: &str, cgroup_id: u64) {
+        let workload = match self.workloads.get_mut(id) {
+            Some(w) => w,
+            None => return,
+        };
+
+        if workload.provisional {
+            self.drop_provisional(id);
+        } else if workload.cgroup_ids.remove(&cgroup_id) && workload.tier != TracingTier::Full {
+            // e.g. a process of a long running container in its own cgroup,
+            // don't leave its config behind in the kernel
+            _ = self
+                .open_monitor
+                .set_cgroup_tier(cgroup_id, TracingTier::Full);
+        }
+    }
+
+    fn drop_provisional(&mut self, id: &str) {
+        if self.workloads.get(id).map_or(false, |w| w.provisional) {
+            debug!("Dropping provisional workload for container {id}");
+
+            if let Some(workload) = self.workloads.remove(id) {
+                for path in workload.watchset() {
+                    _ = self.open_monitor.remove_path(&path);
+                }
+            }
         }
     }
 
+    // Number of workloads and of cgroups they track, for leak checks
+    pub fn sizes(&self) -> (usize, usize) {
+        let cgroups = self.workloads.values().map(|w| w.cgroup_ids.len()).sum();
+        (self.workloads.len(), cgroups)
+    }
+
     pub fn container_started(&mut self, id: String, mut info: ContainerInfo) {
         match &info.rootfs {
             Some(rootfs) => {
@@ -128,8 +477,47 @@ impl ContainerWorkloads {
                 let mut excludes = self.config.container_excludes();
                 excludes.append(&mut info.mounts);
 
-                match ContainerWorkload::new(rootfs, &excludes) {
-                    Ok(workload) => {
+                let workload = ContainerWorkload::new(
+                    rootfs,
+                    info.image_id.clone(),
+                    &excludes,
+                    self.file_types.clone(),
+                    self.convergence_window.is_some(),
+                );
+
+                match workload {
+                    Ok(mut workload) => {
+                        match self.workloads.remove(&id) {
+                            Some(prov) if prov.provisional => {
+                                debug!("Enriching provisional workload of container {id}");
+                                workload.adopt(prov);
+                            }
+                            // Restarted, the cgroups of the previous run are gone
+                            Some(mut prev) => {
+                                for path in prev.watchset() {
+                                    _ = self.open_monitor.remove_path(&path);
+                                }
+
+                                prev.set_tier(TracingTier::Full, self.open_monitor.as_ref());
+                                workload.carry_over(prev);
+                            }
+                            None => (),
+                        }
+
+                        let converged = info
+                            .image_id
+                            .as_ref()
+                            .and_then(|image_id| self.converged_images.get(image_id));
+
+                        if let Some(working_set) = converged {
+                            debug!("Container {id} is a replica of a converged image, starting with reduced tracing");
+                            workload.seed(
+                                working_set,
+                                self.converged_tier,
+                                self.open_monitor.as_ref(),
+                            );
+                        }
+
                         for path in workload.watchset() {
                             _ = self.open_monitor.add_path(&path);
                         }
@@ -146,20 +534,110 @@ impl ContainerWorkloads {
     pub fn container_stopped(&mut self, id: String, _info: ContainerInfo) {
         let workload = self.workloads.remove(&id);
 
-        if let Some(workload) = workload {
+        if let Some(mut workload) = workload {
             for path in workload.watchset() {
                 _ = self.open_monitor.remove_path(&path);
             }
+
+            // Drop the cgroup configs from the kernel
+            if workload.tier != TracingTier::Full {
+                workload.set_tier(TracingTier::Full, self.open_monitor.as_ref());
+            }
+
+            // Reported with the next flush, a provisional workload was never registered
+            if !workload.provisional && !workload.in_use_batch.is_empty() {
+                self.stopped_batches.push((id, workload.flush_in_use()));
+            }
         }
     }
 
-    pub fn flush_in_use(&mut self) -> Vec<(String, Vec<WorkloadPath>)> {
-        let mut in_use = Vec::new();
+    pub fn usage_summaries(&mut self) -> Vec<(String, Vec<FileUsage>)> {
+        self.workloads
+            .iter_mut()
+            .filter(|(_, w)| !w.provisional)
+            .map(|(id, w)| (id.clone(), w.usage.summary()))
+            .collect()
+    }
+
+    // Moves the workloads that haven't opened a new file within the convergence
+    // window to the reduced tracing tier
+    pub fn update_tiers(&mut self) {
+        let window = match self.convergence_window {
+            Some(window) => window,
+            None => return,
+        };
 
         for (id, w) in self.workloads.iter_mut() {
-            in_use.push((id.clone(), w.flush_in_use()))
+            if !w.is_converged(window) {
+                continue;
+            }
+
+            info!(
+                "Container {id} converged ({} files), tracing {:?}",
+                w.working_set().len(),
+                self.converged_tier
+            );
+
+            w.set_tier(self.converged_tier, self.open_monitor.as_ref());
+
+            if let Some(image_id) = &w.image_id {
+                self.converged_images.put(image_id.clone(), w.working_set());
+            }
+        }
+    }
+
+    pub fn flush_in_use(&mut self) -> Vec<(String, Vec<WorkloadPath>)> {
+        let _stage = alloc_stats::enter(Stage::Batching);
+
+        // Their rootfs is gone, too late to identify the binaries
+        let mut in_use = std::mem::take(&mut self.stopped_batches);
+
+        // Provisional workloads hold on to their files until the
+        // container gets reported (and registered) by the runtime
+        for (id, w) in self.workloads.iter_mut().filter(|(_, w)| !w.provisional) {
+            let batch = w.flush_in_use();
+
+            // The agent has no SBOMs of the container images, all binaries are identified
+            if let Some(binary_ids) = &self.binary_ids {
+                for path in &batch {
+                    binary_ids.submit(id, &w.root, path);
+                }
+            }
+
+            in_use.push((id.clone(), batch))
         }
 
         in_use
     }
 }
+
+// The rootfs of a containerized process, as seen by the agent.
+// Returns None if the process is not (yet) in a separate rootfs.
+fn proc_rootfs(host_root: &Path, pid: u32) -> Option<RootFsPath> {
+    let proc_root = host_root.join(format!("proc/{pid}/root"));
+    let proc_root = if proc_root.exists() {
+        proc_root
+    } else {
+        PathBuf::from(format!("/proc/{pid}/root"))
+    };
+
+    // Follows the magic link, unlike readlink
+    let md = std::fs::metadata(&proc_root).ok()?;
+    let same_file = |path: &Path| {
+        std::fs::metadata(path).map_or(false, |m| m.dev() == md.dev() && m.ino() == md.ino())
+    };
+
+    if same_file(host_root) {
+        return None;
+    }
+
+    // The workload root has to be a real path for realpath() to work in it,
+    // find where the process root is reachable from here.
+    let link = std::fs::read_link(&proc_root).ok()?;
+    let candidates = [
+        HostPath::from(&link).to_rootfs(&RootFsPath::from(host_root)),
+        RootFsPath::from(link),
+    ];
+
+    candidates.into_iter().find(|path| same_file(path.as_raw()))
+}
@@ -1,5 +1,5 @@
 use std::borrow::Cow;
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::num::NonZeroUsize;
 use std::path::PathBuf;
 use std::sync::Arc;
@@ -9,11 +9,17 @@ use log::*;
 use lru::LruCache;
 use uuid::Uuid;
 
+use crate::alloc_stats::{self, Stage};
+use crate::binary_id::BinaryIdentifierArc;
 use crate::config::Config;
+use crate::file_type::FileTypeFilter;
+use crate::flight::Verdict;
 use crate::open_monitor::FileOpenMonitorArc;
 use crate::scoped_path::*;
+use crate::usage::{FileUsage, UsageTracker};
 
-use super::PathSet;
+use super::resolve_cache::{self, ResolveCache, ResolveCacheArc};
+use super::{PathSet, Resolved};
 
 const BASEOS_ID_PATH: &str = "/var/lib/edgebit/baseos-id";
 
@@ -21,6 +27,8 @@ const OS_RELEASE_PATHS: [&str; 2] = ["etc/os-release", "usr/lib/os-release"];
 
 const REPORTED_LRU_SIZE: NonZeroUsize = unsafe { NonZeroUsize::new_unchecked(256) };
 
+const RESOLVE_CACHE_SIZE: NonZeroUsize = unsafe { NonZeroUsize::new_unchecked(16 * 1024) };
+
 pub struct HostWorkload {
     pub id: String,
     pub labels: HashMap<String, String>,
@@ -29,8 +37,15 @@ pub struct HostWorkload {
     pub image_id: String,
     host_root: RootFsPath,
     includes: PathSet,
+    file_types: Arc<FileTypeFilter>,
     reported: LruCache<WorkloadPath, ()>,
+    resolve_cache: ResolveCacheArc,
     in_use_batch: Vec<WorkloadPath>,
+    binary_ids: Option<BinaryIdentifierArc>,
+
+    // Files owned by the packages in the host SBOM, these need no identification
+    sbom_files: HashSet<WorkloadPath>,
+    usage: UsageTracker,
 }
 
 impl HostWorkload {
@@ -38,7 +53,10 @@ impl HostWorkload {
         image_id: String,
         config: Arc<Config>,
         open_mon: FileOpenMonitorArc,
+        file_types: Arc<FileTypeFilter>,
         labels: HashMap<String, String>,
+        binary_ids: Option<BinaryIdentifierArc>,
+        sbom_files: HashSet<WorkloadPath>,
     ) -> Result<Self> {
         let host_root = RootFsPath::from(config.host_root());
         let id = load_baseos_id();
@@ -77,6 +95,16 @@ impl HostWorkload {
             };
         }
 
+        // The package files are what the host opens the most,
+        // have them resolved before the first opens come in
+        let resolve_cache = Arc::new(ResolveCache::new(RESOLVE_CACHE_SIZE));
+        resolve_cache::warm(
+            resolve_cache.clone(),
+            host_root.clone(),
+            file_types.clone(),
+            sbom_files.iter().cloned().collect(),
+        );
+
         Ok(Self {
             id,
             labels,
@@ -85,47 +113,90 @@ impl HostWorkload {
             image_id,
             host_root,
             includes,
+            file_types,
             reported: LruCache::new(REPORTED_LRU_SIZE),
+            resolve_cache,
             in_use_batch: Vec::new(),
+            binary_ids,
+            sbom_files,
+            usage: UsageTracker::new(),
         })
     }
 
-    pub fn file_opened(&mut self, filename: &WorkloadPath) {
+    pub fn file_opened(&mut self, filename: &WorkloadPath) -> Verdict {
         match self.resolve(filename) {
-            Ok(Some(filepath)) => {
+            Ok(Resolved::File(filepath)) => {
+                self.usage.record(&filepath, 1);
+
                 // if already reported, no need to do it again
                 if !self.check_and_mark_reported(filepath.clone()) {
                     self.in_use_batch.push(filepath.clone());
+                    Verdict::Reported
+                } else {
+                    Verdict::AlreadyReported
                 }
             }
-            Ok(None) => (),
-            Err(err) => super::resolve_failed(filename, err),
+            Ok(Resolved::Skipped(verdict)) => verdict,
+            Err(err) => {
+                super::resolve_failed(filename, err);
+                Verdict::ResolveFailed
+            }
         }
     }
 
     pub fn flush_in_use(&mut self) -> (String, Vec<WorkloadPath>) {
-        (self.id.clone(), self.in_use_batch.split_off(0))
+        let _stage = alloc_stats::enter(Stage::Batching);
+
+        let batch = self.in_use_batch.split_off(0);
+
+        if let Some(binary_ids) = &self.binary_ids {
+            for path in batch.iter().filter(|p| !self.sbom_files.contains(p)) {
+                binary_ids.submit(&self.id, &self.host_root, path);
+            }
+        }
+
+        (self.id.clone(), batch)
+    }
+
+    pub fn usage_summary(&mut self) -> (String, Vec<FileUsage>) {
+        (self.id.clone(), self.usage.summary())
     }
 
     // Checks if the path is not filtered out and returns canonicalized verison
-    fn resolve(&self, path: &WorkloadPath) -> Result<Option<WorkloadPath>> {
-        let rp = path.to_rootfs(&self.host_root).realpath()?;
+    fn resolve(&self, path: &WorkloadPath) -> Result<Resolved> {
+        let _stage = alloc_stats::enter(Stage::Resolve);
 
-        if !super::is_file(&rp) {
-            return Ok(None);
-        }
+        let path = match self.resolve_cache.get(path) {
+            Some(resolved) => resolved,
+            None => {
+                let rp = path.to_rootfs(&self.host_root).realpath()?;
+
+                let md = match super::file_metadata(&rp) {
+                    Some(md) => md,
+                    None => return Ok(Resolved::Skipped(Verdict::NotAFile)),
+                };
 
-        let path = WorkloadPath::from_rootfs(&self.host_root, &rp)?;
+                if !self.file_types.is_code(&rp, &md) {
+                    return Ok(Resolved::Skipped(Verdict::NotCode));
+                }
+
+                let resolved = WorkloadPath::from_rootfs(&self.host_root, &rp)?;
+                self.resolve_cache.insert(path.clone(), resolved.clone());
+                resolved
+            }
+        };
 
         if self.includes.contains(&path) {
-            Ok(Some(path))
+            Ok(Resolved::File(path))
         } else {
-            Ok(None)
+            Ok(Resolved::Skipped(Verdict::Excluded))
         }
     }
 
     // Returns true if the file was already reported
     fn check_and_mark_reported(&mut self, filename: WorkloadPath) -> bool {
+        let _stage = alloc_stats::enter(Stage::Dedup);
+
         self.reported.put(filename, ()).is_some()
     }
 }
@@ -1,4 +1,4 @@
-use std::collections::VecDeque;
+use std::collections::{HashMap, VecDeque};
 use std::sync::{Arc, Mutex};
 use std::time::{Duration, Instant};
 
@@ -6,11 +6,25 @@ use log::*;
 use tokio::sync::mpsc::Receiver;
 
 use super::Workloads;
-use crate::containers::Containers;
-use crate::open_monitor::OpenEvent;
+use crate::alloc_stats::{self, Stage};
+use crate::containers::{container_id_from_cgroup, Containers};
+use crate::flight::{self, Verdict};
+use crate::open_monitor::{CgroupEvent, OpenEvent};
+use crate::sinks::EventBatch;
 
+// How long the events that can't be attributed to a workload yet are held
+// back, waiting for the runtime to report the container
 const OPEN_EVENT_LAG: Duration = Duration::from_millis(500);
 
+// Beyond this many held back events (e.g. a burst from an unknown runtime),
+// the events are attributed right away rather than growing the queue
+const MAX_QUEUED_EVENTS: usize = 64 * 1024;
+
+// How long a cgroup waits for its container to be reported. Past that,
+// it's not a container of a tracked runtime (see PROVISIONAL_TTL) and
+// forgetting it guards against a lost cgroup removal event.
+const PENDING_TTL: Duration = Duration::from_secs(60);
+
 struct OpenEventQueueItem {
     timestamp: Instant,
     evt: OpenEvent,
@@ -19,10 +33,14 @@ struct OpenEventQueueItem {
 pub async fn track_pkgs_in_use(
     containers: Arc<Containers>,
     workloads: Workloads,
-    mut rx: Receiver<OpenEvent>,
+    mut rx: Receiver<EventBatch>,
+    mut cgroup_rx: Receiver<CgroupEvent>,
 ) {
     let mut open_event_q = Mutex::new(VecDeque::<OpenEventQueueItem>::new());
 
+    // Containers whose cgroup got created but that were not reported by the runtime yet
+    let mut pending = HashMap::<String, Instant>::new();
+
     let mut periods = tokio::time::interval(Duration::from_millis(100));
 
     loop {
@@ -33,35 +51,114 @@ pub async fn track_pkgs_in_use(
                     .unwrap();
 
                 while let Some(evt) = pop_open_event(&mut open_event_q, cutoff) {
-                    let cgroup = evt.cgroup_name.unwrap_or(String::new());
-                    trace!("[{cgroup}]: {}", evt.filename.display());
-
-                    if let Some(id) = containers.id_from_cgroup(&cgroup) {
-                        workloads.containers.lock()
-                            .unwrap()
-                            .file_opened(&id, &evt.filename)
-                    } else {
-                        workloads.host.lock()
-                            .unwrap()
-                            .file_opened(&evt.filename)
-                    }
+                    attribute(&containers, &workloads, &pending, &evt, true);
+                }
+
+                // Give back the memory of a burst
+                let q = open_event_q.get_mut().unwrap();
+                if q.capacity() > 4096 && q.len() < q.capacity() / 4 {
+                    q.shrink_to(q.len() * 2);
+                }
+
+                pending.retain(|_, created| created.elapsed() < PENDING_TTL);
+
+                let expired = workloads.containers.lock()
+                    .unwrap()
+                    .expire_provisional();
+
+                for id in expired {
+                    pending.remove(&id);
                 }
             },
-            evt = rx.recv() => {
-                match evt {
-                    Some(evt) => {
-                        open_event_q.lock()
-                            .unwrap()
-                            .push_back(OpenEventQueueItem{
-                                    timestamp: Instant::now(),
-                                    evt,
-                                });
+            batch = rx.recv() => {
+                match batch {
+                    Some(batch) => {
+                        for evt in batch.iter() {
+                            // Only the (rare) events that have to wait get copied out of the batch
+                            if !attribute(&containers, &workloads, &pending, evt, false) {
+                                let q = open_event_q.get_mut().unwrap();
+                                if q.len() < MAX_QUEUED_EVENTS {
+                                    q.push_back(OpenEventQueueItem{
+                                            timestamp: Instant::now(),
+                                            evt: evt.clone(),
+                                        });
+                                } else {
+                                    attribute(&containers, &workloads, &pending, evt, true);
+                                }
+                            }
+                        }
                     },
                     None => break,
                 }
+            },
+            Some(evt) = cgroup_rx.recv() => {
+                match evt {
+                    CgroupEvent::Created(_, path) => {
+                        if let Some(id) = container_id_from_cgroup(&path) {
+                            if containers.id_from_cgroup(&path).is_none() {
+                                trace!("New container cgroup {path}");
+                                pending.insert(id, Instant::now());
+                            }
+                        }
+                    },
+                    CgroupEvent::Removed(cgroup_id, path) => {
+                        if let Some(id) = container_id_from_cgroup(&path) {
+                            pending.remove(&id);
+                            workloads.containers.lock()
+                                .unwrap()
+                                .cgroup_removed(&id, cgroup_id);
+                        }
+                    },
+                }
+            }
+        }
+    }
+}
+
+// Returns false if the event can't be attributed to a workload yet.
+// The last chance attempt falls back to the host workload.
+fn attribute(
+    containers: &Containers,
+    workloads: &Workloads,
+    pending: &HashMap<String, Instant>,
+    evt: &OpenEvent,
+    last_chance: bool,
+) -> bool {
+    let _stage = alloc_stats::enter(Stage::Attribution);
+
+    let cgroup = evt.cgroup_name.as_deref().unwrap_or("");
+    trace!("[{cgroup}]: {}", evt.filename.display());
+
+    if let Some(id) = container_id_from_cgroup(cgroup) {
+        let known = containers.id_from_cgroup(cgroup).is_some();
+        let mut cont_workloads = workloads.containers.lock().unwrap();
+
+        // A container the runtime hasn't told us about yet gets a provisional
+        // workload so that its startup opens aren't held back or misattributed
+        if known || (pending.contains_key(&id) && cont_workloads.provisional_started(&id, evt.pid))
+        {
+            if let Some(verdict) =
+                cont_workloads.file_opened(&id, &evt.filename, evt.cgroup_id, evt.exec)
+            {
+                flight::record(verdict, evt.pid, &id, evt.filename.as_raw());
+                return true;
             }
         }
+
+        if !last_chance {
+            return false;
+        }
+
+        if known {
+            error!("Container workload missing for id={id}");
+            flight::record(Verdict::NoWorkload, evt.pid, &id, evt.filename.as_raw());
+            return true;
+        }
     }
+
+    let verdict = workloads.host.lock().unwrap().file_opened(&evt.filename);
+    flight::record(verdict, evt.pid, "host", evt.filename.as_raw());
+    true
 }
 
 fn pop_open_event(
@@ -1,6 +1,7 @@
 pub mod containers;
 pub mod host;
 pub mod in_use;
+mod resolve_cache;
 
 use std::collections::HashMap;
 use std::num::NonZeroUsize;
@@ -10,8 +11,11 @@ use anyhow::Result;
 use log::*;
 use tokio::sync::mpsc::{Receiver, Sender};
 
+use crate::binary_id::BinaryIdentifierArc;
 use crate::config::Config;
 use crate::containers::{ContainerEvent, ContainerInfo};
+use crate::file_type::FileTypeFilter;
+use crate::flight::Verdict;
 use crate::open_monitor::FileOpenMonitorArc;
 use crate::scoped_path::*;
 
@@ -33,14 +37,28 @@ pub struct Workloads {
 }
 
 impl Workloads {
-    pub fn new(config: Arc<Config>, host: HostWorkload, open_mon: FileOpenMonitorArc) -> Self {
+    pub fn new(
+        config: Arc<Config>,
+        host: HostWorkload,
+        open_mon: FileOpenMonitorArc,
+        file_types: Arc<FileTypeFilter>,
+        binary_ids: Option<BinaryIdentifierArc>,
+    ) -> Self {
         Self {
             host: Arc::new(Mutex::new(host)),
-            containers: Arc::new(Mutex::new(ContainerWorkloads::new(config, open_mon))),
+            containers: Arc::new(Mutex::new(ContainerWorkloads::new(
+                config, open_mon, file_types, binary_ids,
+            ))),
         }
     }
 }
 
+// Outcome of resolving an opened file in a workload
+enum Resolved {
+    File(WorkloadPath),
+    Skipped(Verdict),
+}
+
 struct PathSet {
     members: HashMap<WorkloadPath, ()>,
 }
@@ -87,10 +105,10 @@ pub(crate) fn is_not_found(err: &anyhow::Error) -> bool {
 }
 
 #[inline]
-fn is_file(path: &RootFsPath) -> bool {
+fn file_metadata(path: &RootFsPath) -> Option<std::fs::Metadata> {
     match std::fs::metadata(path.as_raw()) {
-        Ok(md) => md.is_file(),
-        Err(_) => false,
+        Ok(md) if md.is_file() => Some(md),
+        _ => None,
     }
 }
 
@@ -0,0 +1,170 @@
+use std::num::NonZeroUsize;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+use log::*;
+use lru::LruCache;
+
+use crate::file_type::FileTypeFilter;
+use crate::scoped_path::*;
+
+// Resolutions are redone after a while to pick up replaced files and symlinks
+const RESOLVE_CACHE_TTL: Duration = Duration::from_secs(600);
+
+struct Entry {
+    resolved: WorkloadPath,
+    added: Instant,
+}
+
+// Opened path -> canonical path of a code file, saving the realpath, stat
+// and file type check of the files a workload keeps on opening. Only positive
+// results are kept, the includes and excludes are applied on top of them.
+pub struct ResolveCache {
+    entries: Mutex<LruCache<WorkloadPath, Entry>>,
+}
+
+pub type ResolveCacheArc = Arc<ResolveCache>;
+
+impl ResolveCache {
+    pub fn new(size: NonZeroUsize) -> Self {
+        Self {
+            entries: Mutex::new(LruCache::new(size)),
+        }
+    }
+
+    pub fn get(&self, path: &WorkloadPath) -> Option<WorkloadPath> {
+        let mut entries = self.entries.lock().unwrap();
+
+        match entries.get(path) {
+            Some(entry) if entry.added.elapsed() < RESOLVE_CACHE_TTL => {
+                Some(entry.resolved.clone())
+            }
+            Some(_) => {
+                entries.pop(path);
+                None
+            }
+            None => None,
+        }
+    }
+
+    pub fn insert(&self, path: WorkloadPath, resolved: WorkloadPath) {
+        let entry = Entry {
+            resolved,
+            added: Instant::now(),
+        };
+
+        self.entries.lock().unwrap().put(path, entry);
+    }
+
+    fn is_full(&self) -> bool {
+        let entries = self.entries.lock().unwrap();
+        entries.len() >= entries.cap().get()
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.lock().unwrap().len()
+    }
+}
+
+// Resolves the paths a workload is expected to open (the files of the host
+// SBOM, the working set of a converged image) ahead of time, on a low
+// priority thread. Stops once the cache is full rather than evicting.
+pub fn warm(
+    cache: ResolveCacheArc,
+    root: RootFsPath,
+    file_types: Arc<FileTypeFilter>,
+    paths: Vec<WorkloadPath>,
+) {
+    let res = std::thread::Builder::new()
+        .name("resolve-warm".to_string())
+        .spawn(move || {
+            crate::binary_id::lower_priority("resolve-warm thread");
+
+            let start = Instant::now();
+            warm_paths(&cache, &root, &file_types, paths);
+            debug!(
+                "Warmed up the resolve cache with {} paths in {:?}",
+                cache.len(),
+                start.elapsed()
+            );
+        });
+
+    if let Err(err) = res {
+        error!("Failed to start resolve-warm thread: {err}");
+    }
+}
+
+fn warm_paths(
+    cache: &ResolveCache,
+    root: &RootFsPath,
+    file_types: &FileTypeFilter,
+    paths: Vec<WorkloadPath>,
+) {
+    for path in paths {
+        if cache.is_full() {
+            break;
+        }
+
+        let rp = match path.to_rootfs(root).realpath() {
+            Ok(rp) => rp,
+            Err(_) => continue,
+        };
+
+        let is_code = match super::file_metadata(&rp) {
+            Some(md) => file_types.is_code(&rp, &md),
+            None => false,
+        };
+
+        if !is_code {
+            continue;
+        }
+
+        if let Ok(resolved) = WorkloadPath::from_rootfs(root, &rp) {
+            if resolved != path {
+                cache.insert(resolved.clone(), resolved.clone());
+            }
+            cache.insert(path, resolved);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use assert2::assert;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    #[test]
+    fn test_warm_paths() {
+        let dir = TempDir::new("warm");
+        std::fs::create_dir_all(dir.join("usr/lib")).unwrap();
+        std::fs::write(dir.join("usr/lib/libfoo.so.1"), b"").unwrap();
+        std::fs::write(dir.join("usr/lib/notes.txt"), b"").unwrap();
+        std::os::unix::fs::symlink("usr/lib", dir.join("lib")).unwrap();
+
+        let root = RootFsPath::from(dir.path());
+        let cache = ResolveCache::new(NonZeroUsize::new(16).unwrap());
+        let file_types = FileTypeFilter::new(&[".so"]);
+
+        let paths = vec![
+            WorkloadPath::from("/lib/libfoo.so.1"),
+            WorkloadPath::from("/usr/lib/notes.txt"),
+            WorkloadPath::from("/usr/lib/missing.so"),
+        ];
+        warm_paths(&cache, &root, &file_types, paths);
+
+        let resolved = WorkloadPath::from("/usr/lib/libfoo.so.1");
+        assert!(cache.len() == 2);
+        assert!(cache.get(&WorkloadPath::from("/lib/libfoo.so.1")) == Some(resolved.clone()));
+        assert!(cache.get(&resolved) == Some(resolved.clone()));
+        assert!(cache
+            .get(&WorkloadPath::from("/usr/lib/notes.txt"))
+            .is_none());
+
+        // Full, nothing is evicted
+        let small = ResolveCache::new(NonZeroUsize::new(1).unwrap());
+        warm_paths(&small, &root, &file_types, vec![resolved.clone(), resolved]);
+        assert!(small.len() == 1);
+    }
+}
@@ -9,6 +9,14 @@
         __type(value, val_type); \
     } name SEC(".maps")
 
+#define BPF_PERCPU_ARRAY(name, val_type, size) \
+    struct { \
+        __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY); \
+        __uint(max_entries, size); \
+        __type(key, u32); \
+        __type(value, val_type); \
+    } name SEC(".maps")
+
 #define BPF_HASH(name, key_type, val_type, size) \
     struct { \
         __uint(type, BPF_MAP_TYPE_HASH); \
@@ -23,6 +31,13 @@
         __uint(max_entries, size); \
     } name SEC(".maps")
 
+// BPF_MAP_TYPE_USER_RINGBUF (31) is newer than the vmlinux headers
+#define BPF_USER_RING_BUF(name, size) \
+    struct { \
+        __uint(type, 31); \
+        __uint(max_entries, size); \
+    } name SEC(".maps")
+
 #define BPF_PERF_EVENT_ARRAY(name) \
     struct { \
         __uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY); \
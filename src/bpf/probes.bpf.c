@@ -18,6 +18,29 @@ char LICENSE[] SEC("license") = "Dual BSD/GPL";
 #define NAME_MAX 256
 #define INFLIGHT_MAX 64
 #define EVT_OPEN 1
+#define TASK_COMM_LEN 16
+
+// Filter bits. FILTER_COMM..FILTER_SUFFIX are fixed at load time (static_filters),
+// FILTER_CGROUP_TIERS is set in probe_config.filters once a workload converges.
+#define FILTER_COMM (1 << 0)
+#define FILTER_EXE  (1 << 1)
+#define FILTER_UID  (1 << 2)
+#define FILTER_SUFFIX (1 << 3)
+#define FILTER_CGROUP_TIERS (1 << 4)
+
+// Longest file suffix (incl. the NUL) that can be matched by the suffix filter
+#define SUFFIX_MAX 8
+// How far back from the end of the filename the suffix is searched for
+#define SUFFIX_SCAN 32
+
+// Tracing tiers of cgroups with a stable working set (cgroup_config.tier)
+#define TIER_FULL 0
+#define TIER_SAMPLED 1
+#define TIER_EXEC_ONLY 2
+
+#define SUFFIX_NONE 0
+#define SUFFIX_MATCH 1
+#define SUFFIX_OTHER 2
 
 #define S_IFMT  00170000
 #define S_IFSOCK 0140000
@@ -30,6 +53,7 @@ char LICENSE[] SEC("license") = "Dual BSD/GPL";
 #define S_ISUID  0004000
 #define S_ISGID  0002000
 #define S_ISVTX  0001000
+#define S_IXUSR  00100
 
 #define S_ISLNK(m)  (((m) & S_IFMT) == S_IFLNK)
 #define S_ISREG(m)  (((m) & S_IFMT) == S_IFREG)
@@ -81,16 +105,72 @@ struct open_inflight_entry {
     u32 flags;
 };
 
+// evt_open.flags
+#define EVT_OPEN_EXEC 1
+
 struct evt_open {
     u32 tgid;
+    u32 flags;
     char filename[MAX_PATH];
 };
 
+// evt_cgroup.kind
+#define CGROUP_MKDIR 1
+#define CGROUP_RMDIR 2
+
+struct evt_cgroup {
+    u64 id;
+    u32 kind;
+    char path[MAX_PATH];
+};
+
 struct process_info {
+    u64 cgroup_id;
     bool zombie;
+    bool ignored;
     char cgroup[255];
 };
 
+struct cgroup_config {
+    u32 tier;
+    // 1 in sample_rate opens is reported in TIER_SAMPLED
+    u32 sample_rate;
+};
+
+struct probe_config {
+    u32 filters;
+};
+
+// ctl_cmd.kind
+#define CTL_REMOVE_PID 1
+#define CTL_SET_CGROUP_CONFIG 2
+#define CTL_DELETE_CGROUP_CONFIG 3
+#define CTL_SET_FILTERS 4
+
+// Map update queued by the userspace, applied by drain_control
+struct ctl_cmd {
+    u32 kind;
+    u32 pid;
+    u64 cgroup_id;
+    struct cgroup_config cfg;
+    u32 filters;
+    u32 pad;
+};
+
+struct comm_key {
+    char comm[TASK_COMM_LEN];
+};
+
+struct exe_key {
+    u64 ino;
+    u32 dev;
+    u32 pad;
+};
+
+struct suffix_key {
+    char suffix[SUFFIX_MAX];
+};
+
 // Keeps track of parameters passed into variants of open() syscalls
 // to be used at the end of the syscall (exit hook)
 BPF_HASH(open_inflight, pid_t, struct open_inflight_entry, 1024);
@@ -99,6 +179,39 @@ BPF_HASH(open_inflight, pid_t, struct open_inflight_entry, 1024);
 // the PID to cgroup
 BPF_HASH(pid_to_info, pid_t, struct process_info, 1024);
 
+// Runtime configuration (FILTER_CGROUP_TIERS), updated by the userspace after the load
+BPF_ARRAY(probe_config, struct probe_config, 1);
+
+// Set by the userspace before the load. Since .rodata is frozen, the verifier
+// knows their values and removes the code of the disabled features.
+const volatile bool use_ringbuf = false;
+const volatile u32 static_filters = 0;
+
+// Sends to the ring buffer or to the perf buffer, whichever is in use
+#define OUTPUT_EVENT(ctx, name, data, size)                                      \
+    (use_ringbuf ? bpf_ringbuf_output(&rb_##name, data, size, 0)                 \
+                 : bpf_perf_event_output(ctx, &pb_##name, BPF_F_CURRENT_CPU, data, size))
+
+// Identities of processes (e.g. updatedb, backup agents) whose opens are dropped
+// before anything gets copied out of the kernel
+BPF_HASH(ignored_comms, struct comm_key, u8, 64);
+BPF_HASH(ignored_exes, struct exe_key, u8, 64);
+BPF_HASH(ignored_uids, u32, u8, 64);
+
+// Suffixes of files that can carry code (e.g. so, py, jar). Only consulted when
+// FILTER_SUFFIX is set, other files are dropped unless executable.
+BPF_HASH(code_suffixes, struct suffix_key, u8, 256);
+
+// Per cgroup (by id) tracing configuration, populated by the userspace for the
+// workloads that converged. Missing entry means TIER_FULL.
+BPF_HASH(cgroup_config, u64, struct cgroup_config, 4096);
+
+// Control commands (struct ctl_cmd) from the userspace, only created on 6.1+
+BPF_USER_RING_BUF(control_commands, 64*1024);
+
+// Scratch space for building evt_open, too big to be scanned on the stack
+BPF_PERCPU_ARRAY(open_evt_scratch, struct evt_open, 1);
+
 // Open file events (either ring buffer or perf event array will be used, depending on kernel version)
 BPF_RING_BUF(rb_open_events, 256*1024);
 BPF_PERF_EVENT_ARRAY(pb_open_events);
@@ -107,15 +220,27 @@ BPF_PERF_EVENT_ARRAY(pb_open_events);
 BPF_RING_BUF(rb_zombie_events, 4*1024);
 BPF_PERF_EVENT_ARRAY(pb_zombie_events);
 
+// Cgroup creation/removal events (either ring buffer or perf event array will be used, depending on kernel version)
+BPF_RING_BUF(rb_cgroup_events, 16*1024);
+BPF_PERF_EVENT_ARRAY(pb_cgroup_events);
+
 static inline bool is_abs(const char *filename) {
     return filename && *filename == '/';
 }
 
-static int fill_cgroup_name(char *buf, size_t buf_len) {
+static struct kernfs_node* current_cgroup_kn(void) {
     struct task_struct *current = (struct task_struct*) bpf_get_current_task();
     struct cgroup_subsys_state **subsys_arr = BPF_CORE_READ(current, cgroups, subsys);
     struct cgroup_subsys_state *subsys = subsys_arr[0];
-    const char *name = BPF_CORE_READ(subsys, cgroup, kn, name);
+    return BPF_CORE_READ(subsys, cgroup, kn);
+}
+
+static u64 current_cgroup_id(void) {
+    return BPF_CORE_READ(current_cgroup_kn(), id);
+}
+
+static int fill_cgroup_name(char *buf, size_t buf_len) {
+    const char *name = BPF_CORE_READ(current_cgroup_kn(), name);
 
     if (name) {
         if (bpf_probe_read_kernel_str(buf, buf_len, name) < 0) {
@@ -144,10 +269,78 @@ static void ensure_cgroup_mapping(pid_t tgid) {
         if (fill_cgroup_name(proc_info.cgroup, sizeof(proc_info.cgroup)) < 0)
             return;
 
+        proc_info.cgroup_id = current_cgroup_id();
+
         bpf_map_update_elem(&pid_to_info, &tgid, &proc_info, BPF_ANY);
     }
 }
 
+static bool is_ignored_process(void) {
+    if (!(static_filters & (FILTER_COMM | FILTER_EXE | FILTER_UID)))
+        return false;
+
+    if (static_filters & FILTER_UID) {
+        u32 uid = (u32) bpf_get_current_uid_gid();
+        if (bpf_map_lookup_elem(&ignored_uids, &uid))
+            return true;
+    }
+
+    if (static_filters & FILTER_COMM) {
+        struct comm_key comm;
+        __builtin_memset(&comm, 0, sizeof(comm));
+
+        if (bpf_get_current_comm(&comm.comm, sizeof(comm.comm)) == 0 &&
+            bpf_map_lookup_elem(&ignored_comms, &comm))
+            return true;
+    }
+
+    if (static_filters & FILTER_EXE) {
+        struct task_struct *current = (struct task_struct*) bpf_get_current_task();
+        struct inode *inode = BPF_CORE_READ(current, mm, exe_file, f_inode);
+        if (!inode)
+            return false;
+
+        struct exe_key exe;
+        __builtin_memset(&exe, 0, sizeof(exe));
+        exe.ino = BPF_CORE_READ(inode, i_ino);
+        exe.dev = BPF_CORE_READ(inode, i_sb, s_dev);
+
+        if (bpf_map_lookup_elem(&ignored_exes, &exe))
+            return true;
+    }
+
+    return false;
+}
+
+// Opens of converged cgroups are dropped or sampled, execs are always reported
+static bool is_open_traced(void) {
+    u32 key = 0;
+    struct probe_config *probe_cfg = bpf_map_lookup_elem(&probe_config, &key);
+    if (!probe_cfg || !(probe_cfg->filters & FILTER_CGROUP_TIERS))
+        return true;
+
+    u64 cgroup_id = current_cgroup_id();
+    struct cgroup_config *cfg = bpf_map_lookup_elem(&cgroup_config, &cgroup_id);
+    if (!cfg)
+        return true;
+
+    switch (cfg->tier) {
+    case TIER_EXEC_ONLY:
+        return false;
+    case TIER_SAMPLED:
+        return cfg->sample_rate <= 1 || bpf_get_prandom_u32() % cfg->sample_rate == 0;
+    default:
+        return true;
+    }
+}
+
+// The flag lets the userspace drop fanotify events of the ignored processes
+static void set_ignored(pid_t tgid, bool ignored) {
+    struct process_info *info = bpf_map_lookup_elem(&pid_to_info, &tgid);
+    if (info)
+        info->ignored = ignored;
+}
+
 static int do_enter_open(const char *filename, int flags) {
     struct open_inflight_entry entry = {};
     u32 pid = (u32) bpf_get_current_pid_tgid();
@@ -159,37 +352,112 @@ static int do_enter_open(const char *filename, int flags) {
     return 0;
 }
 
+// Looks up the suffix of the filename in code_suffixes.
+// Numeric components are skipped to match versioned shared objects (libfoo.so.1.2).
+// len is the length of the filename including the NUL.
+static int lookup_suffix(const char *filename, long len) {
+    long last = len - 1;
+    bool numeric = true;
+
+#pragma unroll
+    for (int i = 1; i <= SUFFIX_SCAN; i++) {
+        long pos = len - 1 - i;
+        if (pos < 0)
+            return SUFFIX_NONE;
+
+        char c = filename[pos & (MAX_PATH - 1)];
+        if (c == '/')
+            return SUFFIX_NONE;
+
+        if (c != '.') {
+            if (c < '0' || c > '9')
+                numeric = false;
+            continue;
+        }
+
+        long slen = last - pos - 1;
+
+        if (slen > 0 && numeric) {
+            last = pos;
+            continue;
+        }
+
+        if (slen <= 0 || slen >= SUFFIX_MAX)
+            return SUFFIX_OTHER;
+
+        struct suffix_key key;
+        __builtin_memset(&key, 0, sizeof(key));
+
+        if (bpf_probe_read_kernel(key.suffix, slen & (SUFFIX_MAX - 1), filename + ((pos + 1) & (MAX_PATH - 1))) < 0)
+            return SUFFIX_OTHER;
+
+        return bpf_map_lookup_elem(&code_suffixes, &key) ? SUFFIX_MATCH : SUFFIX_OTHER;
+    }
+
+    return SUFFIX_NONE;
+}
+
+static umode_t fd_mode(int fd) {
+    struct task_struct *current = (struct task_struct*) bpf_get_current_task();
+    struct file **fds = BPF_CORE_READ(current, files, fdt, fd);
+    struct file *file = NULL;
+
+    if (bpf_probe_read_kernel(&file, sizeof(file), fds + fd) < 0 || !file)
+        return 0;
+
+    return BPF_CORE_READ(file, f_inode, i_mode);
+}
+
+// Files without a suffix are passed on for the userspace to check the magic number
+static bool is_code_file(const char *filename, long len, int fd) {
+    if (!(static_filters & FILTER_SUFFIX))
+        return true;
+
+    if (lookup_suffix(filename, len) != SUFFIX_OTHER)
+        return true;
+
+    return (fd_mode(fd) & S_IXUSR) != 0;
+}
+
+// fd is the file descriptor returned by open() or -1 for files being executed,
+// which are always reported
 __attribute__((noinline))
-static void emit_open_event(void *ctx, pid_t tgid, const char *filename, bool user) {
-    struct evt_open evt;
-    __builtin_memset(&evt, 0, sizeof(evt));
+static void emit_open_event(void *ctx, pid_t tgid, const char *filename, bool user, int fd) {
+    u32 zero = 0;
+    struct evt_open *evt = bpf_map_lookup_elem(&open_evt_scratch, &zero);
+    if (!evt)
+        return;
+
+    __builtin_memset(evt, 0, sizeof(*evt));
 
-    evt.tgid = tgid;
+    evt->tgid = tgid;
+    if (fd < 0)
+        evt->flags = EVT_OPEN_EXEC;
 
+    long len;
     if (user) {
-        if (UCOPY_STR(evt.filename, filename) < 0) {
+        len = UCOPY_STR(evt->filename, filename);
+        if (len < 0) {
             BPF_PRINTK("emit_open_event: probe_read_user_str error of %lx", (unsigned long)filename);
             return;
         }
     } else {
-        if (KCOPY_STR(evt.filename, filename) < 0) {
+        len = KCOPY_STR(evt->filename, filename);
+        if (len < 0) {
             BPF_PRINTK("emit_open_event: probe_read_kernel_str error of %lx", (unsigned long)filename);
             return;
         }
-    }  
+    }
 
     // Only care about absolute paths
-    if (!is_abs(evt.filename))
+    if (!is_abs(evt->filename))
         return;
 
-    if (bpf_core_type_exists(struct bpf_ringbuf)) {
-        if (bpf_ringbuf_output(&rb_open_events, &evt, sizeof(evt), 0) < 0) {
-            BPF_PRINTK("error sending evt_open");
-        }
-    } else {
-        if (bpf_perf_event_output(ctx, &pb_open_events, BPF_F_CURRENT_CPU, &evt, sizeof(evt)) < 0) {
-            BPF_PRINTK("error sending evt_open");
-        }
+    if (fd >= 0 && !is_code_file(evt->filename, len, fd))
+        return;
+
+    if (OUTPUT_EVENT(ctx, open_events, evt, sizeof(*evt)) < 0) {
+        BPF_PRINTK("error sending evt_open");
     }
 }
 
@@ -209,7 +477,15 @@ static int do_exit_open(void *ctx, int rc) {
 
     ensure_cgroup_mapping(tgid);
 
-    emit_open_event(ctx, tgid, entry->filename, true);
+    if (is_ignored_process()) {
+        set_ignored(tgid, true);
+        return 0;
+    }
+
+    if (!is_open_traced())
+        return 0;
+
+    emit_open_event(ctx, tgid, entry->filename, true, rc);
 
     return 0;
 }
@@ -267,12 +543,20 @@ int exit_openat2(struct trace_event_raw_sys_exit *tp) {
     return do_exit_open(tp, tp->ret);
 }
 
-SEC("kprobe/setup_new_exec")
-int BPF_KPROBE(kprobe__setup_new_exec, struct linux_binprm *bprm) {
+// The exec, cgroup and exit hooks come in two flavors: the kprobe and the
+// classic tracepoints, and tp_btf programs that get the arguments of the
+// tracepoint directly instead of parsing the formatted trace record (and
+// without the breakpoint trap of the kprobe). The userspace loads the tp_btf
+// ones when the kernel has BTF, falling back to the classic ones.
+
+static int on_exec(void *ctx, struct linux_binprm *bprm) {
     u64 pid_tgid = bpf_get_current_pid_tgid();
     pid_t tgid = (u32) (pid_tgid >> 32);
     ensure_cgroup_mapping(tgid);
 
+    // The process identity is about to change, re-evaluated on its next open
+    set_ignored(tgid, false);
+
     struct evt_open evt;
     __builtin_memset(&evt, 0, sizeof(evt));
 
@@ -282,7 +566,7 @@ int BPF_KPROBE(kprobe__setup_new_exec, struct linux_binprm *bprm) {
         return 0;
     }
 
-    emit_open_event(ctx, tgid, filename, false);
+    emit_open_event(ctx, tgid, filename, false, -1);
 
     // There are cases where the interpreter is different than the filename.
     // e.g. for bash scripts. Report both.
@@ -293,24 +577,35 @@ int BPF_KPROBE(kprobe__setup_new_exec, struct linux_binprm *bprm) {
             return 0;
         }
 
-        emit_open_event(ctx, tgid, interp, false);
+        emit_open_event(ctx, tgid, interp, false, -1);
     }
 
     return 0;
 }
 
-static int cgroup_migrate_task(struct trace_event_raw_cgroup_migrate *tp) {
-    pid_t pid = tp->pid;
+SEC("kprobe/setup_new_exec")
+int BPF_KPROBE(kprobe__setup_new_exec, struct linux_binprm *bprm) {
+    return on_exec(ctx, bprm);
+}
+
+// Right after setup_new_exec() and the rest of the exec, in the new process
+SEC("tp_btf/sched_process_exec")
+int BPF_PROG(tp_btf__sched_process_exec, struct task_struct *p, pid_t old_pid,
+             struct linux_binprm *bprm) {
+    return on_exec(ctx, bprm);
+}
+
+static int cgroup_migrate_task(pid_t pid, u64 cgroup_id, const char *cgrp) {
     struct process_info proc_info;
     __builtin_memset(&proc_info, 0, sizeof(proc_info));
 
-    const char *cgrp = (const char*) DYN_ARRAY(tp, dst_path);
-
     if (KCOPY_STR(&proc_info.cgroup, cgrp) < 0) {
         BPF_PRINTK("cgroup_migrate_task: cgroup name read failed");
         return 0;
     }
 
+    proc_info.cgroup_id = cgroup_id;
+
     bpf_map_update_elem(&pid_to_info, &pid, &proc_info, BPF_ANY);
 
     return 0;
@@ -318,16 +613,68 @@ static int cgroup_migrate_task(struct trace_event_raw_cgroup_migrate *tp) {
 
 SEC("tp/cgroup/cgroup_attach_task")
 int cgroup_attach_task(struct trace_event_raw_cgroup_migrate *tp) {
-    return cgroup_migrate_task(tp);
+    return cgroup_migrate_task(tp->pid, tp->dst_id, (const char*) DYN_ARRAY(tp, dst_path));
 }
 
 SEC("tp/cgroup/cgroup_transfer_tasks")
 int cgroup_transfer_tasks(struct trace_event_raw_cgroup_migrate *tp) {
-    return cgroup_migrate_task(tp);
+    return cgroup_migrate_task(tp->pid, tp->dst_id, (const char*) DYN_ARRAY(tp, dst_path));
 }
 
-SEC("tp/sched/sched_process_exit")
-int sched_process_exit(struct trace_event_raw_sched_process_template *tp) {
+// The same fields as the trace record: task->pid, cgroup_id(dst_cgrp) and the path
+SEC("tp_btf/cgroup_attach_task")
+int BPF_PROG(tp_btf__cgroup_attach_task, struct cgroup *dst_cgrp, const char *path,
+             struct task_struct *task, bool threadgroup) {
+    return cgroup_migrate_task(BPF_CORE_READ(task, pid), BPF_CORE_READ(dst_cgrp, kn, id), path);
+}
+
+SEC("tp_btf/cgroup_transfer_tasks")
+int BPF_PROG(tp_btf__cgroup_transfer_tasks, struct cgroup *dst_cgrp, const char *path,
+             struct task_struct *task, bool threadgroup) {
+    return cgroup_migrate_task(BPF_CORE_READ(task, pid), BPF_CORE_READ(dst_cgrp, kn, id), path);
+}
+
+// Lets the userspace know about a new container before the runtime does
+static int emit_cgroup_event(void *ctx, u64 id, const char *path, u32 kind) {
+    struct evt_cgroup evt;
+    __builtin_memset(&evt, 0, sizeof(evt));
+
+    evt.id = id;
+    evt.kind = kind;
+
+    if (KCOPY_STR(evt.path, path) < 0) {
+        BPF_PRINTK("emit_cgroup_event: cgroup path read failed");
+        return 0;
+    }
+
+    if (OUTPUT_EVENT(ctx, cgroup_events, &evt, sizeof(evt)) < 0) {
+        BPF_PRINTK("error sending evt_cgroup");
+    }
+
+    return 0;
+}
+
+SEC("tp/cgroup/cgroup_mkdir")
+int cgroup_mkdir(struct trace_event_raw_cgroup *tp) {
+    return emit_cgroup_event(tp, tp->id, (const char*) DYN_ARRAY(tp, path), CGROUP_MKDIR);
+}
+
+SEC("tp/cgroup/cgroup_rmdir")
+int cgroup_rmdir(struct trace_event_raw_cgroup *tp) {
+    return emit_cgroup_event(tp, tp->id, (const char*) DYN_ARRAY(tp, path), CGROUP_RMDIR);
+}
+
+SEC("tp_btf/cgroup_mkdir")
+int BPF_PROG(tp_btf__cgroup_mkdir, struct cgroup *cgrp, const char *path) {
+    return emit_cgroup_event(ctx, BPF_CORE_READ(cgrp, kn, id), path, CGROUP_MKDIR);
+}
+
+SEC("tp_btf/cgroup_rmdir")
+int BPF_PROG(tp_btf__cgroup_rmdir, struct cgroup *cgrp, const char *path) {
+    return emit_cgroup_event(ctx, BPF_CORE_READ(cgrp, kn, id), path, CGROUP_RMDIR);
+}
+
+static int on_process_exit(void *ctx) {
     u64 pid_tgid = bpf_get_current_pid_tgid();
     pid_t tgid = pid_tgid >> 32;
     pid_t pid = (pid_t)pid_tgid;
@@ -346,19 +693,23 @@ int sched_process_exit(struct trace_event_raw_sched_process_template *tp) {
 
     // Notify the userspace that a process exited so it has a chance to clean up
     // the pid_to_info map.
-    if (bpf_core_type_exists(struct bpf_ringbuf)) {
-        if (bpf_ringbuf_output(&rb_zombie_events, &pid, sizeof(pid), 0) < 0) {
-            BPF_PRINTK("error sending zombie event");
-        }
-    } else {
-        if (bpf_perf_event_output(tp, &pb_zombie_events, BPF_F_CURRENT_CPU, &pid, sizeof(pid)) < 0) {
-            BPF_PRINTK("error sending zombie event");
-        }
+    if (OUTPUT_EVENT(ctx, zombie_events, &pid, sizeof(pid)) < 0) {
+        BPF_PRINTK("error sending zombie event");
     }
 
     return 0;
 }
 
+SEC("tp/sched/sched_process_exit")
+int sched_process_exit(struct trace_event_raw_sched_process_template *tp) {
+    return on_process_exit(tp);
+}
+
+SEC("tp_btf/sched_process_exit")
+int BPF_PROG(tp_btf__sched_process_exit, struct task_struct *p) {
+    return on_process_exit(ctx);
+}
+
 SEC("kprobe/fsnotify")
 int BPF_KPROBE(fsnotify) {
     u64 pid_tgid = bpf_get_current_pid_tgid();
@@ -369,3 +720,41 @@ int BPF_KPROBE(fsnotify) {
     return 0;
 }
 
+static long apply_command(struct bpf_dynptr *dynptr, void *ctx) {
+    struct ctl_cmd cmd;
+    if (bpf_dynptr_read(&cmd, sizeof(cmd), dynptr, 0, 0) < 0) {
+        BPF_PRINTK("apply_command: short command");
+        return 0;
+    }
+
+    u32 key = 0;
+    struct probe_config probe_cfg = { .filters = cmd.filters };
+
+    switch (cmd.kind) {
+    case CTL_REMOVE_PID:
+        bpf_map_delete_elem(&pid_to_info, &cmd.pid);
+        break;
+    case CTL_SET_CGROUP_CONFIG:
+        bpf_map_update_elem(&cgroup_config, &cmd.cgroup_id, &cmd.cfg, BPF_ANY);
+        break;
+    case CTL_DELETE_CGROUP_CONFIG:
+        bpf_map_delete_elem(&cgroup_config, &cmd.cgroup_id);
+        break;
+    case CTL_SET_FILTERS:
+        bpf_map_update_elem(&probe_config, &key, &probe_cfg, BPF_ANY);
+        break;
+    default:
+        BPF_PRINTK("apply_command: unknown command");
+    }
+
+    return 0;
+}
+
+// Run by the userspace (BPF_PROG_TEST_RUN) once per batch of commands instead
+// of a syscall per map update. The commands of a batch are applied in order,
+// back to back. Returns the number of commands drained.
+SEC("syscall")
+int drain_control(void *ctx) {
+    long drained = bpf_user_ringbuf_drain(&control_commands, apply_command, NULL, 0);
+    return drained < 0 ? 0 : drained;
+}
@@ -0,0 +1,90 @@
+#if defined(__TARGET_ARCH_x86)
+#    include "vmlinux-x86_64.h"
+#elif defined(__TARGET_ARCH_arm64)
+#    include "vmlinux-aarch64.h"
+#else
+#    error "Unsupported architecture"
+#endif
+
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+
+#include "maps.h"
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
+
+#define CGROUP_NAME_MAX 255
+#define PATH_MAX_LEN 512
+#define VM_EXEC 0x00000004
+
+// One per executable file mapping, read back as the iterator output.
+// Must match VmaRecord in mappings.rs.
+struct vma_record {
+    u32 pid;
+    u32 pad;
+    u64 cgroup_id;
+    char cgroup[CGROUP_NAME_MAX + 1];
+    char path[PATH_MAX_LEN];
+};
+
+struct scratch {
+    // The mappings of a file are mostly adjacent, emit it once per run.
+    // Per process: a forked child shares the struct file of its parent.
+    struct file *last_file;
+    u32 last_tgid;
+    struct vma_record rec;
+};
+
+BPF_PERCPU_ARRAY(scratch, struct scratch, 1);
+
+// Walks the VMAs of all the tasks (see the mappings sampling engine)
+SEC("iter/task_vma")
+int sample_exec_mappings(struct bpf_iter__task_vma *ctx) {
+    struct seq_file *seq = ctx->meta->seq;
+    struct task_struct *task = ctx->task;
+    struct vm_area_struct *vma = ctx->vma;
+
+    if (!task || !vma)
+        return 0;
+
+    // Threads share the mappings of the group leader
+    if (task->tgid != task->pid)
+        return 0;
+
+    struct file *file = vma->vm_file;
+    if (!file || !(vma->vm_flags & VM_EXEC))
+        return 0;
+
+    u32 zero = 0;
+    struct scratch *s = bpf_map_lookup_elem(&scratch, &zero);
+    if (!s)
+        return 0;
+
+    // The per-CPU scratch outlives the iteration, a new one starts afresh
+    if (ctx->meta->seq_num == 0 || s->last_tgid != task->tgid) {
+        s->last_tgid = task->tgid;
+        s->last_file = NULL;
+    }
+
+    if (s->last_file == file)
+        return 0;
+
+    s->last_file = file;
+
+    struct vma_record *rec = &s->rec;
+    rec->pid = task->tgid;
+
+    // The same cgroup as the open probes report (see current_cgroup_kn())
+    struct kernfs_node *kn = BPF_CORE_READ(task, cgroups, subsys[0], cgroup, kn);
+    rec->cgroup_id = BPF_CORE_READ(kn, id);
+
+    const char *name = BPF_CORE_READ(kn, name);
+    if (!name || bpf_probe_read_kernel_str(rec->cgroup, sizeof(rec->cgroup), name) < 0)
+        rec->cgroup[0] = '\0';
+
+    if (bpf_d_path(&file->f_path, rec->path, sizeof(rec->path)) < 0)
+        return 0;
+
+    bpf_seq_write(seq, rec, sizeof(*rec));
+    return 0;
+}
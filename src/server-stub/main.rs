@@ -1,4 +1,5 @@
-use std::sync::Arc;
+use std::collections::HashMap;
+use std::sync::{Arc, Mutex};
 use std::time::{Duration, SystemTime};
 
 use anyhow::Result;
@@ -11,10 +12,15 @@ pub mod pb {
 }
 
 use pb::inventory_service_server::{InventoryService, InventoryServiceServer};
+use pb::sbom_service_server::{SbomService, SbomServiceServer};
 use pb::token_service_server::{TokenService, TokenServiceServer};
+use pb::usage_service_server::{UsageService, UsageServiceServer};
 
 #[derive(Debug, Default)]
-pub struct Service {}
+pub struct Service {
+    // content hash -> image id
+    sboms: Mutex<HashMap<String, String>>,
+}
 
 #[tonic::async_trait]
 impl TokenService for Service {
@@ -149,6 +155,61 @@ impl InventoryService for Service {
     }
 }
 
+#[tonic::async_trait]
+impl UsageService for Service {
+    async fn report_binary_ids(
+        &self,
+        request: Request<pb::ReportBinaryIdsRequest>,
+    ) -> Result<Response<pb::ReportBinaryIdsResponse>, Status> {
+        println!("report_binary_ids: {:?}", request.into_inner());
+        Ok(Response::new(pb::ReportBinaryIdsResponse {}))
+    }
+
+    async fn report_usage_summary(
+        &self,
+        request: Request<pb::ReportUsageSummaryRequest>,
+    ) -> Result<Response<pb::ReportUsageSummaryResponse>, Status> {
+        println!("report_usage_summary: {:?}", request.into_inner());
+        Ok(Response::new(pb::ReportUsageSummaryResponse {}))
+    }
+}
+
+#[tonic::async_trait]
+impl SbomService for Service {
+    async fn lookup_sbom(
+        &self,
+        request: Request<pb::LookupSbomRequest>,
+    ) -> Result<Response<pb::LookupSbomResponse>, Status> {
+        let req = request.into_inner();
+        println!("lookup_sbom: {req:?}");
+
+        let image_id = self
+            .sboms
+            .lock()
+            .unwrap()
+            .get(&req.content_hash)
+            .cloned()
+            .unwrap_or_default();
+
+        Ok(Response::new(pb::LookupSbomResponse { image_id }))
+    }
+
+    async fn record_sbom(
+        &self,
+        request: Request<pb::RecordSbomRequest>,
+    ) -> Result<Response<pb::RecordSbomResponse>, Status> {
+        let req = request.into_inner();
+        println!("record_sbom: {req:?}");
+
+        self.sboms
+            .lock()
+            .unwrap()
+            .insert(req.content_hash, req.image_id);
+
+        Ok(Response::new(pb::RecordSbomResponse {}))
+    }
+}
+
 #[tokio::main]
 async fn main() -> Result<(), Box<dyn std::error::Error>> {
     let addr = "0.0.0.0:7777".parse()?;
@@ -157,6 +218,8 @@ async fn main() -> Result<(), Box<dyn std::error::Error>> {
     Server::builder()
         .add_service(TokenServiceServer::from_arc(svc.clone()))
         .add_service(InventoryServiceServer::from_arc(svc.clone()))
+        .add_service(UsageServiceServer::from_arc(svc.clone()))
+        .add_service(SbomServiceServer::from_arc(svc.clone()))
         .serve(addr)
         .await?;
 